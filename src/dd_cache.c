@@ -0,0 +1,30 @@
+/*
+  ddless: page cache control
+*/
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include "dd_cache.h"
+
+//
+// write the range back and wait for it
+//
+void dd_cache_sync(int fd, off64_t offset, off64_t bytes)
+{
+	#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd, offset, bytes,
+		SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	#endif
+}
+
+//
+// drop the range from the page cache
+//
+void dd_cache_drop(int fd, off64_t offset, off64_t bytes)
+{
+	#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise64(fd, offset, bytes, POSIX_FADV_DONTNEED);
+	#endif
+}
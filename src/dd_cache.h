@@ -0,0 +1,19 @@
+/*
+  ddless: page cache control
+*/
+#ifndef DD_CACHE_INCLUDED
+#define DD_CACHE_INCLUDED
+
+//
+// dd_cache.c includes <fcntl.h> for the flags of sync_file_range and
+// posix_fadvise, which clashes with the <asm/fcntl.h> of ddless.h
+//
+#ifndef _LARGEFILE64_SOURCE
+	#define _LARGEFILE64_SOURCE
+#endif
+#include <sys/types.h>
+
+void dd_cache_sync(int fd, off64_t offset, off64_t bytes);
+void dd_cache_drop(int fd, off64_t offset, off64_t bytes);
+
+#endif
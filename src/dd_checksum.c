@@ -0,0 +1,458 @@
+/*
+  ddless: checksum file formats (raw and compact)
+
+  Thin provisioned volumes are mostly zero segments, the compact format
+  stores runs of zero and unwritten checksums as a count. A compact file is
+  expanded into memory when loaded, so segment lookups remain an index into
+  an array, and re-encoded as a whole when saved (tmp file and rename, a
+  crash leaves the previous version).
+*/
+#include "dd_checksum.h"
+#include "dd_zero.h"
+#include "dd_log.h"
+#include "dd_file.h"
+
+#define CHECKSUM_WRITE_BUFFER	(1024*1024)
+#define CHECKSUM_RUN_MAX	0xffffffffULL
+
+//-----------------------------------------------------------------------------
+// classify a checksum for the run length encoding
+//-----------------------------------------------------------------------------
+static inline int checksum_kind(checksum_struct *checksum)
+{
+	if ( checksum->checksum1_murmur == ZERO_CHECKSUM1_MURMUR &&
+		checksum->checksum2_crc32 == ZERO_CHECKSUM2_CRC32 )
+		return CHECKSUM_RUN_ZERO;
+	if ( checksum->checksum1_murmur == 0 && checksum->checksum2_crc32 == 0 )
+		return CHECKSUM_RUN_SPARSE;
+	return CHECKSUM_RUN_LITERAL;
+}
+
+//-----------------------------------------------------------------------------
+// read exactly bytes at offset
+//-----------------------------------------------------------------------------
+static int checksum_read(int fd, void *buf, u_int64_t bytes, u_int64_t offset)
+{
+	ssize_t read_bytes;
+	u_int64_t done = 0;
+
+	while ( done < bytes )
+	{
+		if ((read_bytes = pread64(fd, (char *)buf + done, bytes - done, offset + done)) <= 0 )
+			return -1;
+		done += read_bytes;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// is the checksum file in the compact format?
+//-----------------------------------------------------------------------------
+int dd_checksum_is_compact(char *checksum_file)
+{
+	int fd;
+	char magic[8];
+	int compact = 0;
+
+	if ((fd = open(checksum_file, O_RDONLY|O_LARGEFILE)) == -1 )
+		return 0;
+	if ( pread64(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		memcmp(magic, CHECKSUM_COMPACT_MAGIC, sizeof(magic)) == 0 )
+		compact = 1;
+	close(fd);
+	return compact;
+}
+
+//-----------------------------------------------------------------------------
+// number of segments described by a checksum file of either format
+//-----------------------------------------------------------------------------
+int64_t dd_checksum_segments(char *checksum_file)
+{
+	int fd;
+	checksum_compact_header header;
+
+	if ( !dd_checksum_is_compact(checksum_file) )
+		return dd_file_size(checksum_file) / sizeof(checksum_struct);
+
+	if ((fd = open(checksum_file, O_RDONLY|O_LARGEFILE)) == -1 )
+		return -1;
+	if ( checksum_read(fd, &header, sizeof(header), 0) == -1 )
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return header.segments;
+}
+
+//-----------------------------------------------------------------------------
+// load a checksum file of either format into a malloc'd array
+//-----------------------------------------------------------------------------
+checksum_struct *dd_checksum_load(char *checksum_file, u_int64_t *segments)
+{
+	int fd;
+	off64_t size;
+	checksum_struct *array = NULL;
+	char *data = NULL;
+
+	if ((fd = open(checksum_file, O_RDONLY|O_LARGEFILE)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open checksum file: %s", checksum_file);
+		return NULL;
+	}
+	if ((size = dd_device_size(fd)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to determine checksum file %s size", checksum_file);
+		goto err;
+	}
+
+	//
+	// raw, read it as is
+	//
+	if ( !dd_checksum_is_compact(checksum_file) )
+	{
+		*segments = size / sizeof(checksum_struct);
+		if ((array = malloc(*segments * sizeof(checksum_struct) + 1)) == NULL )
+		{
+			dd_log(LOG_ERR, "unable to allocate %llu checksums", *segments);
+			goto err;
+		}
+		if ( checksum_read(fd, array, *segments * sizeof(checksum_struct), 0) == -1 )
+		{
+			dd_log(LOG_ERR, "unable to read checksum file: %s", checksum_file);
+			goto err;
+		}
+		close(fd);
+		return array;
+	}
+
+	//
+	// compact, expand the runs
+	//
+	if ((data = malloc(size)) == NULL ||
+		checksum_read(fd, data, size, 0) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to read checksum file: %s", checksum_file);
+		goto err;
+	}
+
+	checksum_compact_header *header = (checksum_compact_header *)data;
+	u_int64_t pos = sizeof(checksum_compact_header);
+	u_int64_t segment = 0, run;
+	checksum_struct zero = { ZERO_CHECKSUM1_MURMUR, ZERO_CHECKSUM2_CRC32 };
+
+	if ( size < sizeof(checksum_compact_header) ||
+		(array = calloc(header->segments + 1, sizeof(checksum_struct))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate checksums of %s", checksum_file);
+		goto err;
+	}
+	for (run = 0; run < header->runs; run++)
+	{
+		checksum_run *r = (checksum_run *)(data + pos);
+		u_int64_t i;
+
+		if ( pos + sizeof(checksum_run) > size ||
+			segment + r->count > header->segments )
+			break;
+		pos += sizeof(checksum_run);
+
+		switch ( r->kind )
+		{
+			case CHECKSUM_RUN_ZERO:
+				for (i = 0; i < r->count; i++)
+					array[segment + i] = zero;
+				break;
+			case CHECKSUM_RUN_SPARSE:
+				break;
+			case CHECKSUM_RUN_LITERAL:
+				if ( pos + r->count * sizeof(checksum_struct) > size )
+					goto broken;
+				memcpy(array + segment, data + pos, r->count * sizeof(checksum_struct));
+				pos += r->count * sizeof(checksum_struct);
+				break;
+			default:
+				goto broken;
+		}
+		segment += r->count;
+	}
+	if ( segment != header->segments )
+	{
+broken:
+		dd_log(LOG_ERR, "compact checksum file %s is broken (run %llu, segment %llu)",
+			checksum_file, run, segment);
+		goto err;
+	}
+	dd_log(LOG_DEBUG, "expanded %llu runs into %llu checksums", header->runs, segment);
+
+	*segments = header->segments;
+	free(data);
+	close(fd);
+	return array;
+
+err:
+	free(data);
+	free(array);
+	close(fd);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// open a checksum file of either format for sequential reading
+//-----------------------------------------------------------------------------
+int dd_checksum_open(dd_checksum_reader *reader, char *checksum_file)
+{
+	checksum_compact_header header;
+	off64_t size;
+
+	memset(reader, 0, sizeof(dd_checksum_reader));
+	if ((reader->fd = open(checksum_file, O_RDONLY|O_LARGEFILE)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open checksum file: %s", checksum_file);
+		return -1;
+	}
+	if ((size = dd_device_size(reader->fd)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to determine checksum file %s size", checksum_file);
+		close(reader->fd);
+		return -1;
+	}
+	reader->size = size;
+	reader->segments = size / sizeof(checksum_struct);
+
+	if ( dd_checksum_is_compact(checksum_file) )
+	{
+		if ( checksum_read(reader->fd, &header, sizeof(header), 0) == -1 )
+		{
+			dd_log(LOG_ERR, "unable to read checksum file: %s", checksum_file);
+			close(reader->fd);
+			return -1;
+		}
+		reader->compact = 1;
+		reader->segments = header.segments;
+		reader->runs_left = header.runs;
+		reader->offset = sizeof(header);
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// read up to max checksums, returns 0 at the end of the file
+//-----------------------------------------------------------------------------
+int64_t dd_checksum_next(dd_checksum_reader *reader, checksum_struct *buf, u_int64_t max)
+{
+	checksum_struct zero = { ZERO_CHECKSUM1_MURMUR, ZERO_CHECKSUM2_CRC32 };
+	u_int64_t got = 0, n, i;
+
+	if ( !reader->compact )
+	{
+		n = (reader->size - reader->offset) / sizeof(checksum_struct);
+		if ( n > max )
+			n = max;
+		if ( n && checksum_read(reader->fd, buf, n * sizeof(checksum_struct), reader->offset) == -1 )
+		{
+			dd_log(LOG_ERR, "unable to read checksums at %llu", reader->offset);
+			return -1;
+		}
+		reader->offset += n * sizeof(checksum_struct);
+		return n;
+	}
+
+	while ( got < max )
+	{
+		if ( reader->run_left == 0 )
+		{
+			checksum_run r;
+
+			if ( reader->runs_left == 0 )
+				break;
+			if ( checksum_read(reader->fd, &r, sizeof(r), reader->offset) == -1 )
+			{
+				dd_log(LOG_ERR, "compact checksum run at %llu is broken", reader->offset);
+				return -1;
+			}
+			reader->offset += sizeof(r);
+			reader->runs_left--;
+			reader->run_kind = r.kind;
+			reader->run_left = r.count;
+			continue;
+		}
+
+		n = reader->run_left < max - got ? reader->run_left : max - got;
+		switch ( reader->run_kind )
+		{
+			case CHECKSUM_RUN_ZERO:
+				for (i = 0; i < n; i++)
+					buf[got + i] = zero;
+				break;
+			case CHECKSUM_RUN_SPARSE:
+				memset(buf + got, 0, n * sizeof(checksum_struct));
+				break;
+			case CHECKSUM_RUN_LITERAL:
+				if ( checksum_read(reader->fd, buf + got, n * sizeof(checksum_struct), reader->offset) == -1 )
+				{
+					dd_log(LOG_ERR, "unable to read checksums at %llu", reader->offset);
+					return -1;
+				}
+				reader->offset += n * sizeof(checksum_struct);
+				break;
+			default:
+				dd_log(LOG_ERR, "compact checksum run kind %u is unknown", reader->run_kind);
+				return -1;
+		}
+		reader->run_left -= n;
+		got += n;
+	}
+	return got;
+}
+
+//-----------------------------------------------------------------------------
+void dd_checksum_close(dd_checksum_reader *reader)
+{
+	close(reader->fd);
+	reader->fd = -1;
+}
+
+//-----------------------------------------------------------------------------
+// grow or shrink a loaded array, new segments are unwritten (0/0)
+//-----------------------------------------------------------------------------
+checksum_struct *dd_checksum_resize(checksum_struct *array, u_int64_t old_segments,
+	u_int64_t segments)
+{
+	if ((array = realloc(array, segments * sizeof(checksum_struct) + 1)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to resize checksums to %llu segments", segments);
+		return NULL;
+	}
+	if ( segments > old_segments )
+		memset(array + old_segments, 0, (segments - old_segments) * sizeof(checksum_struct));
+	return array;
+}
+
+//-----------------------------------------------------------------------------
+// buffered writer for the compact encoding
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	int		fd;
+	char		*buffer;
+	u_int64_t	used;
+	u_int64_t	runs;
+} checksum_writer;
+
+static int writer_put(checksum_writer *w, void *data, u_int64_t bytes)
+{
+	while ( bytes > 0 )
+	{
+		u_int64_t n = CHECKSUM_WRITE_BUFFER - w->used;
+		if ( n > bytes )
+			n = bytes;
+		memcpy(w->buffer + w->used, data, n);
+		w->used += n;
+		data = (char *)data + n;
+		bytes -= n;
+
+		if ( w->used == CHECKSUM_WRITE_BUFFER )
+		{
+			if ( write(w->fd, w->buffer, w->used) != w->used )
+				return -1;
+			w->used = 0;
+		}
+	}
+	return 0;
+}
+
+static int writer_run(checksum_writer *w, checksum_struct *array, int kind, u_int64_t count)
+{
+	checksum_run r;
+
+	r.kind = kind;
+	r.count = count;
+	w->runs++;
+	if ( writer_put(w, &r, sizeof(r)) == -1 )
+		return -1;
+	if ( kind == CHECKSUM_RUN_LITERAL )
+		return writer_put(w, array, count * sizeof(checksum_struct));
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// save the array in the given format, replacing the checksum file
+//-----------------------------------------------------------------------------
+int dd_checksum_save(char *checksum_file, checksum_struct *array, u_int64_t segments,
+	int compact)
+{
+	char tmp_file[DEV_NAME_LENGTH + sizeof(".tmp")];
+	checksum_writer w;
+	checksum_compact_header header;
+	u_int64_t i, n;
+
+	if ( snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", checksum_file) >= sizeof(tmp_file) )
+	{
+		dd_log(LOG_ERR, "temporary file name of %s is too long", checksum_file);
+		return -1;
+	}
+	memset(&w, 0, sizeof(w));
+	if ((w.buffer = malloc(CHECKSUM_WRITE_BUFFER)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate checksum write buffer");
+		return -1;
+	}
+	if ((w.fd = open(tmp_file, O_CREAT|O_TRUNC|O_WRONLY|O_LARGEFILE, (mode_t)0600)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to create checksum file: %s", tmp_file);
+		free(w.buffer);
+		return -1;
+	}
+
+	if ( !compact )
+	{
+		if ( writer_put(&w, array, segments * sizeof(checksum_struct)) == -1 )
+			goto err;
+	}
+	else
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CHECKSUM_COMPACT_MAGIC, sizeof(header.magic));
+		if ( writer_put(&w, &header, sizeof(header)) == -1 )
+			goto err;
+
+		for (i = 0; i < segments; i += n)
+		{
+			int kind = checksum_kind(array + i);
+			for (n = 1; i + n < segments && n < CHECKSUM_RUN_MAX &&
+				checksum_kind(array + i + n) == kind; n++)
+				;
+			if ( writer_run(&w, array + i, kind, n) == -1 )
+				goto err;
+		}
+		header.segments = segments;
+		header.runs = w.runs;
+	}
+
+	if ( w.used && write(w.fd, w.buffer, w.used) != w.used )
+		goto err;
+	if ( compact && pwrite64(w.fd, &header, sizeof(header), 0) != sizeof(header) )
+		goto err;
+	if ( fsync(w.fd) )
+		goto err;
+	close(w.fd);
+	free(w.buffer);
+
+	if ( rename(tmp_file, checksum_file) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to rename %s to %s", tmp_file, checksum_file);
+		unlink(tmp_file);
+		return -1;
+	}
+	dd_log(LOG_INFO, "saved %llu checksums to %s (%s, %llu runs)", segments, checksum_file,
+		compact ? "compact" : "raw", w.runs);
+	return 0;
+
+err:
+	dd_log(LOG_ERR, "unable to write checksum file: %s", tmp_file);
+	close(w.fd);
+	unlink(tmp_file);
+	free(w.buffer);
+	return -1;
+}
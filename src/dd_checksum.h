@@ -0,0 +1,61 @@
+/*
+  ddless: checksum file formats (raw and compact)
+*/
+#ifndef DD_CHECKSUM_INCLUDED
+#define DD_CHECKSUM_INCLUDED
+
+#include "ddless.h"
+
+//
+// The raw format is an array of checksum_struct, one per segment. The
+// compact format is a header followed by runs: zero segments and segments
+// never written (0/0, sparse) are stored as a count, anything else as a
+// count followed by the checksums themselves.
+//
+#define CHECKSUM_COMPACT_MAGIC	"ddchkz01"
+
+#define CHECKSUM_RUN_ZERO	0	// ZERO_CHECKSUM1_MURMUR/ZERO_CHECKSUM2_CRC32
+#define CHECKSUM_RUN_SPARSE	1	// 0/0, segment not checksummed yet
+#define CHECKSUM_RUN_LITERAL	2	// count checksum_structs follow
+
+typedef struct
+{
+	char		magic[8];
+	u_int64_t	segments;
+	u_int64_t	runs;
+} checksum_compact_header;
+
+typedef struct
+{
+	u_int32_t	kind;
+	u_int32_t	count;
+} checksum_run;
+
+//
+// sequential reader of either format for files too large to load, compact
+// runs are expanded into the caller's buffer
+//
+typedef struct
+{
+	int		fd;
+	int		compact;
+	u_int64_t	offset;		// file offset of the next read
+	u_int64_t	size;
+	u_int64_t	segments;
+	u_int64_t	runs_left;
+	u_int32_t	run_kind;
+	u_int64_t	run_left;	// segments left in the current run
+} dd_checksum_reader;
+
+int dd_checksum_is_compact(char *checksum_file);
+int64_t dd_checksum_segments(char *checksum_file);
+checksum_struct *dd_checksum_load(char *checksum_file, u_int64_t *segments);
+checksum_struct *dd_checksum_resize(checksum_struct *array, u_int64_t old_segments,
+	u_int64_t segments);
+int dd_checksum_open(dd_checksum_reader *reader, char *checksum_file);
+int64_t dd_checksum_next(dd_checksum_reader *reader, checksum_struct *buf, u_int64_t max);
+void dd_checksum_close(dd_checksum_reader *reader);
+int dd_checksum_save(char *checksum_file, checksum_struct *array, u_int64_t segments,
+	int compact);
+
+#endif
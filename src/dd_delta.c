@@ -0,0 +1,334 @@
+/*
+  ddless: delta file records
+
+  A delta record is the target offset, the payload size and the payload
+  (zipped when DDFLAG_COMPRESSED is set). Copy records (DDFLAG_ROLLING) carry
+  DELTA_COPY_RECORD in the size and the offset of the data in the old target
+  instead of a payload. With DDFLAG_CHECKSUMS a data record is followed by
+  the number of segments it covers and their checksum_structs, so apply
+  does not need to hash what it writes. With DDFLAG_RECORDCRC every record
+  ends in a u64 holding the crc32 of all its bytes before it.
+
+  The reader does not seek, so a delta can be applied while it arrives on
+  a pipe. The footer is only known once the records run out: it is the
+  last sizeof(delta_footer) bytes before end of file. A delta file can
+  instead be mapped: records are parsed in place and payloads handed out
+  as pointers into the mapping, every access is checked against its end.
+*/
+#include "dd_delta.h"
+#include "dd_log.h"
+#include "dd_stats.h"
+
+//-----------------------------------------------------------------------------
+// write all bytes or fail, with -I the bytes count into the record crc
+//-----------------------------------------------------------------------------
+static u_int32_t record_crc;
+
+static int delta_write(parms_struct *parms, void *buf, u_int64_t bytes)
+{
+	ssize_t bytes_written;
+	u_int64_t phase_ns;
+
+	if ( parms->recordcrcflag > 0 )
+		record_crc = crc32(record_crc, buf, bytes);
+
+	phase_ns = dd_stats_begin();
+	if ((bytes_written = write(parms->delta_fd, buf, bytes)) == -1)
+	{
+		dd_log(LOG_ERR,"delta write failed");
+		return -1;
+	}
+	dd_stats_end(DD_PHASE_WRITE, phase_ns, bytes_written);
+	if ( bytes_written != bytes )
+	{
+		dd_log(LOG_ERR,"encountered a short write on delta");
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// close a record with its crc (DDFLAG_RECORDCRC)
+//-----------------------------------------------------------------------------
+static void delta_write_crc(parms_struct *parms)
+{
+	u_int64_t crc = record_crc;
+
+	if ( parms->recordcrcflag > 0 &&
+		delta_write(parms, (void *)&crc, sizeof(crc)) == -1 )
+	{
+		dd_log(LOG_ERR,"delta: failed to write record crc");
+		exit(1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// write a data record, zipped if requested, followed by the checksums of
+// its segments if the delta carries them
+//-----------------------------------------------------------------------------
+int dd_delta_write_record(parms_struct *parms, u_int64_t write_offset,
+	void *buf, u_int64_t bytes, checksum_struct *checksums)
+{
+	record_crc = crc32(0L, Z_NULL, 0);
+	if ( delta_write(parms, (void *)&write_offset, sizeof(write_offset)) == -1 )
+	{
+		dd_log(LOG_ERR,"delta: failed to write segment_write_offset");
+		exit(1);
+	}
+
+	parms->delta_size += bytes;
+	fprintf(parms->delta_info_fd, "Writing %llu bytes - completion %5.2f%%\n",
+		(long long unsigned)bytes, 100*(float)write_offset /(float)parms->source_size_bytes);
+
+	if ( parms->compressedflag > 0 )
+	{
+		int delta_ret;
+		uLongf bound = compressBound(bytes);
+		u_int64_t phase_ns = dd_stats_begin();
+
+		if ((delta_ret = compress2 ((Bytef *)parms->zipbuffer, &bound, buf, bytes, parms->ziplevel)) != Z_OK)
+		{
+			dd_log(LOG_ERR,"compress delta: failed to compress buffer - %d", delta_ret);
+			exit(1);
+		}
+		dd_stats_end(DD_PHASE_COMPRESS, phase_ns, bytes);
+		dd_log(LOG_INFO, "compressed %ld bytes into %ld - rate %.2f", bytes, bound, 100 * (float)bound/(float)bytes);
+
+		parms->delta_zip_size += bound;
+
+		u_int64_t compress_bytes_write = bound;
+		if ( delta_write(parms, (void *)&compress_bytes_write, sizeof(compress_bytes_write)) == -1 )
+		{
+			dd_log(LOG_ERR,"compress delta: failed to write buffer size (measured in BYTES units)");
+			exit(1);
+		}
+		if ( delta_write(parms, parms->zipbuffer, compress_bytes_write) == -1 )
+		{
+			dd_log(LOG_ERR,"compress delta: buffer write failed");
+			exit(1);
+		}
+	}
+	else
+	{
+		if ( delta_write(parms, (void *)&bytes, sizeof(bytes)) == -1 )
+		{
+			dd_log(LOG_ERR,"delta: failed to write buffer_write_size (measured in SEGMENT_SIZE units)");
+			exit(1);
+		}
+		if ( delta_write(parms, buf, bytes) == -1 )
+		{
+			exit(1);
+		}
+		dd_log(LOG_DEBUG,"delta record offset:%llu bytes:%llu", write_offset, bytes);
+	}
+
+	if ( parms->checksumsflag > 0 )
+	{
+		u_int64_t count = (bytes + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+
+		if ( delta_write(parms, (void *)&count, sizeof(count)) == -1 ||
+			delta_write(parms, checksums, count * sizeof(checksum_struct)) == -1 )
+		{
+			dd_log(LOG_ERR,"delta: failed to write record checksums");
+			exit(1);
+		}
+	}
+	delta_write_crc(parms);
+
+	parms->delta_writes++;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// write a copy record, the data is taken from the old target at copy_offset
+//-----------------------------------------------------------------------------
+int dd_delta_write_copy(parms_struct *parms, u_int64_t write_offset,
+	u_int64_t copy_offset, u_int64_t bytes)
+{
+	u_int64_t record[3];
+
+	record[0] = write_offset;
+	record[1] = bytes | DELTA_COPY_RECORD;
+	record[2] = copy_offset;
+	record_crc = crc32(0L, Z_NULL, 0);
+	if ( delta_write(parms, (void *)record, sizeof(record)) == -1 )
+	{
+		dd_log(LOG_ERR,"delta: failed to write copy record");
+		exit(1);
+	}
+	delta_write_crc(parms);
+	fprintf(parms->delta_info_fd, "Copying %llu bytes from %llu - completion %5.2f%%\n",
+		(long long unsigned)bytes, (long long unsigned)copy_offset,
+		100*(float)write_offset /(float)parms->source_size_bytes);
+	dd_log(LOG_DEBUG,"delta copy record offset:%llu from:%llu bytes:%llu",
+		write_offset, copy_offset, bytes);
+
+	parms->delta_writes++;
+	parms->delta_copy_size += bytes;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// reader: fd positioned at offset
+//-----------------------------------------------------------------------------
+int dd_delta_reader_init(dd_delta_reader *reader, int fd, u_int64_t offset)
+{
+	memset(reader, 0, sizeof(dd_delta_reader));
+	reader->fd = fd;
+	reader->offset = offset;
+	if ((reader->buffer = malloc(DELTA_READER_BUFFER)) == NULL )
+	{
+		dd_log(LOG_ERR,"delta: unable to allocate %d bytes read buffer", DELTA_READER_BUFFER);
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// reader over the mapped delta file, records between offset and end
+//-----------------------------------------------------------------------------
+int dd_delta_reader_map(dd_delta_reader *reader, int fd, u_int64_t offset,
+	u_int64_t end, u_int64_t size)
+{
+	memset(reader, 0, sizeof(dd_delta_reader));
+	if ( offset > end || end > size )
+	{
+		dd_log(LOG_ERR,"delta: records %llu...%llu outside of %llu bytes", offset, end, size);
+		return -1;
+	}
+	if ((reader->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		reader->map = NULL;
+		dd_log(LOG_ERR,"delta: unable to map %llu bytes", size);
+		return -1;
+	}
+	#ifdef MADV_SEQUENTIAL
+	madvise(reader->map, size, MADV_SEQUENTIAL);
+	#endif
+	reader->map_size = size;
+	reader->fd = fd;
+	reader->buffer = reader->map;
+	reader->pos = offset;
+	reader->len = end;
+	reader->offset = offset;
+	reader->eof = 1;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// consume bytes of a mapped delta in place, NULL if not mapped or short
+//-----------------------------------------------------------------------------
+void *dd_delta_take(dd_delta_reader *reader, u_int64_t bytes)
+{
+	void *ptr;
+
+	if ( reader->map == NULL || reader->len - reader->pos < bytes )
+		return NULL;
+	ptr = reader->buffer + reader->pos;
+	reader->pos += bytes;
+	reader->offset += bytes;
+	return ptr;
+}
+
+//-----------------------------------------------------------------------------
+// buffer at least bytes (fewer at end of file)
+//-----------------------------------------------------------------------------
+static void reader_fill(dd_delta_reader *reader, u_int64_t bytes)
+{
+	ssize_t read_bytes;
+
+	if ( reader->map != NULL )
+		return;
+
+	if ( reader->pos > 0 )
+	{
+		memmove(reader->buffer, reader->buffer + reader->pos, reader->len - reader->pos);
+		reader->len -= reader->pos;
+		reader->pos = 0;
+	}
+	while ( !reader->eof && reader->len < bytes )
+	{
+		if ((read_bytes = read(reader->fd, reader->buffer + reader->len,
+			DELTA_READER_BUFFER - reader->len)) <= 0 )
+		{
+			if ( read_bytes == -1 )
+				dd_log(LOG_ERR,"delta: read failed at offset %llu", reader->offset + reader->len);
+			reader->eof = 1;
+			break;
+		}
+		reader->len += read_bytes;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// look at the next bytes without consuming them, NULL if the delta ends
+// before
+//-----------------------------------------------------------------------------
+void *dd_delta_peek(dd_delta_reader *reader, u_int64_t bytes)
+{
+	if ( bytes > DELTA_READER_BUFFER && reader->map == NULL )
+		return NULL;
+	if ( reader->len - reader->pos < bytes )
+		reader_fill(reader, bytes);
+	if ( reader->len - reader->pos < bytes )
+		return NULL;
+	return reader->buffer + reader->pos;
+}
+
+//-----------------------------------------------------------------------------
+// read exactly bytes, large payloads go straight into buf
+//-----------------------------------------------------------------------------
+int dd_delta_read(dd_delta_reader *reader, void *buf, u_int64_t bytes)
+{
+	ssize_t read_bytes;
+	u_int64_t n = reader->len - reader->pos;
+
+	if ( n > bytes )
+		n = bytes;
+	memcpy(buf, reader->buffer + reader->pos, n);
+	reader->pos += n;
+	reader->offset += n;
+
+	if ( n == bytes )
+		return 0;
+	if ( reader->map != NULL )
+		return -1;
+	if ( bytes - n < DELTA_READER_BUFFER / 2 )
+	{
+		if ( dd_delta_peek(reader, bytes - n) == NULL )
+			return -1;
+		return dd_delta_read(reader, (char *)buf + n, bytes - n);
+	}
+
+	while ( n < bytes )
+	{
+		if ( reader->eof ||
+			(read_bytes = read(reader->fd, (char *)buf + n, bytes - n)) <= 0 )
+		{
+			reader->eof = 1;
+			return -1;
+		}
+		n += read_bytes;
+		reader->offset += read_bytes;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// nothing left to read?
+//-----------------------------------------------------------------------------
+int dd_delta_at_end(dd_delta_reader *reader)
+{
+	return dd_delta_peek(reader, 1) == NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dd_delta_reader_free(dd_delta_reader *reader)
+{
+	if ( reader->map != NULL )
+		munmap(reader->map, reader->map_size);
+	else
+		free(reader->buffer);
+	reader->map = NULL;
+	reader->buffer = NULL;
+}
@@ -0,0 +1,41 @@
+/*
+  ddless: delta file records
+*/
+#ifndef DD_DELTA_INCLUDED
+#define DD_DELTA_INCLUDED
+
+#include "ddless.h"
+
+int dd_delta_write_record(parms_struct *parms, u_int64_t write_offset,
+	void *buf, u_int64_t bytes, checksum_struct *checksums);
+int dd_delta_write_copy(parms_struct *parms, u_int64_t write_offset,
+	u_int64_t copy_offset, u_int64_t bytes);
+
+//
+// delta reader: buffered, works on files and pipes (no seeking), or mapped
+// over a file, in which case payloads are taken in place (dd_delta_take)
+//
+#define DELTA_READER_BUFFER	(1024*1024)
+
+typedef struct
+{
+	int		fd;
+	char		*buffer;
+	u_int64_t	pos;		// next unread byte in buffer
+	u_int64_t	len;		// valid bytes in buffer
+	u_int64_t	offset;		// delta offset of buffer[pos]
+	int		eof;
+	char		*map;		// mapped delta, buffer points into it
+	u_int64_t	map_size;
+} dd_delta_reader;
+
+int dd_delta_reader_init(dd_delta_reader *reader, int fd, u_int64_t offset);
+int dd_delta_reader_map(dd_delta_reader *reader, int fd, u_int64_t offset,
+	u_int64_t end, u_int64_t size);
+void *dd_delta_take(dd_delta_reader *reader, u_int64_t bytes);
+void *dd_delta_peek(dd_delta_reader *reader, u_int64_t bytes);
+int dd_delta_read(dd_delta_reader *reader, void *buf, u_int64_t bytes);
+int dd_delta_at_end(dd_delta_reader *reader);
+void dd_delta_reader_free(dd_delta_reader *reader);
+
+#endif
@@ -0,0 +1,417 @@
+/*
+  ddless: checksum journal (two-phase checksum updates)
+
+  Changed segment checksums are not written into the checksum file while
+  the data is on its way. They are appended to <checksum>.journal and the
+  journal is sealed only once the delta (or target) has been synced. A
+  sealed journal is replayed into the checksum file and removed. A journal
+  that was never sealed belongs to an aborted run and is discarded, so the
+  checksum file still describes what the other side actually has and a
+  retry sends the same changes again.
+
+  A journal can also be sealed as pending: the checksum file is updated
+  only after the delta was acknowledged (ddplus -A commit) or never
+  (ddplus -A abort).
+*/
+#include "dd_journal.h"
+#include "dd_log.h"
+#include "dd_file.h"
+#include "dd_checksum.h"
+
+//-----------------------------------------------------------------------------
+// journal file name of a checksum file, journal_file holds
+// JOURNAL_NAME_LENGTH bytes
+//-----------------------------------------------------------------------------
+int dd_journal_name(char *journal_file, char *checksum_file)
+{
+	if ( snprintf(journal_file, JOURNAL_NAME_LENGTH, "%s.journal", checksum_file) >= JOURNAL_NAME_LENGTH )
+	{
+		dd_log(LOG_ERR, "journal: file name of %s is too long", checksum_file);
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// read and check the journal header
+//-----------------------------------------------------------------------------
+static int journal_read_header(int fd, journal_header *header)
+{
+	if ( pread64(fd, header, sizeof(journal_header), 0) != sizeof(journal_header) ||
+		strncmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 )
+	{
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// replay a sealed journal into a compact checksum file: expand, apply and
+// save it again
+//-----------------------------------------------------------------------------
+static int journal_replay_compact(int fd, journal_header *header, char *checksum_file)
+{
+	u_int64_t i, count, segments;
+	struct dd_journal_entry *entries;
+	checksum_struct *array;
+	u_int64_t chunk = JOURNAL_BUFFER_ENTRIES * 16;
+
+	if ((array = dd_checksum_load(checksum_file, &segments)) == NULL )
+		return -1;
+	if ( segments != header->segments )
+	{
+		dd_log(LOG_ERR, "journal: checksum file %s does not have %llu segments",
+			checksum_file, header->segments);
+		free(array);
+		return -1;
+	}
+	if ((entries = malloc(chunk * sizeof(struct dd_journal_entry))) == NULL )
+	{
+		dd_log(LOG_ERR, "journal: unable to allocate replay buffers");
+		free(array);
+		return -1;
+	}
+
+	for (i = 0; i < header->entries; i += count)
+	{
+		u_int64_t j;
+		count = header->entries - i;
+		if ( count > chunk )
+			count = chunk;
+		if ( pread64(fd, entries, count * sizeof(struct dd_journal_entry),
+			sizeof(journal_header) + i * sizeof(struct dd_journal_entry)) !=
+			count * sizeof(struct dd_journal_entry) )
+		{
+			dd_log(LOG_ERR, "journal: short read, journal is broken");
+			goto err;
+		}
+		for (j = 0; j < count; j++)
+		{
+			if ( entries[j].segment >= segments )
+			{
+				dd_log(LOG_ERR, "journal: segment %llu out of range", entries[j].segment);
+				goto err;
+			}
+			array[entries[j].segment] = entries[j].checksum;
+		}
+	}
+
+	if ( dd_checksum_save(checksum_file, array, segments, 1) == -1 )
+		goto err;
+	free(entries);
+	free(array);
+	dd_log(LOG_INFO, "journal: replayed %llu checksums into %s", header->entries, checksum_file);
+	return 0;
+
+err:
+	free(entries);
+	free(array);
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// replay a sealed journal into the checksum file, runs of consecutive
+// segments are written at once
+//-----------------------------------------------------------------------------
+static int journal_replay(int fd, journal_header *header, char *checksum_file)
+{
+	int checksum_fd;
+	u_int64_t i, j;
+	struct dd_journal_entry *entries;
+	checksum_struct *run;
+	u_int64_t chunk = JOURNAL_BUFFER_ENTRIES * 16;
+
+	if ( dd_checksum_is_compact(checksum_file) )
+		return journal_replay_compact(fd, header, checksum_file);
+
+	if ((checksum_fd = open(checksum_file, O_RDWR|O_LARGEFILE)) == -1 )
+	{
+		dd_log(LOG_ERR, "journal: unable to open checksum file: %s", checksum_file);
+		return -1;
+	}
+	if ( dd_device_size(checksum_fd) != header->segments * sizeof(checksum_struct) )
+	{
+		dd_log(LOG_ERR, "journal: checksum file %s does not have %llu segments",
+			checksum_file, header->segments);
+		close(checksum_fd);
+		return -1;
+	}
+
+	entries = malloc(chunk * sizeof(struct dd_journal_entry));
+	run = malloc(chunk * sizeof(checksum_struct));
+	if ( entries == NULL || run == NULL )
+	{
+		dd_log(LOG_ERR, "journal: unable to allocate replay buffers");
+		close(checksum_fd);
+		return -1;
+	}
+
+	for (i = 0; i < header->entries; i += chunk)
+	{
+		u_int64_t count = header->entries - i;
+		if ( count > chunk )
+			count = chunk;
+		if ( pread64(fd, entries, count * sizeof(struct dd_journal_entry),
+			sizeof(journal_header) + i * sizeof(struct dd_journal_entry)) !=
+			count * sizeof(struct dd_journal_entry) )
+		{
+			dd_log(LOG_ERR, "journal: short read, journal is broken");
+			goto err;
+		}
+
+		j = 0;
+		while ( j < count )
+		{
+			u_int64_t first = entries[j].segment;
+			u_int64_t n = 0;
+			while ( j + n < count && entries[j + n].segment == first + n )
+			{
+				run[n] = entries[j + n].checksum;
+				n++;
+			}
+			if ( first + n > header->segments )
+			{
+				dd_log(LOG_ERR, "journal: segment %llu out of range", first + n - 1);
+				goto err;
+			}
+			if ( pwrite64(checksum_fd, run, n * sizeof(checksum_struct),
+				first * sizeof(checksum_struct)) != n * sizeof(checksum_struct) )
+			{
+				dd_log(LOG_ERR, "journal: unable to write checksum file: %s", checksum_file);
+				goto err;
+			}
+			j += n;
+		}
+	}
+
+	if ( fsync(checksum_fd) )
+	{
+		dd_log(LOG_ERR, "journal: unable to sync checksum file: %s", checksum_file);
+		goto err;
+	}
+	close(checksum_fd);
+	free(entries);
+	free(run);
+
+	//
+	// pwrite does update the time stamp, be explicit anyway (see ddless())
+	//
+	utime(checksum_file, NULL);
+	dd_log(LOG_INFO, "journal: replayed %llu checksums into %s", header->entries, checksum_file);
+	return 0;
+
+err:
+	close(checksum_fd);
+	free(entries);
+	free(run);
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// deal with the journal of a previous run: finish a commit, drop an aborted
+// run, refuse to continue while a delta waits for acknowledgement
+//-----------------------------------------------------------------------------
+int dd_journal_recover(char *checksum_file)
+{
+	int fd;
+	char journal_file[JOURNAL_NAME_LENGTH];
+	journal_header header;
+
+	if ( dd_journal_name(journal_file, checksum_file) == -1 )
+		return -1;
+	if ( !dd_file_exists(journal_file) )
+		return 0;
+
+	if ((fd = open(journal_file, O_RDONLY|O_LARGEFILE)) == -1 )
+	{
+		dd_log(LOG_ERR, "journal: unable to open %s", journal_file);
+		return -1;
+	}
+	if ( journal_read_header(fd, &header) == -1 || header.state == JOURNAL_OPEN )
+	{
+		dd_log(LOG_INFO, "journal: discarding %s of an aborted run", journal_file);
+	}
+	else if ( header.state == JOURNAL_PENDING )
+	{
+		dd_log(LOG_ERR, "journal: %s waits for acknowledgement of the last delta, "
+			"use -A commit or -A abort", journal_file);
+		close(fd);
+		return -1;
+	}
+	else if ( journal_replay(fd, &header, checksum_file) == -1 )
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if ( unlink(journal_file) == -1 )
+	{
+		dd_log(LOG_ERR, "journal: unable to remove %s", journal_file);
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// start a new journal
+//-----------------------------------------------------------------------------
+int dd_journal_open(struct dd_journal *journal, char *checksum_file, u_int64_t segments)
+{
+	journal_header header;
+
+	memset(journal, 0, sizeof(struct dd_journal));
+	strncpy(journal->checksum_file, checksum_file, DEV_NAME_LENGTH - 1);
+	if ( dd_journal_name(journal->journal_file, checksum_file) == -1 )
+		return -1;
+	journal->segments = segments;
+	pthread_mutex_init(&journal->lock, NULL);
+
+	if ((journal->fd = open(journal->journal_file, O_CREAT|O_RDWR|O_TRUNC|O_LARGEFILE,
+		(mode_t)0600)) == -1 )
+	{
+		dd_log(LOG_ERR, "journal: unable to create %s", journal->journal_file);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.state = JOURNAL_OPEN;
+	header.segments = segments;
+	if ( write(journal->fd, &header, sizeof(header)) != sizeof(header) )
+	{
+		dd_log(LOG_ERR, "journal: unable to write header of %s", journal->journal_file);
+		return -1;
+	}
+	dd_log(LOG_INFO, "journal: %s", journal->journal_file);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// append the thread's buffered entries to the journal
+//-----------------------------------------------------------------------------
+int dd_journal_flush(struct dd_journal *journal, thread_struct *thread)
+{
+	ssize_t bytes = thread->journal_count * sizeof(struct dd_journal_entry);
+
+	if ( thread->journal_count == 0 )
+		return 0;
+
+	pthread_mutex_lock(&journal->lock);
+	if ( write(journal->fd, thread->journal_entries, bytes) != bytes )
+	{
+		pthread_mutex_unlock(&journal->lock);
+		dd_log(LOG_ERR, "journal: unable to write %s", journal->journal_file);
+		return -1;
+	}
+	journal->entries += thread->journal_count;
+	pthread_mutex_unlock(&journal->lock);
+
+	thread->journal_count = 0;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// stage a checksum update (buffered per thread)
+//-----------------------------------------------------------------------------
+int dd_journal_add(struct dd_journal *journal, thread_struct *thread,
+	u_int64_t segment, checksum_struct *checksum)
+{
+	if ( thread->journal_entries == NULL &&
+		(thread->journal_entries = malloc(JOURNAL_BUFFER_ENTRIES *
+			sizeof(struct dd_journal_entry))) == NULL )
+	{
+		dd_log(LOG_ERR, "journal: unable to allocate buffer");
+		return -1;
+	}
+
+	thread->journal_entries[thread->journal_count].segment = segment;
+	thread->journal_entries[thread->journal_count].checksum = *checksum;
+	thread->journal_count++;
+
+	if ( thread->journal_count == JOURNAL_BUFFER_ENTRIES )
+		return dd_journal_flush(journal, thread);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// seal the journal once the data is durable, a committed journal is replayed
+// right away
+//-----------------------------------------------------------------------------
+int dd_journal_seal(struct dd_journal *journal, int state)
+{
+	journal_header header;
+
+	if ( fsync(journal->fd) )
+	{
+		dd_log(LOG_ERR, "journal: unable to sync %s", journal->journal_file);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+	header.state = state;
+	header.segments = journal->segments;
+	header.entries = journal->entries;
+	if ( pwrite64(journal->fd, &header, sizeof(header), 0) != sizeof(header) ||
+		fsync(journal->fd) )
+	{
+		dd_log(LOG_ERR, "journal: unable to seal %s", journal->journal_file);
+		return -1;
+	}
+	close(journal->fd);
+	journal->fd = -1;
+	pthread_mutex_destroy(&journal->lock);
+	dd_log(LOG_INFO, "journal: sealed %llu checksums (%s)", journal->entries,
+		state == JOURNAL_PENDING ? "pending" : "committed");
+
+	if ( state == JOURNAL_COMMITTED )
+		return dd_journal_recover(journal->checksum_file);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// acknowledge (commit) or abort a pending journal
+//-----------------------------------------------------------------------------
+int dd_journal_resolve(char *checksum_file, int commit)
+{
+	int fd;
+	char journal_file[JOURNAL_NAME_LENGTH];
+	journal_header header;
+
+	if ( dd_journal_name(journal_file, checksum_file) == -1 )
+		return -1;
+	if ((fd = open(journal_file, O_RDWR|O_LARGEFILE)) == -1 )
+	{
+		dd_log(LOG_ERR, "journal: no journal %s", journal_file);
+		return -1;
+	}
+	if ( journal_read_header(fd, &header) == -1 || header.state != JOURNAL_PENDING )
+	{
+		dd_log(LOG_ERR, "journal: %s is not waiting for acknowledgement", journal_file);
+		close(fd);
+		return -1;
+	}
+
+	if ( commit )
+	{
+		header.state = JOURNAL_COMMITTED;
+		if ( pwrite64(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) )
+		{
+			dd_log(LOG_ERR, "journal: unable to commit %s", journal_file);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		return dd_journal_recover(checksum_file);
+	}
+
+	close(fd);
+	dd_log(LOG_INFO, "journal: aborting %s, the checksum file is unchanged", journal_file);
+	if ( unlink(journal_file) == -1 )
+	{
+		dd_log(LOG_ERR, "journal: unable to remove %s", journal_file);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+  ddless: checksum journal (two-phase checksum updates)
+*/
+#ifndef DD_JOURNAL_INCLUDED
+#define DD_JOURNAL_INCLUDED
+
+#include "ddless.h"
+
+#define JOURNAL_MAGIC		"ddjournl"
+#define JOURNAL_OPEN		0	// run in progress, discarded on recovery
+#define JOURNAL_COMMITTED	1	// data is durable, replay into checksum file
+#define JOURNAL_PENDING		2	// data is durable, waiting for acknowledgement
+
+#define JOURNAL_BUFFER_ENTRIES	(BUFFER_SEGMENTS * 4)
+#define JOURNAL_NAME_LENGTH	(DEV_NAME_LENGTH + sizeof(".journal"))
+
+typedef struct
+{
+	char		magic[8];
+	u_int64_t	state;
+	u_int64_t	segments;	// size of the checksum file in entries
+	u_int64_t	entries;	// valid once the journal is sealed
+} journal_header;
+
+struct dd_journal_entry
+{
+	u_int64_t	segment;
+	checksum_struct	checksum;
+};
+
+struct dd_journal
+{
+	char		journal_file[JOURNAL_NAME_LENGTH];
+	char		checksum_file[DEV_NAME_LENGTH];
+	int		fd;
+	u_int64_t	segments;
+	u_int64_t	entries;
+	pthread_mutex_t	lock;
+};
+
+int dd_journal_name(char *journal_file, char *checksum_file);
+int dd_journal_recover(char *checksum_file);
+int dd_journal_open(struct dd_journal *journal, char *checksum_file, u_int64_t segments);
+int dd_journal_add(struct dd_journal *journal, thread_struct *thread,
+	u_int64_t segment, checksum_struct *checksum);
+int dd_journal_flush(struct dd_journal *journal, thread_struct *thread);
+int dd_journal_seal(struct dd_journal *journal, int state);
+int dd_journal_resolve(char *checksum_file, int commit);
+
+#endif
@@ -1,57 +1,264 @@
 /*
   ddless: utilities
   Steffen Plotner, 2008
+
+  By default a message is printed right away by the thread logging it.
+  DDLESS_LOG in the environment changes that, a comma separated list of:
+
+	async	each thread formats into its own ring buffer (single producer,
+		single consumer, no locks), a background thread drains the
+		rings to stdout, a thread waits while its ring is full (only
+		messages logged after the drain stopped are dropped)
+	json	one JSON object per line with the time in nanoseconds, the
+		thread, the level and the message, for high rate tracing
 */
 #include "dd_log.h"
+#include <errno.h>
 
 int log_level = 0;
 pthread_t main_thread;
 #define LOG_NAME_SIZE 128
 char log_name[LOG_NAME_SIZE];
 
+#define LOG_RING_SIZE	4096		// entries per thread, power of 2
+#define LOG_TEXT_SIZE	232
+
+typedef struct
+{
+	u_int64_t	ns;
+	int		log_type;
+	int		error;		// errno of a LOG_ERR message
+	char		text[LOG_TEXT_SIZE];
+} log_entry;
+
+typedef struct log_ring
+{
+	log_entry	entries[LOG_RING_SIZE];
+	u_int64_t	head;		// written by the owning thread
+	u_int64_t	tail;		// written by the drain
+	u_int64_t	dropped;
+	unsigned int	thread;
+	int		main;
+	struct log_ring	*next;
+} log_ring;
+
+static int log_async = 0;
+static int log_json = 0;
+static __thread log_ring *thread_ring;
+static log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drain_thread;
+static volatile int drain_running = 0;
+
 void dd_loglevel_inc()
 {
 	log_level++;
 }
 
+//-----------------------------------------------------------------------------
+static u_int64_t log_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// print one message, text as it always was or a JSON line
+//-----------------------------------------------------------------------------
+static void log_emit(FILE *fp, int log_type, int error, u_int64_t ns, unsigned int thread,
+	int main, char *text)
+{
+	char *p;
+
+	if ( !log_json )
+	{
+		if ( main )
+			fprintf(fp, "%s> %s\n", log_name, text);
+		else
+			fprintf(fp, "%s[%x]> %s\n", log_name, thread, text);
+		if ( log_type == LOG_ERR )
+			fprintf(stderr, "err> perror: %s\n", strerror(error));
+		return;
+	}
+
+	fprintf(fp, "{\"ts_ns\": %llu, \"program\": \"%s\", \"thread\": \"%s%x\", \"level\": \"%s\", \"msg\": \"",
+		(long long unsigned)ns, log_name, main ? "main-" : "", thread,
+		log_type == LOG_ERR ? "error" : log_type == LOG_INFO ? "info" :
+		log_type == LOG_DEBUG ? "debug" : "debug2");
+	for (p = text; *p; p++)
+	{
+		if ( *p == '"' || *p == '\\' )
+			fprintf(fp, "\\%c", *p);
+		else if ( (unsigned char)*p < 0x20 )
+			fprintf(fp, "\\u%04x", (unsigned char)*p);
+		else
+			fputc(*p, fp);
+	}
+	if ( log_type == LOG_ERR )
+		fprintf(fp, "\", \"error\": \"%s\"}\n", strerror(error));
+	else
+		fprintf(fp, "\"}\n");
+}
+
+//-----------------------------------------------------------------------------
+// the calling thread's ring, registered on first use
+//-----------------------------------------------------------------------------
+static log_ring *log_thread_ring()
+{
+	log_ring *ring;
+
+	if ( thread_ring )
+		return thread_ring;
+	if ( (ring = calloc(1, sizeof(log_ring))) == NULL )
+		return NULL;
+	ring->thread = (unsigned int)pthread_self();
+	ring->main = pthread_equal(pthread_self(), main_thread);
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+	thread_ring = ring;
+	return ring;
+}
+
+//-----------------------------------------------------------------------------
+// print what the rings hold, one drain at a time
+//-----------------------------------------------------------------------------
+static void log_drain()
+{
+	log_ring *ring;
+
+	pthread_mutex_lock(&drain_lock);
+	pthread_mutex_lock(&rings_lock);
+	ring = rings;
+	pthread_mutex_unlock(&rings_lock);
+
+	for ( ; ring != NULL; ring = ring->next)
+	{
+		u_int64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		u_int64_t tail = ring->tail;
+
+		for ( ; tail < head; tail++)
+		{
+			log_entry *e = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+			log_emit(stdout, e->log_type, e->error, e->ns, ring->thread, ring->main, e->text);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *log_drain_thread(void *arg)
+{
+	while ( drain_running )
+	{
+		log_drain();
+		usleep(1000);
+	}
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// stop the drain and print what is left, runs at exit
+//-----------------------------------------------------------------------------
+void dd_log_flush()
+{
+	log_ring *ring;
+	u_int64_t dropped = 0;
+
+	if ( !log_async )
+		return;
+	if ( drain_running )
+	{
+		drain_running = 0;
+		if ( !pthread_equal(pthread_self(), drain_thread) )
+			pthread_join(drain_thread, NULL);
+	}
+	log_drain();
+
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring != NULL; ring = ring->next)
+	{
+		dropped += ring->dropped;
+		ring->dropped = 0;
+	}
+	pthread_mutex_unlock(&rings_lock);
+	if ( dropped )
+		fprintf(stderr, "%s> log rings were full, %llu messages dropped\n", log_name,
+			(long long unsigned)dropped);
+}
+
+//-----------------------------------------------------------------------------
 void dd_log_init(char *progam_name)
 {
+	char *env = getenv("DDLESS_LOG");
+
 	main_thread = pthread_self();
 	snprintf(log_name, LOG_NAME_SIZE, "%s", progam_name);
+
+	if ( env != NULL )
+	{
+		log_async = ( strstr(env, "async") != NULL );
+		log_json = ( strstr(env, "json") != NULL );
+	}
+	if ( log_async )
+	{
+		drain_running = 1;
+		if ( pthread_create(&drain_thread, NULL, log_drain_thread, NULL) != 0 )
+		{
+			drain_running = 0;
+			log_async = 0;
+		}
+		else
+			atexit(dd_log_flush);
+	}
 }
 
-void dd_log(int log_type, char *format_string, ...)
+//-----------------------------------------------------------------------------
+// dd_log() has checked the level already
+//-----------------------------------------------------------------------------
+void dd_log_write(int log_type, char *format_string, ...)
 {
 	va_list var_args;
-	
+	int error = errno;
+	log_ring *ring;
+
 	va_start(var_args, format_string);
-	
-	//
-	// actual logging is determined by loglevel, include thread
-	// id when caller is not main().
-	//
-	if ( log_type < log_level || log_type == LOG_ERR )
+
+	if ( log_async && (ring = log_thread_ring()) != NULL )
 	{
-		pthread_t pthread = pthread_self();
-		if ( pthread != main_thread )
-		{
-			printf("%s[%x]> ", log_name, (unsigned int)pthread);
-		}
+		u_int64_t head = ring->head;
+
+		while ( head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE && drain_running )
+			usleep(100);
+		if ( head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE )
+			ring->dropped++;
 		else
 		{
-			printf("%s> ", log_name);
+			log_entry *e = &ring->entries[head & (LOG_RING_SIZE - 1)];
+
+			e->ns = log_json ? log_now() : 0;
+			e->log_type = log_type;
+			e->error = error;
+			vsnprintf(e->text, LOG_TEXT_SIZE, format_string, var_args);
+			__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 		}
-		vfprintf(stdout, format_string, var_args);
-		printf("\n");
+		va_end(var_args);
+		return;
 	}
-	
+
 	//
-	// errors always appear
+	// synchronous, include the thread id when the caller is not main()
 	//
-	if ( log_type == LOG_ERR )
-	{
-		perror("err> perror");
-	}
+	char text[1024];
+	vsnprintf(text, sizeof(text), format_string, var_args);
+	log_emit(stdout, log_type, error, log_json ? log_now() : 0, (unsigned int)pthread_self(),
+		pthread_equal(pthread_self(), main_thread), text);
 
 	va_end(var_args);
 }
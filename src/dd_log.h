@@ -14,8 +14,27 @@
 // always show up
 #define LOG_ERR 10
 
+//
+// levels above DD_LOG_MAX_LEVEL are compiled out (make RELEASE=1 keeps
+// LOG_INFO and LOG_ERR only), the others cost a compare when they are not
+// enabled at runtime, their arguments are not evaluated
+//
+#ifndef DD_LOG_MAX_LEVEL
+#define DD_LOG_MAX_LEVEL LOG_DEBUG2
+#endif
+
+extern int log_level;
+
+#define dd_log(log_type, ...)							\
+	do {									\
+		if ( (log_type) == LOG_ERR ||					\
+			((log_type) <= DD_LOG_MAX_LEVEL && (log_type) < log_level) )	\
+			dd_log_write(log_type, __VA_ARGS__);			\
+	} while (0)
+
 void dd_loglevel_inc();
 void dd_log_init(char *program_name);
-void dd_log(int log_type, char *format_string, ...);
+void dd_log_write(int log_type, char *format_string, ...);
+void dd_log_flush();
 
 #endif
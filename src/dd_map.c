@@ -123,3 +123,38 @@ err:
 	
 	return ret;
 }
+
+//-----------------------------------------------------------------------------
+// write the map (header and bits) to a file, the counterpart of ddmap_read
+//-----------------------------------------------------------------------------
+int ddmap_write(struct ddmap_data *map_data)
+{
+	int fd;
+	struct ddmap_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	strncpy(hdr.info, "ddmap", sizeof(hdr.info));
+	hdr.version = 1;
+	hdr.name_sum = map_data->name_sum;
+	hdr.map_size = map_data->map_size;
+
+	if ((fd = open(map_data->map_device, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, (mode_t)0600)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to create map: %s", map_data->map_device);
+		return -1;
+	}
+	if ( write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		write(fd, map_data->map, map_data->map_size_bytes) != map_data->map_size_bytes )
+	{
+		dd_log(LOG_ERR, "unable to write map: %s", map_data->map_device);
+		close(fd);
+		return -1;
+	}
+	if ( close(fd) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to close map: %s", map_data->map_device);
+		return -1;
+	}
+	dd_log(LOG_INFO, "wrote map: %s (%u u32 words)", map_data->map_device, map_data->map_size);
+	return 0;
+}
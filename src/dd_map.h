@@ -34,5 +34,6 @@ struct ddmap_data {
 
 void ddmap_dump(struct ddmap_data *map_data);
 int ddmap_read(struct ddmap_data *map_data, int dump_header);
+int ddmap_write(struct ddmap_data *map_data);
 
 #endif
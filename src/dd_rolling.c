@@ -0,0 +1,172 @@
+/*
+  ddless: rolling hash over a fixed window
+
+  crc32 is linear, so the crc of a window moved by one byte follows from the
+  old crc, the byte entering and the byte leaving the window. The old
+  checksum file already holds the crc32 (weak) and murmur (strong) checksum
+  of every segment, which makes it the dictionary for rsync style matching.
+*/
+#include "dd_rolling.h"
+#include "dd_log.h"
+#include "dd_murmurhash2.h"
+#include "dd_zero.h"
+#include "dd_checksum.h"
+
+//-----------------------------------------------------------------------------
+// raw crc32 step (no pre/post inversion)
+//-----------------------------------------------------------------------------
+static u_int32_t roll_step(dd_roll_struct *roll, u_int32_t raw, unsigned char in)
+{
+	return roll->crc_table[(raw ^ in) & 0xff] ^ (raw >> 8);
+}
+
+//-----------------------------------------------------------------------------
+// prepare the tables for a given window length
+//-----------------------------------------------------------------------------
+void dd_roll_init(dd_roll_struct *roll, u_int32_t window)
+{
+	u_int32_t i, j, raw;
+
+	roll->window = window;
+	for (i = 0; i < 256; i++)
+	{
+		raw = i;
+		for (j = 0; j < 8; j++)
+			raw = (raw & 1) ? (raw >> 1) ^ 0xedb88320 : raw >> 1;
+		roll->crc_table[i] = raw;
+	}
+
+	//
+	// contribution of the initial register after window and window+1 bytes
+	//
+	raw = 0xffffffff;
+	for (i = 0; i < window; i++)
+		raw = roll_step(roll, raw, 0);
+	roll->constant = raw ^ roll_step(roll, raw, 0);
+
+	//
+	// contribution of the byte leaving the window
+	//
+	for (i = 0; i < 256; i++)
+	{
+		raw = roll_step(roll, 0, i);
+		for (j = 0; j < window; j++)
+			raw = roll_step(roll, raw, 0);
+		roll->out_table[i] = raw;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// load the old checksum file and index it by crc32
+//-----------------------------------------------------------------------------
+int dd_dict_load(dd_dict_struct *dict, char *checksum_file)
+{
+	u_int64_t i, slot;
+
+	memset(dict, 0, sizeof(dd_dict_struct));
+	if ((dict->old = dd_checksum_load(checksum_file, &dict->old_segments)) == NULL )
+	{
+		dd_log(LOG_ERR, "rolling: unable to load checksum file: %s", checksum_file);
+		return -1;
+	}
+	if ( dict->old_segments == 0 )
+		return 0;
+	if ( dict->old_segments >= 0xffffffffULL )
+	{
+		dd_log(LOG_ERR, "rolling: checksum file too large for the dictionary");
+		return -1;
+	}
+
+	//
+	// open addressing table at most half full, filter with 32 bits per entry
+	//
+	u_int64_t table_size = 1024;
+	while ( table_size < dict->old_segments * 2 )
+		table_size <<= 1;
+	u_int64_t filter_bits = 1 << 16;
+	while ( filter_bits < dict->old_segments * 32 && filter_bits < (1ULL << 32) )
+		filter_bits <<= 1;
+
+	dict->table_mask = table_size - 1;
+	dict->filter_mask = filter_bits - 1;
+	dict->table = calloc(table_size, sizeof(u_int32_t));
+	dict->filter = calloc(filter_bits / 8, 1);
+	if ( dict->table == NULL || dict->filter == NULL )
+	{
+		dd_log(LOG_ERR, "rolling: unable to allocate dictionary for %llu segments",
+			dict->old_segments);
+		return -1;
+	}
+
+	//
+	// zero segments are never matched (they are cheaper sent zipped than
+	// copied) and of duplicate contents only the first segment is kept
+	//
+	for (i = 0; i < dict->old_segments; i++)
+	{
+		checksum_struct *old = dict->old + i;
+		if ( old->checksum1_murmur == ZERO_CHECKSUM1_MURMUR &&
+			old->checksum2_crc32 == ZERO_CHECKSUM2_CRC32 )
+			continue;
+
+		for (slot = old->checksum2_crc32 & dict->table_mask; dict->table[slot];
+			slot = (slot + 1) & dict->table_mask)
+		{
+			checksum_struct *other = dict->old + dict->table[slot] - 1;
+			if ( other->checksum1_murmur == old->checksum1_murmur &&
+				other->checksum2_crc32 == old->checksum2_crc32 )
+				break;
+		}
+		if ( dict->table[slot] )
+			continue;
+
+		dict->table[slot] = i + 1;
+		dict->filter[(old->checksum2_crc32 & dict->filter_mask) >> 3] |=
+			1 << (old->checksum2_crc32 & 7);
+		dict->entries++;
+	}
+	dd_log(LOG_INFO, "rolling: dictionary of %llu segments, %llu entries",
+		dict->old_segments, dict->entries);
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// find an old segment with the window's content, returns -1 if none
+//-----------------------------------------------------------------------------
+int64_t dd_dict_lookup(dd_dict_struct *dict, u_int32_t crc, const void *window, u_int32_t len)
+{
+	u_int64_t slot;
+	u_int32_t murmur = 0;
+	int have_murmur = 0;
+
+	if ( !dict->entries )
+		return -1;
+
+	for (slot = crc & dict->table_mask; dict->table[slot];
+		slot = (slot + 1) & dict->table_mask)
+	{
+		u_int64_t index = dict->table[slot] - 1;
+		if ( dict->old[index].checksum2_crc32 != crc )
+			continue;
+		if ( !have_murmur )
+		{
+			murmur = MurmurHash2(window, len, MURMUR_SEED);
+			have_murmur = 1;
+		}
+		if ( dict->old[index].checksum1_murmur == murmur )
+			return index;
+	}
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// release the dictionary
+//-----------------------------------------------------------------------------
+void dd_dict_free(dd_dict_struct *dict)
+{
+	free(dict->old);
+	free(dict->table);
+	free(dict->filter);
+	memset(dict, 0, sizeof(dd_dict_struct));
+}
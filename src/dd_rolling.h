@@ -0,0 +1,57 @@
+/*
+  ddless: rolling hash over a fixed window
+*/
+#ifndef DD_ROLLING_INCLUDED
+#define DD_ROLLING_INCLUDED
+
+#include "ddless.h"
+
+//
+// rolling crc32 (zlib flavour) over a window of fixed length
+//
+typedef struct
+{
+	u_int32_t	window;
+	u_int32_t	constant;
+	u_int32_t	crc_table[256];
+	u_int32_t	out_table[256];
+} dd_roll_struct;
+
+//
+// dictionary of old segment checksums, looked up by crc32
+//
+typedef struct
+{
+	checksum_struct	*old;		// copy of the old checksum file
+	u_int64_t	old_segments;
+	u_int32_t	*table;		// segment index + 1, 0 is an empty slot
+	u_int64_t	table_mask;
+	u_int8_t	*filter;	// one bit per crc32 bucket
+	u_int64_t	filter_mask;
+	u_int64_t	entries;
+} dd_dict_struct;
+
+void dd_roll_init(dd_roll_struct *roll, u_int32_t window);
+
+//
+// move the window one byte: out leaves at the front, in enters at the back
+//
+static inline u_int32_t dd_roll(dd_roll_struct *roll, u_int32_t crc,
+	unsigned char out, unsigned char in)
+{
+	u_int32_t raw = ~crc;
+	raw = roll->crc_table[(raw ^ in) & 0xff] ^ (raw >> 8);
+	return ~(raw ^ roll->constant ^ roll->out_table[out]);
+}
+
+int dd_dict_load(dd_dict_struct *dict, char *checksum_file);
+int64_t dd_dict_lookup(dd_dict_struct *dict, u_int32_t crc, const void *window, u_int32_t len);
+void dd_dict_free(dd_dict_struct *dict);
+
+static inline int dd_dict_filter(dd_dict_struct *dict, u_int32_t crc)
+{
+	u_int64_t bit = crc & dict->filter_mask;
+	return dict->entries && (dict->filter[bit >> 3] & (1 << (bit & 7)));
+}
+
+#endif
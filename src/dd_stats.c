@@ -0,0 +1,311 @@
+/*
+  ddless: per phase timings of the workers
+
+  Workers time their phases (read, hash, compare, compress, write, sleep)
+  into their own slot. The exporter thread sums the slots every
+  DD_STATS_INTERVAL seconds and once more at the end, and writes
+  <prefix>.json and <prefix>.prom, the latter a node_exporter textfile.
+  Both are written to a tmp file and renamed, so a reader never sees half
+  a file.
+*/
+#include "dd_stats.h"
+#include "dd_log.h"
+#include <errno.h>
+
+int dd_stats_enabled = 0;
+
+static dd_stats_slot *stats_slots;
+static int stats_nslots;
+static __thread int stats_slot;
+static char stats_program[32];
+static char stats_prefix[DEV_NAME_LENGTH - 16];	// room for the suffixes
+static u_int64_t stats_start_ns;
+static int stats_running;
+static pthread_t stats_thread;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stats_cond = PTHREAD_COND_INITIALIZER;
+
+static char *phase_names[DD_PHASES] = { "read", "hash", "compare", "compress", "write", "sleep" };
+
+//-----------------------------------------------------------------------------
+// monotonic clock in nanoseconds
+//-----------------------------------------------------------------------------
+u_int64_t dd_stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// the calling thread records into the slot of worker_id (-1 is main)
+//-----------------------------------------------------------------------------
+void dd_stats_thread(int worker_id)
+{
+	stats_slot = worker_id + 1;
+	if ( stats_slot < 0 || stats_slot >= stats_nslots )
+		stats_slot = 0;
+}
+
+//-----------------------------------------------------------------------------
+void dd_stats_record(int phase, u_int64_t start_ns, u_int64_t bytes)
+{
+	dd_stats_phase *p = &stats_slots[stats_slot].phase[phase];
+	u_int64_t ns = dd_stats_now() - start_ns;
+	int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if ( b >= DD_STATS_BUCKETS )
+		b = DD_STATS_BUCKETS - 1;
+	p->count++;
+	p->ns += ns;
+	p->bytes += bytes;
+	p->buckets[b]++;
+	if ( ns > p->max_ns )
+		p->max_ns = ns;
+}
+
+//-----------------------------------------------------------------------------
+// open <prefix><suffix>.tmp, the caller renames it when complete
+//-----------------------------------------------------------------------------
+static FILE *stats_open(char *suffix, char *tmp_file, char *file)
+{
+	FILE *fp;
+
+	snprintf(file, DEV_NAME_LENGTH, "%s%s", stats_prefix, suffix);
+	snprintf(tmp_file, DEV_NAME_LENGTH, "%s%s.tmp", stats_prefix, suffix);
+	if ((fp = fopen(tmp_file, "w")) == NULL )
+		dd_log(LOG_ERR, "unable to create stats file: %s", tmp_file);
+	return fp;
+}
+
+static int stats_close(FILE *fp, char *tmp_file, char *file)
+{
+	if ( fclose(fp) != 0 || rename(tmp_file, file) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to write stats file: %s", file);
+		unlink(tmp_file);
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// upper bound of a histogram bucket in seconds
+//-----------------------------------------------------------------------------
+static double bucket_le(int b)
+{
+	return (double)(2ULL << b) / 1000000000.0;
+}
+
+//-----------------------------------------------------------------------------
+static void stats_json(FILE *fp, dd_stats_slot *total, double elapsed)
+{
+	int s, ph, b, first;
+
+	fprintf(fp, "{\n  \"program\": \"%s\",\n  \"running\": %d,\n  \"elapsed_seconds\": %.3f,\n",
+		stats_program, stats_running, elapsed);
+	fprintf(fp, "  \"phases\": {");
+	for (ph = 0; ph < DD_PHASES; ph++)
+	{
+		dd_stats_phase *p = &total->phase[ph];
+
+		fprintf(fp, "%s\n    \"%s\": {\"count\": %llu, \"seconds\": %.6f, \"max_seconds\": %.6f, \"bytes\": %llu, \"histogram\": {",
+			ph ? "," : "", phase_names[ph], (long long unsigned)p->count, p->ns / 1000000000.0,
+			p->max_ns / 1000000000.0, (long long unsigned)p->bytes);
+		for (b = 0, first = 1; b < DD_STATS_BUCKETS; b++)
+		{
+			if ( !p->buckets[b] )
+				continue;
+			fprintf(fp, "%s\"%g\": %llu", first ? "" : ", ", bucket_le(b), (long long unsigned)p->buckets[b]);
+			first = 0;
+		}
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "\n  },\n  \"workers\": [");
+	for (s = 0; s < stats_nslots; s++)
+	{
+		if ( s )
+			fprintf(fp, ",\n    {\"worker\": \"%d\"", s - 1);
+		else
+			fprintf(fp, "\n    {\"worker\": \"main\"");
+		for (ph = 0; ph < DD_PHASES; ph++)
+		{
+			dd_stats_phase *p = &stats_slots[s].phase[ph];
+
+			fprintf(fp, ", \"%s\": [%llu, %.6f, %llu]", phase_names[ph], (long long unsigned)p->count,
+				p->ns / 1000000000.0, (long long unsigned)p->bytes);
+		}
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+}
+
+//-----------------------------------------------------------------------------
+// prometheus exposition format: totals as histograms, workers as counters
+//-----------------------------------------------------------------------------
+static void stats_prom(FILE *fp, dd_stats_slot *total, double elapsed)
+{
+	int s, ph, b;
+
+	fprintf(fp, "# HELP ddless_running 1 while the run is in progress\n# TYPE ddless_running gauge\n");
+	fprintf(fp, "ddless_running{program=\"%s\"} %d\n", stats_program, stats_running);
+	fprintf(fp, "# HELP ddless_elapsed_seconds Time since the run started\n# TYPE ddless_elapsed_seconds gauge\n");
+	fprintf(fp, "ddless_elapsed_seconds{program=\"%s\"} %.3f\n", stats_program, elapsed);
+
+	fprintf(fp, "# HELP ddless_phase_seconds Duration of each phase of all workers\n# TYPE ddless_phase_seconds histogram\n");
+	for (ph = 0; ph < DD_PHASES; ph++)
+	{
+		dd_stats_phase *p = &total->phase[ph];
+		u_int64_t cumulative = 0;
+
+		for (b = 0; b < DD_STATS_BUCKETS - 1; b++)
+		{
+			cumulative += p->buckets[b];
+			fprintf(fp, "ddless_phase_seconds_bucket{program=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+				stats_program, phase_names[ph], bucket_le(b), (long long unsigned)cumulative);
+		}
+		fprintf(fp, "ddless_phase_seconds_bucket{program=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+			stats_program, phase_names[ph], (long long unsigned)p->count);
+		fprintf(fp, "ddless_phase_seconds_sum{program=\"%s\",phase=\"%s\"} %.9f\n",
+			stats_program, phase_names[ph], p->ns / 1000000000.0);
+		fprintf(fp, "ddless_phase_seconds_count{program=\"%s\",phase=\"%s\"} %llu\n",
+			stats_program, phase_names[ph], (long long unsigned)p->count);
+	}
+
+	fprintf(fp, "# HELP ddless_worker_phase_seconds_total Time spent per worker and phase\n# TYPE ddless_worker_phase_seconds_total counter\n");
+	for (s = 0; s < stats_nslots; s++)
+		for (ph = 0; ph < DD_PHASES; ph++)
+		{
+			if ( s )
+				fprintf(fp, "ddless_worker_phase_seconds_total{program=\"%s\",worker=\"%d\",phase=\"%s\"} %.9f\n",
+					stats_program, s - 1, phase_names[ph], stats_slots[s].phase[ph].ns / 1000000000.0);
+			else
+				fprintf(fp, "ddless_worker_phase_seconds_total{program=\"%s\",worker=\"main\",phase=\"%s\"} %.9f\n",
+					stats_program, phase_names[ph], stats_slots[s].phase[ph].ns / 1000000000.0);
+		}
+
+	fprintf(fp, "# HELP ddless_worker_phase_bytes_total Bytes moved per worker and phase\n# TYPE ddless_worker_phase_bytes_total counter\n");
+	for (s = 0; s < stats_nslots; s++)
+		for (ph = 0; ph < DD_PHASES; ph++)
+		{
+			if ( s )
+				fprintf(fp, "ddless_worker_phase_bytes_total{program=\"%s\",worker=\"%d\",phase=\"%s\"} %llu\n",
+					stats_program, s - 1, phase_names[ph], (long long unsigned)stats_slots[s].phase[ph].bytes);
+			else
+				fprintf(fp, "ddless_worker_phase_bytes_total{program=\"%s\",worker=\"main\",phase=\"%s\"} %llu\n",
+					stats_program, phase_names[ph], (long long unsigned)stats_slots[s].phase[ph].bytes);
+		}
+}
+
+//-----------------------------------------------------------------------------
+// sum the slots and write <prefix>.json and <prefix>.prom
+//-----------------------------------------------------------------------------
+int dd_stats_export()
+{
+	char file[DEV_NAME_LENGTH], tmp_file[DEV_NAME_LENGTH];
+	dd_stats_slot total;
+	double elapsed;
+	FILE *fp;
+	int s, ph, b;
+
+	if ( !dd_stats_enabled )
+		return 0;
+
+	memset(&total, 0, sizeof(total));
+	for (s = 0; s < stats_nslots; s++)
+		for (ph = 0; ph < DD_PHASES; ph++)
+		{
+			dd_stats_phase *p = &stats_slots[s].phase[ph];
+
+			total.phase[ph].count += p->count;
+			total.phase[ph].ns += p->ns;
+			total.phase[ph].bytes += p->bytes;
+			if ( p->max_ns > total.phase[ph].max_ns )
+				total.phase[ph].max_ns = p->max_ns;
+			for (b = 0; b < DD_STATS_BUCKETS; b++)
+				total.phase[ph].buckets[b] += p->buckets[b];
+		}
+	elapsed = (dd_stats_now() - stats_start_ns) / 1000000000.0;
+
+	if ((fp = stats_open(".json", tmp_file, file)) == NULL )
+		return -1;
+	stats_json(fp, &total, elapsed);
+	if ( stats_close(fp, tmp_file, file) == -1 )
+		return -1;
+
+	if ((fp = stats_open(".prom", tmp_file, file)) == NULL )
+		return -1;
+	stats_prom(fp, &total, elapsed);
+	return stats_close(fp, tmp_file, file);
+}
+
+//-----------------------------------------------------------------------------
+// exporter thread, wakes up every DD_STATS_INTERVAL seconds
+//-----------------------------------------------------------------------------
+static void *stats_exporter_thread(void *arg)
+{
+	struct timespec due;
+
+	pthread_mutex_lock(&stats_lock);
+	while ( stats_running )
+	{
+		clock_gettime(CLOCK_REALTIME, &due);
+		due.tv_sec += DD_STATS_INTERVAL;
+		if ( pthread_cond_timedwait(&stats_cond, &stats_lock, &due) == ETIMEDOUT && stats_running )
+			dd_stats_export();
+	}
+	pthread_mutex_unlock(&stats_lock);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// allocate a slot per worker plus main and start the exporter, a run
+// without a prefix records nothing
+//-----------------------------------------------------------------------------
+int dd_stats_init(char *program, char *prefix, int workers)
+{
+	if ( !prefix || !*prefix )
+		return 0;
+
+	stats_nslots = workers + 1;
+	if ((stats_slots = calloc(stats_nslots, sizeof(dd_stats_slot))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate stats for %d workers", workers);
+		return -1;
+	}
+	snprintf(stats_program, sizeof(stats_program), "%s", program);
+	snprintf(stats_prefix, sizeof(stats_prefix), "%s", prefix);
+	stats_slot = 0;
+	stats_start_ns = dd_stats_now();
+	stats_running = 1;
+	dd_stats_enabled = 1;
+
+	if ( pthread_create(&stats_thread, NULL, stats_exporter_thread, NULL) != 0 )
+	{
+		dd_log(LOG_ERR, "pthread_create stats exporter failed");
+		return -1;
+	}
+	dd_log(LOG_INFO, "stats: %s.json and %s.prom every %d seconds", prefix, prefix, DD_STATS_INTERVAL);
+	return dd_stats_export();
+}
+
+//-----------------------------------------------------------------------------
+// stop the exporter and write the final numbers
+//-----------------------------------------------------------------------------
+void dd_stats_finish()
+{
+	if ( !dd_stats_enabled )
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_running = 0;
+	pthread_cond_signal(&stats_cond);
+	pthread_mutex_unlock(&stats_lock);
+	pthread_join(stats_thread, NULL);
+
+	dd_stats_export();
+	dd_stats_enabled = 0;
+	free(stats_slots);
+	stats_slots = NULL;
+}
@@ -0,0 +1,63 @@
+/*
+  ddless: per phase timings of the workers
+*/
+#ifndef DD_STATS_INCLUDED
+#define DD_STATS_INCLUDED
+
+#include "ddless.h"
+
+//
+// Each thread owns a slot: slot 0 is the main thread, worker n uses slot
+// n + 1. A phase records its count, total and maximum duration, the bytes
+// it moved and a log2 histogram of the durations in nanoseconds. Nothing is
+// locked, the exporter reads the slots while they are being updated.
+//
+#define DD_PHASE_READ		0
+#define DD_PHASE_HASH		1
+#define DD_PHASE_COMPARE	2
+#define DD_PHASE_COMPRESS	3
+#define DD_PHASE_WRITE		4
+#define DD_PHASE_SLEEP		5
+#define DD_PHASES		6
+
+#define DD_STATS_BUCKETS	36	// 1ns ... 2^35ns (34s) and above
+#define DD_STATS_INTERVAL	10	// seconds between exports during a run
+
+typedef struct
+{
+	u_int64_t	count;
+	u_int64_t	ns;
+	u_int64_t	max_ns;
+	u_int64_t	bytes;
+	u_int64_t	buckets[DD_STATS_BUCKETS];
+} dd_stats_phase;
+
+typedef struct
+{
+	dd_stats_phase	phase[DD_PHASES];
+} dd_stats_slot;
+
+extern int dd_stats_enabled;
+
+u_int64_t dd_stats_now();
+int dd_stats_init(char *program, char *prefix, int workers);
+void dd_stats_thread(int worker_id);
+void dd_stats_record(int phase, u_int64_t start_ns, u_int64_t bytes);
+int dd_stats_export();
+void dd_stats_finish();
+
+//
+// start_ns is 0 when stats are off, so call sites pay for no clock reads
+//
+static inline u_int64_t dd_stats_begin()
+{
+	return dd_stats_enabled ? dd_stats_now() : 0;
+}
+
+static inline void dd_stats_end(int phase, u_int64_t start_ns, u_int64_t bytes)
+{
+	if ( start_ns )
+		dd_stats_record(phase, start_ns, bytes);
+}
+
+#endif
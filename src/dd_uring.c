@@ -0,0 +1,261 @@
+/*
+  ddless: io_uring write (and profiler read) submission (raw system calls,
+  no liburing)
+
+  A ring per thread, the caller keeps at most depth writes in flight and
+  reaps a completion before submitting more. Completions come back in any
+  order, ordering against a flush is up to the caller: reap everything,
+  then dd_uring_fsync(). Without io_uring (SunOS, old kernels, disabled by
+  sysctl) dd_uring_init() fails and the caller writes with pwrite.
+*/
+#include "dd_uring.h"
+#include "dd_log.h"
+#include <errno.h>
+
+#if !defined(SUNOS) && defined(__linux__)
+	#include <sys/syscall.h>
+	#include <linux/io_uring.h>
+#endif
+
+#if !defined(SUNOS) && defined(__NR_io_uring_setup)
+
+#define read_barrier()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define write_barrier()	__atomic_thread_fence(__ATOMIC_RELEASE)
+
+//-----------------------------------------------------------------------------
+int dd_uring_init(struct dd_uring *ring, unsigned depth)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(struct dd_uring));
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0 )
+	{
+		dd_log(LOG_INFO, "io_uring: setup of %u entries failed", depth);
+		return -1;
+	}
+	ring->depth = depth;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		if ( ring->cq_size > ring->sq_size )
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap64(0, ring->sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if ( ring->sq_ptr == MAP_FAILED )
+		goto err;
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+		ring->cq_ptr = ring->sq_ptr;
+	else
+	{
+		ring->cq_ptr = mmap64(0, ring->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if ( ring->cq_ptr == MAP_FAILED )
+			goto err;
+	}
+	ring->sqes = mmap64(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if ( ring->sqes == MAP_FAILED )
+		goto err;
+
+	ring->sq_head  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes     = (char *)ring->cq_ptr + p.cq_off.cqes;
+
+	dd_log(LOG_INFO, "io_uring: %u submission, %u completion entries",
+		p.sq_entries, p.cq_entries);
+	return 0;
+
+err:
+	dd_log(LOG_INFO, "io_uring: unable to map the rings");
+	dd_uring_exit(ring);
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// queue one sqe and submit it
+//-----------------------------------------------------------------------------
+static int uring_submit(struct dd_uring *ring, struct io_uring_sqe *template)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+
+	*sqe = *template;
+	ring->sq_array[index] = index;
+	write_barrier();
+	*ring->sq_tail = tail + 1;
+	write_barrier();
+
+	while ( syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) != 1 )
+	{
+		if ( errno != EINTR && errno != EAGAIN && errno != EBUSY )
+		{
+			dd_log(LOG_ERR, "io_uring: submission failed");
+			return -1;
+		}
+	}
+	ring->in_flight++;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int uring_rw(struct dd_uring *ring, int opcode, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user)
+{
+	struct io_uring_sqe sqe;
+
+	if ( ring->in_flight >= ring->depth )
+	{
+		dd_log(LOG_ERR, "io_uring: %u requests in flight, reap first", ring->in_flight);
+		return -1;
+	}
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	sqe.addr = (unsigned long)buf;
+	sqe.len = len;
+	sqe.off = offset;
+	sqe.user_data = (unsigned long)user;
+	return uring_submit(ring, &sqe);
+}
+
+//-----------------------------------------------------------------------------
+int dd_uring_write(struct dd_uring *ring, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user)
+{
+	return uring_rw(ring, IORING_OP_WRITE, fd, buf, len, offset, user);
+}
+
+//-----------------------------------------------------------------------------
+// reads for the ddzone profiler, the same rules as for writes
+//-----------------------------------------------------------------------------
+int dd_uring_read(struct dd_uring *ring, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user)
+{
+	return uring_rw(ring, IORING_OP_READ, fd, buf, len, offset, user);
+}
+
+//-----------------------------------------------------------------------------
+// wait for a completion, returns its user pointer and the result (bytes
+// written or -errno)
+//-----------------------------------------------------------------------------
+void *dd_uring_reap(struct dd_uring *ring, int *result)
+{
+	unsigned head;
+	struct io_uring_cqe *cqe;
+	void *user;
+
+	for (;;)
+	{
+		head = *ring->cq_head;
+		read_barrier();
+		if ( head != *ring->cq_tail )
+			break;
+		if ( syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			errno != EINTR )
+		{
+			dd_log(LOG_ERR, "io_uring: waiting for completions failed");
+			*result = -errno;
+			return NULL;
+		}
+	}
+
+	cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+	user = (void *)(unsigned long)cqe->user_data;
+	*result = cqe->res;
+	write_barrier();
+	*ring->cq_head = head + 1;
+	ring->in_flight--;
+	return user;
+}
+
+//-----------------------------------------------------------------------------
+// flush the file, only once all writes have been reaped
+//-----------------------------------------------------------------------------
+int dd_uring_fsync(struct dd_uring *ring, int fd)
+{
+	struct io_uring_sqe sqe;
+	int result;
+
+	if ( ring->in_flight > 0 )
+	{
+		dd_log(LOG_ERR, "io_uring: fsync with %u writes in flight", ring->in_flight);
+		return -1;
+	}
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_FSYNC;
+	sqe.fd = fd;
+	if ( uring_submit(ring, &sqe) == -1 )
+		return -1;
+	dd_uring_reap(ring, &result);
+	return result < 0 ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+void dd_uring_exit(struct dd_uring *ring)
+{
+	if ( ring->sqes != NULL && ring->sqes != MAP_FAILED )
+		munmap(ring->sqes, ring->sqes_size);
+	if ( ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr )
+		munmap(ring->cq_ptr, ring->cq_size);
+	if ( ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED )
+		munmap(ring->sq_ptr, ring->sq_size);
+	if ( ring->fd >= 0 )
+		close(ring->fd);
+	memset(ring, 0, sizeof(struct dd_uring));
+	ring->fd = -1;
+}
+
+#else
+
+//-----------------------------------------------------------------------------
+// no io_uring, callers fall back to pwrite
+//-----------------------------------------------------------------------------
+int dd_uring_init(struct dd_uring *ring, unsigned depth)
+{
+	memset(ring, 0, sizeof(struct dd_uring));
+	ring->fd = -1;
+	dd_log(LOG_INFO, "io_uring: not supported on this platform");
+	return -1;
+}
+
+int dd_uring_write(struct dd_uring *ring, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user)
+{
+	return -1;
+}
+
+int dd_uring_read(struct dd_uring *ring, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user)
+{
+	return -1;
+}
+
+void *dd_uring_reap(struct dd_uring *ring, int *result)
+{
+	*result = -1;
+	return NULL;
+}
+
+int dd_uring_fsync(struct dd_uring *ring, int fd)
+{
+	return -1;
+}
+
+void dd_uring_exit(struct dd_uring *ring)
+{
+}
+
+#endif
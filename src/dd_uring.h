@@ -0,0 +1,44 @@
+/*
+  ddless: io_uring write and read submission (raw system calls, no liburing)
+*/
+#ifndef DD_URING_INCLUDED
+#define DD_URING_INCLUDED
+
+#include "ddless.h"
+
+struct dd_uring
+{
+	int		fd;
+	unsigned	depth;
+	unsigned	in_flight;
+
+	// submission queue
+	unsigned	*sq_head;
+	unsigned	*sq_tail;
+	unsigned	*sq_mask;
+	unsigned	*sq_array;
+	void		*sqes;
+
+	// completion queue
+	unsigned	*cq_head;
+	unsigned	*cq_tail;
+	unsigned	*cq_mask;
+	void		*cqes;
+
+	void		*sq_ptr;
+	void		*cq_ptr;
+	size_t		sq_size;
+	size_t		cq_size;
+	size_t		sqes_size;
+};
+
+int dd_uring_init(struct dd_uring *ring, unsigned depth);
+int dd_uring_write(struct dd_uring *ring, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user);
+int dd_uring_read(struct dd_uring *ring, int fd, void *buf, u_int32_t len,
+	u_int64_t offset, void *user);
+void *dd_uring_reap(struct dd_uring *ring, int *result);
+int dd_uring_fsync(struct dd_uring *ring, int fd);
+void dd_uring_exit(struct dd_uring *ring);
+
+#endif
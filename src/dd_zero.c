@@ -0,0 +1,102 @@
+/*
+  ddless: zero segment detection
+
+  Thin provisioned volumes are mostly zeros. Checking a segment for zeros
+  runs at memory bandwidth, hashing it does not, so we check first and use
+  the known checksums of a zero segment instead.
+*/
+#include "dd_zero.h"
+#include "dd_murmurhash2.h"
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
+static const unsigned char zero_segment[SEGMENT_SIZE];
+
+//
+// word at a time check, used for the unaligned head/tail and on platforms
+// without SSE2
+//
+int dd_zero_check_scalar(const void *buf, u_int32_t len)
+{
+	const unsigned char *ptr = buf;
+	u_int64_t word;
+
+	while ( len >= sizeof(word) )
+	{
+		memcpy(&word, ptr, sizeof(word));
+		if ( word )
+			return 0;
+		ptr += sizeof(word);
+		len -= sizeof(word);
+	}
+	while ( len-- )
+	{
+		if ( *ptr++ )
+			return 0;
+	}
+	return 1;
+}
+
+//
+// returns 1 if all len bytes of buf are zero
+//
+int dd_zero_check(const void *buf, u_int32_t len)
+{
+	#if defined(__SSE2__)
+	const unsigned char *ptr = buf;
+
+	//
+	// align to 16 bytes (the read buffers are page aligned, so this
+	// only matters for odd callers)
+	//
+	u_int32_t head = (16 - ((unsigned long)ptr & 15)) & 15;
+	if ( head > len )
+		head = len;
+	if ( !dd_zero_check_scalar(ptr, head) )
+		return 0;
+	ptr += head;
+	len -= head;
+
+	//
+	// or 64 bytes per round together, test every 256 bytes so non-zero
+	// data bails out early
+	//
+	while ( len >= 256 )
+	{
+		__m128i acc = _mm_setzero_si128();
+		int i;
+		for ( i = 0; i < 256; i += 64 )
+		{
+			acc = _mm_or_si128(acc, _mm_load_si128((const __m128i *)(ptr + i)));
+			acc = _mm_or_si128(acc, _mm_load_si128((const __m128i *)(ptr + i + 16)));
+			acc = _mm_or_si128(acc, _mm_load_si128((const __m128i *)(ptr + i + 32)));
+			acc = _mm_or_si128(acc, _mm_load_si128((const __m128i *)(ptr + i + 48)));
+		}
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff )
+			return 0;
+		ptr += 256;
+		len -= 256;
+	}
+	return dd_zero_check_scalar(ptr, len);
+	#else
+	return dd_zero_check_scalar(buf, len);
+	#endif
+}
+
+//
+// checksums of len zero bytes, a full segment is a constant, short tail
+// segments are hashed (once per device)
+//
+void dd_zero_checksum(u_int32_t len, checksum_struct *checksum)
+{
+	if ( len == SEGMENT_SIZE )
+	{
+		checksum->checksum1_murmur = ZERO_CHECKSUM1_MURMUR;
+		checksum->checksum2_crc32 = ZERO_CHECKSUM2_CRC32;
+		return;
+	}
+	checksum->checksum1_murmur = MurmurHash2(zero_segment, len, MURMUR_SEED);
+	checksum->checksum2_crc32 = crc32(crc32(0L, Z_NULL, 0), zero_segment, len);
+}
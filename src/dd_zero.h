@@ -0,0 +1,19 @@
+/*
+  ddless: zero segment detection
+*/
+#ifndef DD_ZERO_INCLUDED
+#define DD_ZERO_INCLUDED
+
+#include "ddless.h"
+
+//
+// checksums of a full SEGMENT_SIZE segment of zeros
+//
+#define ZERO_CHECKSUM1_MURMUR 0x68b3db1f
+#define ZERO_CHECKSUM2_CRC32  0xab54d286
+
+int dd_zero_check(const void *buf, u_int32_t len);
+int dd_zero_check_scalar(const void *buf, u_int32_t len);
+void dd_zero_checksum(u_int32_t len, checksum_struct *checksum);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+  ddless: ddzone device profiler
+
+  Sweeps the read access mode (buffered, O_DIRECT), the pattern (sequential,
+  random), the block size and the queue depth. At every sweep point the
+  device is cut into zones and each zone gets an equal share of the time,
+  so the heatmap shows how the device behaves from its start to its end.
+  Reads are kept in flight with io_uring, without it only depth 1 runs
+  (pread). Latencies go into log-linear histograms (32 steps per power of
+  two, about 3% resolution) for the percentiles.
+
+  Buffered sweep points start with the device dropped from the page cache,
+  but reads within a point still hit it (a small zone wraps around, random
+  offsets repeat), so buffered results depend on the cache and the zone
+  size, O_DIRECT results do not.
+*/
+#include "dd_zone.h"
+#include "dd_log.h"
+#include "dd_file.h"
+#include "dd_uring.h"
+#include "dd_stats.h"
+#include "dd_cache.h"
+#include <errno.h>
+
+dd_zone_config zone_config;
+
+#define ZONE_SUB_BITS		5
+#define ZONE_SUB		(1 << ZONE_SUB_BITS)
+#define ZONE_BUCKETS		((64 - ZONE_SUB_BITS + 1) * ZONE_SUB)
+#define ZONE_ALIGN		4096	// O_DIRECT buffers, offsets and sizes
+
+typedef struct
+{
+	u_int64_t	count;
+	u_int64_t	max_ns;
+	u_int64_t	buckets[ZONE_BUCKETS];
+} zone_histogram;
+
+typedef struct
+{
+	void *		buffer;
+	u_int64_t	start_ns;
+} zone_slot;
+
+typedef struct
+{
+	int		fd;
+	int		mode;
+	int		pattern;
+	u_int32_t	size;
+	u_int32_t	depth;
+	u_int64_t	zone_size;
+	u_int64_t	seed;
+	struct dd_uring	ring;
+	int		uring;
+	zone_slot	slots[1024];
+	zone_histogram	zone;		// current zone
+	zone_histogram	total;		// the sweep point
+	FILE *		heatmap;
+	int		json;
+} zone_run;
+
+//-----------------------------------------------------------------------------
+void dd_zone_defaults()
+{
+	memset(&zone_config, 0, sizeof(zone_config));
+	zone_config.depths[0] = 1;
+	zone_config.depths[1] = 4;
+	zone_config.depths[2] = 16;
+	zone_config.depths[3] = 32;
+	zone_config.ndepths = 4;
+	zone_config.sizes[0] = SEGMENT_SIZE;
+	zone_config.sizes[1] = MEGABYTE_FACTOR;
+	zone_config.nsizes = 2;
+	zone_config.patterns = DD_ZONE_SEQUENTIAL | DD_ZONE_RANDOM;
+	zone_config.zones = 16;
+	zone_config.seconds = 2;
+}
+
+//-----------------------------------------------------------------------------
+// comma separated numbers times unit, returns the count or -1
+//-----------------------------------------------------------------------------
+int dd_zone_list(char *arg, u_int32_t *list, u_int32_t unit)
+{
+	int n = 0;
+	char *tok;
+
+	for(tok=strtok(arg, ","); tok != NULL; tok=strtok(NULL, ","))
+	{
+		if ( n == DD_ZONE_MAX_LIST || atoi(tok) < 1 )
+			return -1;
+		list[n++] = atoi(tok) * unit;
+	}
+	return n ? n : -1;
+}
+
+//-----------------------------------------------------------------------------
+int dd_zone_patterns(char *arg)
+{
+	int patterns = 0;
+	char *tok;
+
+	for(tok=strtok(arg, ","); tok != NULL; tok=strtok(NULL, ","))
+	{
+		if ( strcmp(tok, "seq") == 0 )
+			patterns |= DD_ZONE_SEQUENTIAL;
+		else if ( strcmp(tok, "rand") == 0 )
+			patterns |= DD_ZONE_RANDOM;
+		else
+			return -1;
+	}
+	return patterns ? patterns : -1;
+}
+
+//-----------------------------------------------------------------------------
+// log-linear histogram
+//-----------------------------------------------------------------------------
+static inline int zone_bucket(u_int64_t ns)
+{
+	int e;
+
+	if ( ns < ZONE_SUB )
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	return (e - ZONE_SUB_BITS + 1) * ZONE_SUB + ((ns >> (e - ZONE_SUB_BITS)) & (ZONE_SUB - 1));
+}
+
+static u_int64_t zone_bucket_ns(int bucket)
+{
+	int e = bucket / ZONE_SUB + ZONE_SUB_BITS - 1;
+
+	if ( bucket < ZONE_SUB )
+		return bucket;
+	// middle of the bucket
+	return ((u_int64_t)(ZONE_SUB + bucket % ZONE_SUB) << (e - ZONE_SUB_BITS)) +
+		((1ULL << (e - ZONE_SUB_BITS)) >> 1);
+}
+
+static void zone_record(zone_histogram *h, u_int64_t ns)
+{
+	h->count++;
+	h->buckets[zone_bucket(ns)]++;
+	if ( ns > h->max_ns )
+		h->max_ns = ns;
+}
+
+static double zone_percentile_us(zone_histogram *h, double p)
+{
+	u_int64_t target = h->count * p, seen = 0;
+	int b;
+
+	if ( h->count == 0 )
+		return 0;
+	if ( target >= h->count )
+		target = h->count - 1;
+	for(b=0; b < ZONE_BUCKETS; b++)
+	{
+		seen += h->buckets[b];
+		if ( seen > target )
+			break;
+	}
+	// the middle of the last bucket may lie above the slowest read
+	if ( zone_bucket_ns(b) > h->max_ns )
+		return (double)h->max_ns / 1000;
+	return (double)zone_bucket_ns(b) / 1000;
+}
+
+//-----------------------------------------------------------------------------
+// next read offset within the zone
+//-----------------------------------------------------------------------------
+static inline u_int64_t zone_offset(zone_run *run, u_int64_t zone_start, u_int64_t zone_blocks,
+	u_int64_t *cursor)
+{
+	if ( run->pattern == DD_ZONE_RANDOM )
+	{
+		run->seed ^= run->seed >> 12;
+		run->seed ^= run->seed << 25;
+		run->seed ^= run->seed >> 27;
+		return zone_start + (run->seed * 0x2545f4914f6cdd1dULL % zone_blocks) * run->size;
+	}
+	if ( *cursor == zone_blocks )
+		*cursor = 0;
+	return zone_start + (*cursor)++ * run->size;
+}
+
+//-----------------------------------------------------------------------------
+// read one zone for its share of the time, returns the bytes read or -1
+//-----------------------------------------------------------------------------
+static int64_t zone_read(zone_run *run, u_int64_t zone_start, u_int64_t zone_blocks,
+	u_int64_t deadline_ns)
+{
+	u_int64_t cursor = 0, bytes = 0, now;
+	u_int32_t i;
+	int result;
+	zone_slot *slot;
+
+	if ( !run->uring )
+	{
+		slot = &run->slots[0];
+		do
+		{
+			slot->start_ns = dd_stats_now();
+			result = pread(run->fd, slot->buffer, run->size,
+				zone_offset(run, zone_start, zone_blocks, &cursor));
+			now = dd_stats_now();
+			if ( result < 0 )
+			{
+				dd_log(LOG_ERR, "ddzone: read failed");
+				return -1;
+			}
+			zone_record(&run->zone, now - slot->start_ns);
+			bytes += result;
+		} while ( now < deadline_ns );
+		return bytes;
+	}
+
+	for(i=0; i < run->depth; i++)
+	{
+		run->slots[i].start_ns = dd_stats_now();
+		if ( dd_uring_read(&run->ring, run->fd, run->slots[i].buffer, run->size,
+			zone_offset(run, zone_start, zone_blocks, &cursor), &run->slots[i]) == -1 )
+			return -1;
+	}
+	while ( run->ring.in_flight > 0 )
+	{
+		if ( (slot = dd_uring_reap(&run->ring, &result)) == NULL || result < 0 )
+		{
+			errno = -result;
+			dd_log(LOG_ERR, "ddzone: read failed");
+			return -1;
+		}
+		now = dd_stats_now();
+		zone_record(&run->zone, now - slot->start_ns);
+		bytes += result;
+		if ( now < deadline_ns )
+		{
+			slot->start_ns = now;
+			if ( dd_uring_read(&run->ring, run->fd, slot->buffer, run->size,
+				zone_offset(run, zone_start, zone_blocks, &cursor), slot) == -1 )
+				return -1;
+		}
+	}
+	return bytes;
+}
+
+//-----------------------------------------------------------------------------
+// one sweep point: every zone, a heatmap row each and the summary line
+//-----------------------------------------------------------------------------
+static int zone_sweep(zone_run *run, u_int64_t source_size)
+{
+	static const char *modes[] = { "", "buffered", "direct" };
+	static const char *patterns[] = { "", "seq", "rand" };
+	u_int64_t zone_ns = zone_config.seconds * 1e9 / zone_config.zones;
+	u_int64_t total_bytes = 0, total_ns = 0, start_ns, ns, zone_start, zone_blocks;
+	int64_t bytes;
+	int zone, b;
+
+	//
+	// buffered: start from a cold page cache, not the previous point's reads
+	//
+	if ( run->mode == DD_ZONE_BUFFERED )
+		dd_cache_drop(run->fd, 0, 0);
+
+	memset(&run->total, 0, sizeof(run->total));
+	for(zone=0; zone < zone_config.zones; zone++)
+	{
+		zone_start = zone * run->zone_size / run->size * run->size;
+		zone_blocks = ( zone == zone_config.zones - 1 ? source_size - zone_start : run->zone_size ) /
+			run->size;
+		if ( zone_blocks == 0 )
+			continue;
+
+		memset(&run->zone, 0, sizeof(run->zone));
+		start_ns = dd_stats_now();
+		if ( (bytes = zone_read(run, zone_start, zone_blocks, start_ns + zone_ns)) == -1 )
+			return -1;
+		ns = dd_stats_now() - start_ns;
+		total_bytes += bytes;
+		total_ns += ns;
+
+		if ( run->json )
+			fprintf(run->heatmap, "{\"mode\": \"%s\", \"pattern\": \"%s\", \"block_size\": %u, "
+				"\"queue_depth\": %u, \"zone\": %d, \"zone_offset\": %llu, \"ios\": %llu, "
+				"\"mb_per_sec\": %0.2f, \"iops\": %0.0f, \"lat_p50_us\": %0.1f, "
+				"\"lat_p99_us\": %0.1f, \"lat_max_us\": %0.1f}\n",
+				modes[run->mode], patterns[run->pattern], run->size, run->depth, zone,
+				(long long unsigned)zone_start, (long long unsigned)run->zone.count,
+				(double)bytes / MEGABYTE_FACTOR / (ns / 1e9), run->zone.count / (ns / 1e9),
+				zone_percentile_us(&run->zone, 0.5), zone_percentile_us(&run->zone, 0.99),
+				run->zone.max_ns / 1000.0);
+		else
+			fprintf(run->heatmap, "%s,%s,%u,%u,%d,%llu,%llu,%0.2f,%0.0f,%0.1f,%0.1f,%0.1f\n",
+				modes[run->mode], patterns[run->pattern], run->size, run->depth, zone,
+				(long long unsigned)zone_start, (long long unsigned)run->zone.count,
+				(double)bytes / MEGABYTE_FACTOR / (ns / 1e9), run->zone.count / (ns / 1e9),
+				zone_percentile_us(&run->zone, 0.5), zone_percentile_us(&run->zone, 0.99),
+				run->zone.max_ns / 1000.0);
+
+		run->total.count += run->zone.count;
+		if ( run->zone.max_ns > run->total.max_ns )
+			run->total.max_ns = run->zone.max_ns;
+		for(b=0; b < ZONE_BUCKETS; b++)
+			run->total.buckets[b] += run->zone.buckets[b];
+	}
+
+	printf("%-8s %-4s %7uK %5u %10.2f %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		modes[run->mode], patterns[run->pattern], run->size / 1024, run->depth,
+		(double)total_bytes / MEGABYTE_FACTOR / (total_ns / 1e9), run->total.count / (total_ns / 1e9),
+		zone_percentile_us(&run->total, 0.5), zone_percentile_us(&run->total, 0.9),
+		zone_percentile_us(&run->total, 0.99), zone_percentile_us(&run->total, 0.999),
+		run->total.max_ns / 1000.0);
+	fflush(stdout);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// ddzone profiler: sweep mode, pattern, block size and queue depth
+//-----------------------------------------------------------------------------
+int dd_zone_profile(char *source_dev)
+{
+	zone_run run;
+	u_int64_t source_size;
+	u_int32_t max_depth = 0, max_size = 0;
+	int m, p, s, d, i, ret = -1;
+	char *suffix;
+
+	memset(&run, 0, sizeof(run));
+	run.seed = 1;
+	for(i=0; i < zone_config.ndepths; i++)
+	{
+		if ( zone_config.depths[i] > sizeof(run.slots) / sizeof(zone_slot) )
+		{
+			dd_log(LOG_ERR, "ddzone: queue depth %u above %u", zone_config.depths[i],
+				sizeof(run.slots) / sizeof(zone_slot));
+			return -1;
+		}
+		if ( zone_config.depths[i] > max_depth )
+			max_depth = zone_config.depths[i];
+	}
+	for(i=0; i < zone_config.nsizes; i++)
+	{
+		if ( zone_config.sizes[i] % ZONE_ALIGN )
+		{
+			dd_log(LOG_ERR, "ddzone: block size %u is not a multiple of %d", zone_config.sizes[i],
+				ZONE_ALIGN);
+			return -1;
+		}
+		if ( zone_config.sizes[i] > max_size )
+			max_size = zone_config.sizes[i];
+	}
+
+	if ( (run.fd = dd_dev_open_ro(source_dev, 0)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open source device: %s", source_dev);
+		return -1;
+	}
+	source_size = dd_device_size(run.fd);
+	close(run.fd);
+	run.zone_size = source_size / zone_config.zones;
+	if ( run.zone_size < max_size )
+	{
+		dd_log(LOG_ERR, "ddzone: %d zones of %llu bytes are smaller than the block size %u",
+			zone_config.zones, run.zone_size, max_size);
+		return -1;
+	}
+
+	suffix = strrchr(zone_config.heatmap_file, '.');
+	run.json = suffix != NULL && strcmp(suffix, ".json") == 0;
+	if ( (run.heatmap = fopen(zone_config.heatmap_file, "w")) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to create heatmap file: %s", zone_config.heatmap_file);
+		return -1;
+	}
+	if ( !run.json )
+		fprintf(run.heatmap, "mode,pattern,block_size,queue_depth,zone,zone_offset,ios,"
+			"mb_per_sec,iops,lat_p50_us,lat_p99_us,lat_max_us\n");
+
+	for(i=0; i < max_depth; i++)
+	{
+		if ( posix_memalign(&run.slots[i].buffer, ZONE_ALIGN, max_size) != 0 )
+		{
+			dd_log(LOG_ERR, "unable to allocate read buffers");
+			goto out;
+		}
+	}
+	run.uring = dd_uring_init(&run.ring, max_depth) == 0;
+	if ( !run.uring )
+		dd_log(LOG_INFO, "ddzone: no io_uring, queue depths above 1 are skipped");
+
+	dd_log(LOG_INFO, "ddzone: %llu bytes, %d zones, %0.1f seconds per sweep point",
+		source_size, zone_config.zones, zone_config.seconds);
+	printf("%-8s %-4s %8s %5s %10s %10s %9s %9s %9s %9s %9s\n", "mode", "io", "block", "depth",
+		"MB/s", "IOPS", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+	for(m=DD_ZONE_BUFFERED; m <= DD_ZONE_DIRECT; m++)
+	{
+		if ( !(zone_config.modes & m) )
+			continue;
+		if ( (run.fd = dd_dev_open_ro(source_dev, m == DD_ZONE_DIRECT)) == -1 )
+		{
+			dd_log(LOG_ERR, "unable to open source device: %s", source_dev);
+			goto out;
+		}
+		run.mode = m;
+		for(p=DD_ZONE_SEQUENTIAL; p <= DD_ZONE_RANDOM; p++)
+		{
+			if ( !(zone_config.patterns & p) )
+				continue;
+			run.pattern = p;
+			for(s=0; s < zone_config.nsizes; s++)
+			{
+				run.size = zone_config.sizes[s];
+				for(d=0; d < zone_config.ndepths; d++)
+				{
+					run.depth = zone_config.depths[d];
+					if ( run.depth > 1 && !run.uring )
+						continue;
+					if ( zone_sweep(&run, source_size) == -1 )
+					{
+						close(run.fd);
+						goto out;
+					}
+				}
+			}
+		}
+		close(run.fd);
+	}
+	ret = 0;
+
+out:
+	if ( run.uring )
+		dd_uring_exit(&run.ring);
+	for(i=0; i < max_depth; i++)
+		free(run.slots[i].buffer);
+	if ( fclose(run.heatmap) == EOF )
+	{
+		dd_log(LOG_ERR, "unable to write heatmap file: %s", zone_config.heatmap_file);
+		ret = -1;
+	}
+	return ret;
+}
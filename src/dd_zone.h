@@ -0,0 +1,37 @@
+/*
+  ddless: ddzone device profiler
+*/
+#ifndef DD_ZONE_INCLUDED
+#define DD_ZONE_INCLUDED
+
+#include "ddless.h"
+
+#define DD_ZONE_MAX_LIST	16
+
+#define DD_ZONE_SEQUENTIAL	1
+#define DD_ZONE_RANDOM		2
+
+#define DD_ZONE_BUFFERED	1
+#define DD_ZONE_DIRECT		2
+
+typedef struct
+{
+	char		heatmap_file[DEV_NAME_LENGTH];	// .json: JSON lines, else CSV
+	u_int32_t	depths[DD_ZONE_MAX_LIST];
+	int		ndepths;
+	u_int32_t	sizes[DD_ZONE_MAX_LIST];	// bytes
+	int		nsizes;
+	int		patterns;
+	int		modes;
+	int		zones;
+	double		seconds;			// per sweep point
+} dd_zone_config;
+
+extern dd_zone_config zone_config;
+
+void dd_zone_defaults();
+int dd_zone_list(char *arg, u_int32_t *list, u_int32_t unit);
+int dd_zone_patterns(char *arg);
+int dd_zone_profile(char *source_dev);
+
+#endif
@@ -0,0 +1,588 @@
+/*
+  ddbench: per core speed of the hot kernels
+
+  Every kernel runs on fixed seed input (about 2:1 compressible data,
+  zeros for the zero checks) for each segment size and buffer alignment,
+  after warm-up rounds, for a number of repetitions. The median and best
+  rate are reported with the cycles per byte (x86 time stamp counter,
+  which ticks at the nominal rate of the cpu).
+
+  The dirty run extraction of process_buffer() and the bit walk of
+  ddmap_worker_thread() are copies of those loops without their reads and
+  writes, they have to follow changes made there. The ctz bit walk is the
+  word skipping alternative, its runs are checked against the copy.
+*/
+
+#include "ddless.h"
+#include "dd_log.h"
+#include "dd_murmurhash2.h"
+#include "dd_zero.h"
+#include "dd_stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define BENCH_CYCLES() __rdtsc()
+#else
+	#define BENCH_CYCLES() 0
+#endif
+
+parms_struct parms;
+
+#define BENCH_BUFFER		READ_BUFFER_SIZE
+#define BENCH_MAP_SEGMENTS	(GIGABYTE_FACTOR / SEGMENT_SIZE)	// 1GB of ddmap
+#define BENCH_MAX_LIST		16
+#define BENCH_MAX_REPS		1000
+
+typedef struct
+{
+	unsigned char *	data;		// BENCH_BUFFER + alignment slack
+	unsigned char *	zeros;
+	unsigned char *	zbuf;		// compress output
+	uLongf		zbuf_size;
+	unsigned char *	zchunks;	// uncompress input, one per chunk
+	uLongf *	zchunk_size;
+	u_int64_t	zchunk_stride;
+	int		dirty_map[BUFFER_SEGMENTS+1];
+	u_int32_t	ddmap[BENCH_MAP_SEGMENTS / 32];
+	u_int64_t	seed;
+	int		ziplevel;
+	int		density;	// percent of dirty segments/ddmap bits
+} bench_struct;
+
+bench_struct bench;
+
+volatile u_int64_t bench_sink;	// keeps the results alive
+
+//-----------------------------------------------------------------------------
+// xorshift64*, the input is the same for every run
+//-----------------------------------------------------------------------------
+static inline u_int64_t bench_random()
+{
+	bench.seed ^= bench.seed >> 12;
+	bench.seed ^= bench.seed << 25;
+	bench.seed ^= bench.seed >> 27;
+	return bench.seed * 0x2545f4914f6cdd1dULL;
+}
+
+//-----------------------------------------------------------------------------
+// kernels: process len bytes at buf, chunk is the index of the chunk
+//-----------------------------------------------------------------------------
+u_int64_t kernel_murmur(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	return MurmurHash2(buf, len, MURMUR_SEED);
+}
+
+u_int64_t kernel_crc32(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	return crc32(crc32(0L, Z_NULL, 0), buf, len);
+}
+
+u_int64_t kernel_zero(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	return dd_zero_check(bench.zeros + (buf - bench.data), len);
+}
+
+u_int64_t kernel_zero_scalar(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	return dd_zero_check_scalar(bench.zeros + (buf - bench.data), len);
+}
+
+u_int64_t kernel_compress(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	uLongf bound = bench.zbuf_size;
+
+	if ( compress2(bench.zbuf, &bound, buf, len, bench.ziplevel) != Z_OK )
+	{
+		dd_log(LOG_ERR, "compress2 failed");
+		exit(1);
+	}
+	return bound;
+}
+
+u_int64_t kernel_uncompress(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	uLongf dest_len = bench.zbuf_size;
+
+	if ( uncompress(bench.zbuf, &dest_len, bench.zchunks + chunk * bench.zchunk_stride,
+		bench.zchunk_size[chunk]) != Z_OK || dest_len != len )
+	{
+		dd_log(LOG_ERR, "uncompress failed");
+		exit(1);
+	}
+	return dest_len;
+}
+
+//
+// process_buffer(): coalesce the dirty segments of a read buffer into writes
+//
+u_int64_t kernel_dirty_runs(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	int seg_i;
+	int active_segment_bytes = 0;
+	const unsigned char *buf_dirty_ptr = NULL;
+	u_int64_t write_offset = 0;
+	u_int64_t result = 0;
+
+	for(seg_i = 0; seg_i < BUFFER_SEGMENTS+1; seg_i++)
+	{
+		if ( bench.dirty_map[seg_i] != 0 && !active_segment_bytes )
+		{
+			active_segment_bytes = bench.dirty_map[seg_i];
+			buf_dirty_ptr = buf + (seg_i * SEGMENT_SIZE);
+			write_offset = seg_i * SEGMENT_SIZE;
+		}
+		else if ( bench.dirty_map[seg_i] != 0 && active_segment_bytes )
+		{
+			active_segment_bytes += bench.dirty_map[seg_i];
+		}
+		else if ( bench.dirty_map[seg_i] == 0 && active_segment_bytes )
+		{
+			result += write_offset + active_segment_bytes + (buf_dirty_ptr - buf);
+			active_segment_bytes = 0;
+		}
+	}
+	return result;
+}
+
+//
+// ddmap_worker_thread(): one bit at a time, a run is read in buffers of up
+// to READ_BUFFER_SIZE. Returns the sum of the read positions and sizes.
+//
+u_int64_t kernel_bitwalk(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	const u_int32_t *map, *map_end = bench.ddmap + BENCH_MAP_SEGMENTS / 32;
+	u_int32_t map_mask, bit, bit_prev = 0;
+	u_int64_t source_pos = 0, source_pos_start = 0, result = 0;
+	u_int32_t read_size = 0;
+
+	for (map=bench.ddmap; map<map_end; map++)
+	{
+		map_mask = 0x00000001;
+		while (map_mask)
+		{
+			bit = ((*map & map_mask) > 0);
+
+			if ( bit == 1 && bit_prev == 0 )
+			{
+				source_pos_start = source_pos;
+				read_size = SEGMENT_SIZE;
+			}
+			else if ( bit == 1 && bit_prev == 1 )
+			{
+				if ( read_size + SEGMENT_SIZE > READ_BUFFER_SIZE )
+				{
+					result += source_pos_start + read_size;
+					source_pos_start = source_pos;
+					read_size = 0;
+				}
+				read_size += SEGMENT_SIZE;
+			}
+			else if ( bit == 0 && bit_prev == 1 )
+			{
+				result += source_pos_start + read_size;
+			}
+			bit_prev = bit;
+			source_pos += SEGMENT_SIZE;
+			map_mask = map_mask << 1;
+		}
+	}
+	if ( bit_prev == 1 )
+		result += source_pos_start + read_size;
+	return result;
+}
+
+//
+// word skipping bit walk: whole words without an edge are skipped, the
+// edges within a word are found with count trailing zeros
+//
+static inline u_int64_t bitwalk_run(u_int64_t start, u_int64_t end)
+{
+	u_int64_t result = 0;
+	u_int64_t pos = start * SEGMENT_SIZE, size = (end - start) * SEGMENT_SIZE;
+
+	while ( size > READ_BUFFER_SIZE )
+	{
+		result += pos + READ_BUFFER_SIZE;
+		pos += READ_BUFFER_SIZE;
+		size -= READ_BUFFER_SIZE;
+	}
+	return result + pos + size;
+}
+
+u_int64_t kernel_bitwalk_ctz(const unsigned char *buf, u_int32_t len, u_int64_t chunk)
+{
+	u_int64_t w, words = BENCH_MAP_SEGMENTS / 32, run_start = 0, result = 0;
+	int in_run = 0;
+
+	for (w=0; w < words; w++)
+	{
+		u_int32_t word = bench.ddmap[w];
+		u_int32_t bit = 0, rest;
+
+		if ( word == (in_run ? 0xffffffff : 0) )
+			continue;
+		while ( bit < 32 )
+		{
+			rest = (in_run ? ~word : word) >> bit;
+			if ( rest == 0 )
+				break;
+			bit += __builtin_ctz(rest);
+			if ( in_run )
+				result += bitwalk_run(run_start, w * 32 + bit);
+			else
+				run_start = w * 32 + bit;
+			in_run = !in_run;
+		}
+	}
+	if ( in_run )
+		result += bitwalk_run(run_start, words * 32);
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// kernel table: sized kernels run per segment size and alignment, the
+// others walk their fixed map and report the source bytes it covers and
+// the cycles per segment. factor
+// scales the bytes per repetition (slow kernels less, map walks more).
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	char *		name;
+	int		sized;
+	double		factor;
+	u_int64_t	(*run)(const unsigned char *buf, u_int32_t len, u_int64_t chunk);
+} bench_kernel;
+
+bench_kernel kernels[] =
+{
+	{ "murmur2",		1, 1,		kernel_murmur },
+	{ "crc32",		1, 1,		kernel_crc32 },
+#if defined(__SSE2__)
+	{ "zero_sse2",		1, 4,		kernel_zero },
+#else
+	{ "zero",		1, 4,		kernel_zero },
+#endif
+	{ "zero_scalar",	1, 4,		kernel_zero_scalar },
+	{ "compress2",		1, 0.125,	kernel_compress },
+	{ "uncompress",		1, 0.5,		kernel_uncompress },
+	{ "dirty_runs",		0, 64,		kernel_dirty_runs },
+	{ "bitwalk",		0, 64,		kernel_bitwalk },
+	{ "bitwalk_ctz",	0, 64,		kernel_bitwalk_ctz },
+	{ NULL,			0, 0,		NULL }
+};
+
+//-----------------------------------------------------------------------------
+// input: half random, half repeated text per 4KB, dirty map and ddmap with
+// runs of 1..16 segments (8.5 on average) covering about density percent
+//-----------------------------------------------------------------------------
+int bench_setup()
+{
+	static const char text[] = "ddbench input block of a filesystem, compressible half.\n";
+	u_int64_t i, j, n;
+	u_int64_t *p;
+
+	if ( posix_memalign((void **)&bench.data, 4096, BENCH_BUFFER + 4096) != 0 ||
+		posix_memalign((void **)&bench.zeros, 4096, BENCH_BUFFER + 4096) != 0 )
+	{
+		dd_log(LOG_ERR, "unable to allocate the input buffers");
+		return -1;
+	}
+	memset(bench.zeros, 0, BENCH_BUFFER + 4096);
+	for(i=0; i < BENCH_BUFFER + 4096; i += 4096)
+	{
+		p = (u_int64_t *)(bench.data + i);
+		for(j=0; j < 2048 / sizeof(u_int64_t); j++)
+			p[j] = bench_random();
+		for(j=2048; j < 4096; j++)
+			bench.data[i + j] = text[j % (sizeof(text) - 1)];
+	}
+
+	bench.zbuf_size = compressBound(BENCH_BUFFER);
+	if ( (bench.zbuf = malloc(bench.zbuf_size)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate the compress buffer");
+		return -1;
+	}
+
+	memset(bench.dirty_map, 0, sizeof(bench.dirty_map));
+	for(i=0; i < BUFFER_SEGMENTS; i++)
+	{
+		if ( bench_random() % 850 >= bench.density )
+			continue;
+		for(n = 1 + bench_random() % 16; n-- && i < BUFFER_SEGMENTS; i++)
+			bench.dirty_map[i] = SEGMENT_SIZE;
+	}
+	memset(bench.ddmap, 0, sizeof(bench.ddmap));
+	for(i=0; i < BENCH_MAP_SEGMENTS; i++)
+	{
+		if ( bench_random() % 850 >= bench.density )
+			continue;
+		for(n = 1 + bench_random() % 16; n-- && i < BENCH_MAP_SEGMENTS; i++)
+			bench.ddmap[i >> 5] |= 1U << (i & 31);
+	}
+
+	if ( kernel_bitwalk(NULL, 0, 0) != kernel_bitwalk_ctz(NULL, 0, 0) )
+	{
+		dd_log(LOG_ERR, "bitwalk and bitwalk_ctz disagree");
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// compressed copies of every chunk for the uncompress kernel
+//-----------------------------------------------------------------------------
+int bench_zchunks(u_int32_t size, u_int32_t align, u_int64_t chunks)
+{
+	u_int64_t chunk;
+
+	free(bench.zchunks);
+	free(bench.zchunk_size);
+	bench.zchunk_stride = compressBound(size);
+	if ( (bench.zchunks = malloc(bench.zchunk_stride * chunks)) == NULL ||
+		(bench.zchunk_size = malloc(sizeof(uLongf) * chunks)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate the compressed chunks");
+		return -1;
+	}
+	for(chunk=0; chunk < chunks; chunk++)
+	{
+		bench.zchunk_size[chunk] = bench.zchunk_stride;
+		if ( compress2(bench.zchunks + chunk * bench.zchunk_stride, &bench.zchunk_size[chunk],
+			bench.data + align + chunk * size, size, bench.ziplevel) != Z_OK )
+		{
+			dd_log(LOG_ERR, "compress2 failed");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+//-----------------------------------------------------------------------------
+// time one kernel at one size and alignment
+//-----------------------------------------------------------------------------
+int bench_kernel_run(bench_kernel *k, u_int32_t size, u_int32_t align,
+	u_int64_t rep_bytes, int warmups, int reps, int json)
+{
+	double rate[BENCH_MAX_REPS], cpb[BENCH_MAX_REPS];
+	u_int64_t chunks, chunk, bytes, target, covered;
+	u_int64_t sink = 0, start_ns, start_cycles, ns, cycles;
+	int rep;
+
+	if ( k->sized )
+	{
+		chunks = (BENCH_BUFFER - align) / size;
+		covered = size;
+	}
+	else
+	{
+		chunks = 1;
+		covered = k->run == kernel_dirty_runs ? (u_int64_t)BUFFER_SEGMENTS * SEGMENT_SIZE :
+			(u_int64_t)BENCH_MAP_SEGMENTS * SEGMENT_SIZE;
+	}
+	if ( k->run == kernel_uncompress && bench_zchunks(size, align, chunks) == -1 )
+		return -1;
+	target = rep_bytes * k->factor;
+	if ( target < covered )
+		target = covered;
+
+	for(rep=-warmups; rep < reps; rep++)
+	{
+		start_ns = dd_stats_now();
+		start_cycles = BENCH_CYCLES();
+		for(bytes=0, chunk=0; bytes < target; bytes += covered)
+		{
+			sink += k->run(bench.data + align + chunk * size, covered, chunk);
+			if ( ++chunk == chunks )
+				chunk = 0;
+		}
+		cycles = BENCH_CYCLES() - start_cycles;
+		ns = dd_stats_now() - start_ns;
+		if ( rep < 0 )
+			continue;
+		rate[rep] = ns ? (double)bytes / ns : 0;	// bytes/ns = GB/s
+		cpb[rep] = (double)cycles / bytes * (k->sized ? 1 : SEGMENT_SIZE);
+	}
+	bench_sink += sink;
+
+	qsort(rate, reps, sizeof(double), bench_compare);
+	qsort(cpb, reps, sizeof(double), bench_compare);
+	if ( json )
+	{
+		printf("{\"kernel\": \"%s\", \"size\": %u, \"align\": %u, \"reps\": %d, "
+			"\"gb_per_sec\": %0.3f, \"gb_per_sec_best\": %0.3f, \"%s\": %0.4f}\n",
+			k->name, k->sized ? size : 0, k->sized ? align : 0, reps,
+			rate[reps / 2], rate[reps - 1],
+			k->sized ? "cycles_per_byte" : "cycles_per_segment", cpb[reps / 2]);
+	}
+	else if ( k->sized )
+	{
+		printf("%-14s %8u %6u %10.3f %10.3f %10.4f\n", k->name, size, align,
+			rate[reps / 2], rate[reps - 1], cpb[reps / 2]);
+	}
+	else
+	{
+		printf("%-14s %8s %6s %10.3f %10.3f %10.4f/seg\n", k->name, "-", "-",
+			rate[reps / 2], rate[reps - 1], cpb[reps / 2]);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// comma separated numbers
+//-----------------------------------------------------------------------------
+int bench_list(char *arg, u_int32_t *list)
+{
+	int n = 0;
+	char *tok;
+
+	for(tok=strtok(arg, ","); tok != NULL && n < BENCH_MAX_LIST; tok=strtok(NULL, ","))
+		list[n++] = strtoul(tok, NULL, 10);
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+// help
+//-----------------------------------------------------------------------------
+void usage()
+{
+	bench_kernel *k;
+
+	printf(
+"ddbench by Graham Houston, release date: "RELEASE_DATE"\n"
+"\n"
+"Measure the hashing, compression, zero check and map walking kernels\n"
+"\n"
+"	ddbench	[-k kernel,...] [-s size,...] [-a align,...] [-m MB] [-r #] [-W #]\n"
+"		[-l #] [-D #] [-j] [-v]\n"
+"\n"
+"Parameters\n"
+"	-k	kernels to run (default all):");
+	for(k=kernels; k->name != NULL; k++)
+		printf(" %s", k->name);
+	printf("\n"
+"	-s	segment sizes in bytes (default 4096,16384,65536)\n"
+"	-a	buffer alignments in bytes (default 0,1,8)\n"
+"	-m	megabytes per repetition (default 64, scaled per kernel)\n"
+"	-r	repetitions, the median is reported (default 5)\n"
+"	-W	warm-up rounds (default 1)\n"
+"	-l	compression level (default 6)\n"
+"	-D	percent of dirty segments and ddmap bits (default 10)\n"
+"	-j	JSON lines\n"
+"	-v	verbose\n"
+"\n"
+"Exit codes:\n"
+"	0	successful\n"
+"	1	a runtime error code, unable to complete task\n"
+);
+}
+
+//-----------------------------------------------------------------------------
+// main
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	int c, errflg = 0, i, j;
+	extern char *optarg;
+	char selected[DEV_NAME_LENGTH] = "";
+	char sizes_arg[DEV_NAME_LENGTH] = "4096,16384,65536";
+	char aligns_arg[DEV_NAME_LENGTH] = "0,1,8";
+	u_int32_t sizes[BENCH_MAX_LIST], aligns[BENCH_MAX_LIST];
+	int nsizes, naligns;
+	u_int64_t rep_mb = 64;
+	int reps = 5, warmups = 1, json = 0;
+	bench_kernel *k;
+
+	dd_log_init("ddbench");
+	bench.seed = 1;
+	bench.ziplevel = 6;
+	bench.density = 10;
+
+	while ((c = getopt(argc, argv, "k:s:a:m:r:W:l:D:jvh?")) != -1)
+	{
+		switch (c)
+		{
+			case 'k':
+				snprintf(selected, sizeof(selected), ",%s,", optarg);
+				break;
+			case 's':
+				strncpy(sizes_arg, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'a':
+				strncpy(aligns_arg, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'm':
+				rep_mb = strtoull(optarg, NULL, 10);
+				break;
+			case 'r':
+				reps = atoi(optarg);
+				break;
+			case 'W':
+				warmups = atoi(optarg);
+				break;
+			case 'l':
+				bench.ziplevel = atoi(optarg);
+				break;
+			case 'D':
+				bench.density = atoi(optarg);
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'v':
+				dd_loglevel_inc();
+				break;
+			case 'h':
+			case '?':
+				errflg++;
+		}
+	}
+	nsizes = bench_list(sizes_arg, sizes);
+	naligns = bench_list(aligns_arg, aligns);
+	for(i=0; i < nsizes; i++)
+		if ( sizes[i] == 0 || sizes[i] > BENCH_BUFFER / 2 )
+			errflg++;
+	for(i=0; i < naligns; i++)
+		if ( aligns[i] >= 4096 )
+			errflg++;
+	if ( errflg || reps < 1 || reps > BENCH_MAX_REPS || warmups < 0 || rep_mb == 0 ||
+		bench.ziplevel < 1 || bench.ziplevel > 9 || bench.density < 0 || bench.density > 100 )
+	{
+		usage();
+		exit(1);
+	}
+
+	if ( bench_setup() == -1 )
+		exit(1);
+
+	if ( !json )
+		printf("%-14s %8s %6s %10s %10s %10s\n", "kernel", "size", "align",
+			"GB/s", "best GB/s", "cycles/B");
+	for(k=kernels; k->name != NULL; k++)
+	{
+		char name[DEV_NAME_LENGTH];
+
+		snprintf(name, sizeof(name), ",%s,", k->name);
+		if ( *selected && strstr(selected, name) == NULL )
+			continue;
+		if ( !k->sized )
+		{
+			if ( bench_kernel_run(k, 0, 0, rep_mb * MEGABYTE_FACTOR, warmups, reps, json) == -1 )
+				exit(1);
+			continue;
+		}
+		for(i=0; i < nsizes; i++)
+			for(j=0; j < naligns; j++)
+				if ( bench_kernel_run(k, sizes[i], aligns[j], rep_mb * MEGABYTE_FACTOR,
+					warmups, reps, json) == -1 )
+					exit(1);
+	}
+	exit(0);
+}
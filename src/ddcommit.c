@@ -8,6 +8,13 @@
 #include "dd_murmurhash2.h"
 #include "dd_file.h"
 #include "dd_map.h"
+#include "dd_checksum.h"
+#include "dd_uring.h"
+#include "dd_stats.h"
+#include "dd_delta.h"
+#include "dd_zero.h"
+#include <errno.h>
+#include <getopt.h>
 
 parms_struct parms;
 
@@ -81,7 +88,7 @@ void write_checksum(Bytef * ptr, checksum_struct *checksum_ptr, u_int64_t csize)
 	u_int32_t checksum1_murmur;
 	u_int32_t checksum2_crc32 = crc32( 0L, Z_NULL, 0 );
 
-	checksum1_murmur = MurmurHash2(ptr, csize, 0xbabeaffe);
+	checksum1_murmur = MurmurHash2(ptr, csize, MURMUR_SEED);
 	checksum2_crc32 = crc32(checksum2_crc32, ptr, csize);
 
 	checksum_ptr->checksum1_murmur = checksum1_murmur;
@@ -89,7 +96,7 @@ void write_checksum(Bytef * ptr, checksum_struct *checksum_ptr, u_int64_t csize)
 
 }
 //-----------------------------------------------------------------------------
-int open_file_with_size(char *filetype, char *filename, u_int64_t filesize)
+int open_file_with_size(char *filetype, char *filename, u_int64_t filesize, int allow_shrink)
 {
         int tmp_fd;
 	u_int64_t tmp_size;
@@ -144,7 +151,11 @@ int open_file_with_size(char *filetype, char *filename, u_int64_t filesize)
                         	exit (1);
                 	}
                 }
-                if ( tmp_size > filesize ) 
+                if ( tmp_size > filesize && allow_shrink )
+		{
+                        dd_log(LOG_INFO, "%s file %s will be reduced from %llu to %llu bytes", filetype, filename, tmp_size, filesize);
+        	}
+                else if ( tmp_size > filesize ) 
 		{
                         dd_log(LOG_ERR, "refusing to reduce the size of %s file %s from %llu to %llu bytes", filetype, filename, tmp_size, filesize);
                         exit (1);
@@ -163,8 +174,1380 @@ int open_file_with_size(char *filetype, char *filename, u_int64_t filesize)
         }
 
 
-	if (tmp_fd < 0) exit (1);
-        return (tmp_fd);
+	if (tmp_fd < 0) exit (1);
+        return (tmp_fd);
+}
+
+//-----------------------------------------------------------------------------
+// records of a delta file from offset on: mapped, records parsed in place,
+// or buffered if the file cannot be mapped
+//-----------------------------------------------------------------------------
+int delta_reader_open(dd_delta_reader *reader, u_int64_t offset)
+{
+	if ( dd_delta_reader_map(reader, parms.delta_fd, offset,
+		parms.delta_size_bytes - sizeof(delta_footer), parms.delta_size_bytes) == 0 )
+		return 0;
+
+	dd_log(LOG_INFO, "reading delta %s buffered", parms.delta_file);
+	if ( lseek64(parms.delta_fd, offset, SEEK_SET) == -1 )
+	{
+		dd_log(LOG_ERR,"seek set to read offset: %llu failed", offset);
+		return -1;
+	}
+	return dd_delta_reader_init(reader, parms.delta_fd, offset);
+}
+
+//-----------------------------------------------------------------------------
+// skip a payload, buffer holds READ_BUFFER_SIZE bytes
+//-----------------------------------------------------------------------------
+int delta_skip(dd_delta_reader *reader, u_int64_t bytes, void *buffer)
+{
+	if ( reader->map != NULL )
+		return dd_delta_take(reader, bytes) == NULL ? -1 : 0;
+
+	while ( bytes > 0 )
+	{
+		u_int64_t n = bytes > READ_BUFFER_SIZE ? READ_BUFFER_SIZE : bytes;
+
+		if ( dd_delta_read(reader, buffer, n) == -1 )
+			return -1;
+		bytes -= n;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// rolling hash deltas: copy records refer to the old target, so all of them
+// are read into a spool file before the first write changes the target
+//-----------------------------------------------------------------------------
+int spool_copy_records(int target_fd, u_int64_t seg_count, void *buffer)
+{
+	int spool_fd;
+	u_int64_t i;
+	char spool_file[DEV_NAME_LENGTH + sizeof(".spool")];
+	dd_delta_reader reader;
+
+	if ( snprintf(spool_file, sizeof(spool_file), "%s.spool", parms.delta_file) >= sizeof(spool_file) )
+	{
+		dd_log(LOG_ERR, "spool file name of %s is too long", parms.delta_file);
+		return -1;
+	}
+	if ((spool_fd = open(spool_file, O_CREAT|O_RDWR|O_TRUNC|O_LARGEFILE, (mode_t)0600)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to create spool file: %s", spool_file);
+		return -1;
+	}
+	unlink(spool_file);
+
+	if ( delta_reader_open(&reader, sizeof(delta_header)) == -1 )
+		return -1;
+
+	for (i=0; i < seg_count; i++)
+	{
+		u_int64_t record[2];
+
+		if ( dd_delta_read(&reader, record, sizeof(record)) == -1 )
+		{
+			dd_log(LOG_ERR, "delta is truncated at block %llu", i+1);
+			return -1;
+		}
+		u_int64_t seg_offset = record[0];
+		u_int64_t data_size  = record[1];
+
+		if ( !(data_size & DELTA_COPY_RECORD) )
+		{
+			if ( delta_skip(&reader, data_size + (parms.recordcrcflag ? sizeof(u_int64_t) : 0), buffer) == -1 )
+			{
+				dd_log(LOG_ERR, "unable to skip %llu bytes of block %llu", data_size, i+1);
+				return -1;
+			}
+			continue;
+		}
+
+		u_int64_t copy_offset = 0;
+		data_size &= ~DELTA_COPY_RECORD;
+		if ( dd_delta_read(&reader, &copy_offset, sizeof(copy_offset)) == -1 ||
+			( parms.recordcrcflag && delta_skip(&reader, sizeof(u_int64_t), buffer) == -1 ) )
+		{
+			dd_log(LOG_ERR, "delta is truncated at copy record %llu", i+1);
+			return -1;
+		}
+		if ( data_size > READ_BUFFER_SIZE )
+		{
+			dd_log(LOG_ERR, "copy record %llu of %llu bytes exceeds the buffer", i+1, data_size);
+			return -1;
+		}
+		if ( pread64(target_fd, buffer, data_size, copy_offset) != data_size )
+		{
+			dd_log(LOG_ERR, "unable to read %llu bytes at %llu from target for block %llu",
+				data_size, copy_offset, i+1);
+			return -1;
+		}
+		if ( write(spool_fd, buffer, data_size) != data_size )
+		{
+			dd_log(LOG_ERR, "unable to write spool file: %s", spool_file);
+			return -1;
+		}
+		dd_log(LOG_DEBUG, "spooled %llu bytes from %llu for offset %llu",
+			data_size, copy_offset, seg_offset);
+	}
+	dd_delta_reader_free(&reader);
+
+	if ( lseek64(spool_fd, 0, SEEK_SET) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to rewind spool file");
+		return -1;
+	}
+	return spool_fd;
+}
+
+//-----------------------------------------------------------------------------
+// rolling hash deltas: records are not on the segment grid, checksum the
+// segments they touched from the target once everything is written
+//-----------------------------------------------------------------------------
+int rehash_dirty_segments(int target_fd, u_int8_t *dirty, u_int64_t source_size,
+	u_int64_t check_seg_size, void *buffer)
+{
+	u_int64_t segments = (source_size + check_seg_size - 1) / check_seg_size;
+	u_int64_t max_segments = READ_BUFFER_SIZE / check_seg_size;
+	u_int64_t j = 0, k;
+
+	while ( j < segments )
+	{
+		if ( !dirty[j] )
+		{
+			j++;
+			continue;
+		}
+
+		//
+		// read a run of dirty segments at once
+		//
+		u_int64_t run = 1;
+		while ( j + run < segments && dirty[j + run] && run < max_segments )
+			run++;
+		u_int64_t offset = j * check_seg_size;
+		u_int64_t bytes = run * check_seg_size;
+		if ( offset + bytes > source_size )
+			bytes = source_size - offset;
+
+		if ( pread64(target_fd, buffer, bytes, offset) != bytes )
+		{
+			dd_log(LOG_ERR, "unable to read %llu bytes at %llu from target", bytes, offset);
+			return -1;
+		}
+		for (k = 0; k < run; k++)
+		{
+			u_int64_t csize = check_seg_size;
+			if ( k * check_seg_size + csize > bytes )
+				csize = bytes - k * check_seg_size;
+			write_checksum((Bytef *)buffer + k * check_seg_size,
+				parms.checksum_array + j + k, csize);
+		}
+		j += run;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// parallel apply: the reader parses the delta records into slots, workers
+// uncompress, write and checksum them. Records never overlap, so workers
+// write to independent offsets and update disjoint checksum segments.
+//-----------------------------------------------------------------------------
+#define APPLY_READ_AHEAD	4	// slots with a buffer beyond two per worker
+#define APPLY_BUFFER_MB		1024	// -q uncompress buffers of all workers
+
+typedef struct
+{
+	u_int64_t	index;		// record number, 1 based
+	u_int64_t	offset;		// target offset
+	u_int64_t	size;		// payload size as read from the delta
+	int		compressed;
+	int		copy;		// copy record, data comes from the spool
+	u_int64_t	checksum_count;	// segment checksums embedded in the delta
+	checksum_struct	checksums[DELTA_RECORD_CHECKSUMS];
+	void		*data;
+	void		*payload;	// data, or the record in the mapped delta
+} apply_slot;
+
+typedef struct
+{
+	apply_slot	*slots;
+	apply_slot	**ready;	// ring of slots to be applied
+	apply_slot	**idle;		// stack of slots to be filled
+	int		depth;
+	int		ready_head;
+	int		ready_count;
+	int		idle_count;
+	int		done;
+	pthread_mutex_t	lock;
+	pthread_cond_t	ready_cond;
+	pthread_cond_t	idle_cond;
+
+	int		target_fd;
+	u_int64_t	seg_count;
+	u_int64_t	check_seg_size;
+	u_int64_t	bound;
+	u_int8_t	*dirty;
+	u_int64_t	data_bytes;	// written by data records, see delta_size
+	u_int64_t	completed;	// records written (or resumed past)
+	u_int64_t	windowed;	// records waiting in the sorted window
+	pthread_cond_t	done_cond;
+
+	int		direct_fd;	// O_DIRECT target (-d), -1 if buffered
+	u_int64_t	direct_writes;
+	u_int64_t	direct_bytes;
+	u_int64_t	buffered_writes;	// unaligned heads and tails
+	u_int64_t	buffered_bytes;
+	u_int64_t	bounced_bytes;	// copied to an aligned buffer first
+} apply_queue;
+
+apply_queue applyq;
+
+//-----------------------------------------------------------------------------
+// page aligned buffers, record data written with O_DIRECT needs no copy
+//-----------------------------------------------------------------------------
+void *apply_alloc(u_int64_t size)
+{
+	void *buffer = NULL;
+
+	#ifdef SUNOS
+	buffer = memalign(getpagesize(), size);
+	#else
+	if (posix_memalign(&buffer, getpagesize(), size))
+		buffer = NULL;
+	#endif
+	return buffer;
+}
+
+//-----------------------------------------------------------------------------
+int apply_queue_init(int depth, u_int64_t bound)
+{
+	int i;
+
+	memset(&applyq, 0, sizeof(applyq));
+	applyq.direct_fd = -1;
+	applyq.depth = depth;
+	applyq.bound = bound;
+	applyq.slots = calloc(depth, sizeof(apply_slot));
+	applyq.ready = calloc(depth, sizeof(apply_slot *));
+	applyq.idle  = calloc(depth, sizeof(apply_slot *));
+	if ( applyq.slots == NULL || applyq.ready == NULL || applyq.idle == NULL )
+	{
+		dd_log(LOG_ERR, "apply: unable to allocate a queue of %d slots", depth);
+		return -1;
+	}
+	for (i = 0; i < depth; i++)
+	{
+		if ( bound > 0 && (applyq.slots[i].data = apply_alloc(bound)) == NULL )
+		{
+			dd_log(LOG_ERR, "apply: unable to allocate %llu bytes for slot %d", bound, i);
+			return -1;
+		}
+		applyq.idle[applyq.idle_count++] = &applyq.slots[i];
+	}
+	pthread_mutex_init(&applyq.lock, NULL);
+	pthread_cond_init(&applyq.ready_cond, NULL);
+	pthread_cond_init(&applyq.idle_cond, NULL);
+	pthread_cond_init(&applyq.done_cond, NULL);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+void apply_queue_free()
+{
+	int i;
+
+	for (i = 0; i < applyq.depth; i++)
+		free(applyq.slots[i].data);
+	free(applyq.slots);
+	free(applyq.ready);
+	free(applyq.idle);
+	pthread_mutex_destroy(&applyq.lock);
+	pthread_cond_destroy(&applyq.ready_cond);
+	pthread_cond_destroy(&applyq.idle_cond);
+	pthread_cond_destroy(&applyq.done_cond);
+}
+
+//-----------------------------------------------------------------------------
+// reader side: get an empty slot, hand a filled one to the workers
+//-----------------------------------------------------------------------------
+apply_slot *apply_get_idle()
+{
+	apply_slot *slot;
+
+	pthread_mutex_lock(&applyq.lock);
+	while ( applyq.idle_count == 0 )
+		pthread_cond_wait(&applyq.idle_cond, &applyq.lock);
+	slot = applyq.idle[--applyq.idle_count];
+	pthread_mutex_unlock(&applyq.lock);
+	return slot;
+}
+
+void apply_put_ready(apply_slot *slot)
+{
+	pthread_mutex_lock(&applyq.lock);
+	applyq.ready[(applyq.ready_head + applyq.ready_count) % applyq.depth] = slot;
+	applyq.ready_count++;
+	pthread_cond_signal(&applyq.ready_cond);
+	pthread_mutex_unlock(&applyq.lock);
+}
+
+void apply_finish()
+{
+	pthread_mutex_lock(&applyq.lock);
+	applyq.done = 1;
+	pthread_cond_broadcast(&applyq.ready_cond);
+	pthread_mutex_unlock(&applyq.lock);
+}
+
+//-----------------------------------------------------------------------------
+// worker side: next filled slot (NULL once the reader is done), give it back
+//-----------------------------------------------------------------------------
+apply_slot *apply_get_ready()
+{
+	apply_slot *slot = NULL;
+
+	pthread_mutex_lock(&applyq.lock);
+	while ( applyq.ready_count == 0 && !applyq.done )
+		pthread_cond_wait(&applyq.ready_cond, &applyq.lock);
+	if ( applyq.ready_count > 0 )
+	{
+		slot = applyq.ready[applyq.ready_head];
+		applyq.ready_head = (applyq.ready_head + 1) % applyq.depth;
+		applyq.ready_count--;
+	}
+	pthread_mutex_unlock(&applyq.lock);
+	return slot;
+}
+
+//-----------------------------------------------------------------------------
+// worker side, without blocking: next filled slot or NULL if none is ready
+//-----------------------------------------------------------------------------
+apply_slot *apply_try_ready()
+{
+	apply_slot *slot = NULL;
+
+	pthread_mutex_lock(&applyq.lock);
+	if ( applyq.ready_count > 0 )
+	{
+		slot = applyq.ready[applyq.ready_head];
+		applyq.ready_head = (applyq.ready_head + 1) % applyq.depth;
+		applyq.ready_count--;
+	}
+	pthread_mutex_unlock(&applyq.lock);
+	return slot;
+}
+
+void apply_put_idle(apply_slot *slot)
+{
+	pthread_mutex_lock(&applyq.lock);
+	applyq.idle[applyq.idle_count++] = slot;
+	pthread_cond_signal(&applyq.idle_cond);
+	pthread_mutex_unlock(&applyq.lock);
+}
+
+//-----------------------------------------------------------------------------
+// read exactly size bytes of a record payload
+//-----------------------------------------------------------------------------
+int read_payload(int fd, void *buffer, u_int64_t size)
+{
+	ssize_t read_bytes;
+	u_int64_t done = 0;
+
+	while ( done < size )
+	{
+		if ((read_bytes = read(fd, (char *)buffer + done, size - done)) <= 0 )
+			return -1;
+		done += read_bytes;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// checksum the segments of a record written at seg_offset
+//-----------------------------------------------------------------------------
+void apply_checksum(u_int64_t index, Bytef *ptr, u_int64_t seg_offset, u_int64_t data_size)
+{
+	u_int64_t j;
+	u_int64_t check_count  = data_size  / applyq.check_seg_size;
+	u_int64_t check_offset = seg_offset / applyq.check_seg_size;
+	checksum_struct *checksum_ptr = parms.checksum_array + check_offset;
+	u_int64_t phase_ns = dd_stats_begin();
+
+	for (j=0; j < check_count; j++) 
+	{
+		dd_log(LOG_DEBUG,"Writing checksum %llu/%llu in block %llu/%llu", j+1, check_count, index, applyq.seg_count);
+		write_checksum(ptr, checksum_ptr, applyq.check_seg_size);
+		ptr += applyq.check_seg_size;
+		checksum_ptr++;
+	}
+
+	// Catch any trailing data
+	u_int64_t check_trail = data_size % applyq.check_seg_size;
+	if (check_trail > 0) {
+		dd_log(LOG_DEBUG,"Writing checksum of %lu trailing bytes in block %lu/%lu", check_trail, index, applyq.seg_count);
+		write_checksum(ptr, checksum_ptr, check_trail);
+	}
+	dd_stats_end(DD_PHASE_HASH, phase_ns, data_size);
+}
+
+//-----------------------------------------------------------------------------
+// delta with embedded checksums: check that they cover the record and with
+// --verify that they match the data, then store them. Runs before the record
+// is written, so a mismatch leaves target and checksum file alone.
+//-----------------------------------------------------------------------------
+void apply_embedded_checksum(apply_slot *slot, Bytef *ptr, u_int64_t data_size)
+{
+	u_int64_t j;
+	u_int64_t check_count  = (data_size + applyq.check_seg_size - 1) / applyq.check_seg_size;
+	u_int64_t check_offset = slot->offset / applyq.check_seg_size;
+	checksum_struct checksum;
+
+	if ( slot->checksum_count != check_count )
+	{
+		dd_log(LOG_ERR, "block %llu carries %llu checksums for %llu segments",
+			slot->index, slot->checksum_count, check_count);
+		exit(1);
+	}
+
+	if ( parms.verifyflag )
+	{
+		u_int64_t phase_ns = dd_stats_begin();
+		for (j=0; j < check_count; j++)
+		{
+			u_int64_t csize = applyq.check_seg_size;
+			if ( (j + 1) * applyq.check_seg_size > data_size )
+				csize = data_size - j * applyq.check_seg_size;
+
+			write_checksum(ptr + j * applyq.check_seg_size, &checksum, csize);
+			if ( checksum.checksum1_murmur != slot->checksums[j].checksum1_murmur ||
+				checksum.checksum2_crc32 != slot->checksums[j].checksum2_crc32 )
+			{
+				dd_log(LOG_ERR, "block %llu segment %llu does not match its checksum in the delta",
+					slot->index, check_offset + j);
+				exit(1);
+			}
+		}
+		dd_stats_end(DD_PHASE_HASH, phase_ns, data_size);
+	}
+
+	memcpy(parms.checksum_array + check_offset, slot->checksums,
+		check_count * sizeof(checksum_struct));
+}
+
+#define DIRECT_IO_ALIGN 4096	// covers 512 byte and 4k logical blocks
+
+//-----------------------------------------------------------------------------
+// write to the target: with -d the DIRECT_IO_ALIGN aligned middle of the
+// extent goes through the O_DIRECT descriptor (via the bounce buffer if the
+// data is not aligned in memory), the unaligned head and tail are written
+// buffered. Records do not overlap, so no block is written both ways.
+//-----------------------------------------------------------------------------
+static int apply_pwrite_split(void *data, u_int64_t size, u_int64_t offset, void *bounce)
+{
+	u_int64_t start, end, pos;
+	char *ptr = data;
+
+	if ( applyq.direct_fd == -1 )
+		return pwrite64(applyq.target_fd, data, size, offset) == size ? 0 : -1;
+
+	start = (offset + DIRECT_IO_ALIGN - 1) & ~(u_int64_t)(DIRECT_IO_ALIGN - 1);
+	end = (offset + size) & ~(u_int64_t)(DIRECT_IO_ALIGN - 1);
+	if ( end <= start )
+		start = end = offset;
+
+	//
+	// buffered head, and the whole extent if it holds no aligned block
+	//
+	if ( start > offset || end == offset )
+	{
+		u_int64_t bytes = ( end == offset ) ? size : start - offset;
+
+		if ( pwrite64(applyq.target_fd, ptr, bytes, offset) != bytes )
+			return -1;
+		__sync_fetch_and_add(&applyq.buffered_writes, 1);
+		__sync_fetch_and_add(&applyq.buffered_bytes, bytes);
+		if ( end == offset )
+			return 0;
+	}
+
+	for (pos = start; pos < end; )
+	{
+		u_int64_t bytes = end - pos;
+		void *src = ptr + (pos - offset);
+
+		if ( ((unsigned long)src & (DIRECT_IO_ALIGN - 1)) != 0 )
+		{
+			if ( bytes > READ_BUFFER_SIZE )
+				bytes = READ_BUFFER_SIZE;
+			memcpy(bounce, src, bytes);
+			src = bounce;
+			__sync_fetch_and_add(&applyq.bounced_bytes, bytes);
+		}
+		if ( pwrite64(applyq.direct_fd, src, bytes, pos) != bytes )
+			return -1;
+		__sync_fetch_and_add(&applyq.direct_writes, 1);
+		__sync_fetch_and_add(&applyq.direct_bytes, bytes);
+		pos += bytes;
+	}
+
+	//
+	// buffered tail
+	//
+	if ( offset + size > end )
+	{
+		if ( pwrite64(applyq.target_fd, ptr + (end - offset), offset + size - end, end) != offset + size - end )
+			return -1;
+		__sync_fetch_and_add(&applyq.buffered_writes, 1);
+		__sync_fetch_and_add(&applyq.buffered_bytes, offset + size - end);
+	}
+	return 0;
+}
+
+int apply_pwrite(void *data, u_int64_t size, u_int64_t offset, void *bounce)
+{
+	u_int64_t phase_ns = dd_stats_begin();
+	int rc = apply_pwrite_split(data, size, offset, bounce);
+
+	dd_stats_end(DD_PHASE_WRITE, phase_ns, size);
+	return rc;
+}
+
+//-----------------------------------------------------------------------------
+// a record on its way to the target, the slot is held until the write has
+// completed unless the data was uncompressed into the write's own buffer
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	u_int64_t	index;
+	u_int64_t	offset;
+	u_int64_t	size;
+	int		copy;
+	void		*data;
+	void		*buffer;
+	apply_slot	*slot;
+	u_int64_t	submit_ns;	// io_uring submission, for dd_stats
+} apply_write;
+
+//-----------------------------------------------------------------------------
+// prepare a write from a slot: uncompress into the write buffer if needed
+//-----------------------------------------------------------------------------
+void apply_prepare(apply_write *w, apply_slot *slot)
+{
+	w->index = slot->index;
+	w->offset = slot->offset;
+	w->data = slot->payload;
+	w->size = slot->size;
+	w->copy = slot->copy;
+	w->slot = slot;
+
+	if (slot->compressed) 
+	{
+		dd_log(LOG_DEBUG, "unzipping segment(s)");
+
+		uLongf destLen = READ_BUFFER_SIZE;
+		int uncomp_ret;
+		u_int64_t phase_ns = dd_stats_begin();
+		if ((uncomp_ret = uncompress ((Bytef *)w->buffer, &destLen, (Bytef *)slot->payload, slot->size)) != Z_OK) 
+		{
+			dd_log(LOG_ERR,"uncompress delta: failed at block %lu of %lu - input size %lu - error %d", slot->index, applyq.seg_count, slot->size, uncomp_ret);
+			exit(1);
+		}
+		dd_stats_end(DD_PHASE_COMPRESS, phase_ns, destLen);
+		dd_log(LOG_DEBUG,"uncompress delta: uncompressed %lu bytes to %lu bytes", slot->size, destLen);
+		w->data = w->buffer;
+		w->size = destLen;
+	}
+
+	if (applyq.dirty == NULL && parms.checksum_array != NULL && parms.checksumsflag)
+		apply_embedded_checksum(slot, (Bytef *)w->data, w->size);
+
+	//
+	// the compressed record is no longer needed
+	//
+	if (slot->compressed)
+	{
+		apply_put_idle(slot);
+		w->slot = NULL;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// the write is done: log it, checksum it, release its slot
+//-----------------------------------------------------------------------------
+void apply_account(apply_write *w)
+{
+	dd_log(LOG_DEBUG,"Writing block %llu/%llu, size %llu at offset %llu", w->index, applyq.seg_count, w->size, w->offset);
+
+	fprintf(parms.delta_info_fd, "Writing block %llu/%llu, size %llu at offset %llu\n", (long long unsigned)w->index, (long long unsigned)applyq.seg_count, (long long unsigned)w->size, (long long unsigned)w->offset);
+
+	if (!w->copy)
+		__sync_fetch_and_add(&applyq.data_bytes, w->size);
+
+	if (applyq.dirty != NULL)
+	{
+		u_int64_t j;
+		for (j = w->offset / applyq.check_seg_size;
+			j <= (w->offset + w->size - 1) / applyq.check_seg_size; j++)
+			applyq.dirty[j] = 1;
+	}
+
+	pthread_mutex_lock(&applyq.lock);
+	applyq.completed++;
+	pthread_cond_signal(&applyq.done_cond);
+	pthread_mutex_unlock(&applyq.lock);
+}
+
+void apply_complete(apply_write *w)
+{
+	apply_account(w);
+
+	if (applyq.dirty == NULL && parms.checksum_array != NULL && !parms.checksumsflag)
+		apply_checksum(w->index, (Bytef *)w->data, w->offset, w->size);
+
+	if (w->slot != NULL)
+	{
+		apply_put_idle(w->slot);
+		w->slot = NULL;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// io_uring: keep up to parms.uring_depth writes in flight, each with its
+// own uncompress buffer, recycled on completion
+//-----------------------------------------------------------------------------
+apply_write *apply_reap(struct dd_uring *ring)
+{
+	int result;
+	apply_write *w = dd_uring_reap(ring, &result);
+
+	if ( w == NULL || result != w->size )
+	{
+		dd_log(LOG_ERR,"delta write of %llu bytes at offset %llu failed (%d)",
+			w ? w->size : 0, w ? w->offset : 0, result);
+		exit(1);
+	}
+	dd_stats_end(DD_PHASE_WRITE, w->submit_ns, w->size);
+	apply_complete(w);
+	return w;
+}
+
+int apply_uring(struct dd_uring *ring, apply_write *writes, void *bounce)
+{
+	apply_slot *slot;
+	apply_write **idle;
+	int idle_count = 0, i;
+
+	if ((idle = malloc(ring->depth * sizeof(apply_write *))) == NULL )
+	{
+		dd_log(LOG_ERR, "apply: unable to allocate io_uring write list");
+		return -1;
+	}
+	for (i = 0; i < ring->depth; i++)
+		idle[idle_count++] = &writes[i];
+
+	for (;;)
+	{
+		//
+		// no write buffer left, wait for a completion to recycle
+		//
+		if ( idle_count == 0 )
+			idle[idle_count++] = apply_reap(ring);
+
+		//
+		// never block for more work with writes in flight: a checkpoint
+		// waits for them to complete before it hands out more records
+		//
+		if ( ring->in_flight > 0 )
+		{
+			if ((slot = apply_try_ready()) == NULL)
+			{
+				idle[idle_count++] = apply_reap(ring);
+				continue;
+			}
+		}
+		else if ((slot = apply_get_ready()) == NULL)
+			break;
+
+		apply_write *w = idle[--idle_count];
+		apply_prepare(w, slot);
+
+		//
+		// with -d only aligned records are queued, the others are
+		// split into direct and buffered writes right away
+		//
+		if ( applyq.direct_fd != -1 && ( (w->offset | w->size |
+			(unsigned long)w->data) & (DIRECT_IO_ALIGN - 1) ) )
+		{
+			if ( apply_pwrite(w->data, w->size, w->offset, bounce) == -1 )
+			{
+				dd_log(LOG_ERR,"delta write of %llu bytes at offset %llu failed", w->size, w->offset);
+				exit(1);
+			}
+			apply_complete(w);
+			idle[idle_count++] = w;
+			continue;
+		}
+		if ( applyq.direct_fd != -1 )
+		{
+			__sync_fetch_and_add(&applyq.direct_writes, 1);
+			__sync_fetch_and_add(&applyq.direct_bytes, w->size);
+		}
+		w->submit_ns = dd_stats_begin();
+		if ( dd_uring_write(ring, applyq.direct_fd != -1 ? applyq.direct_fd : applyq.target_fd,
+			w->data, w->size, w->offset, w) == -1 )
+		{
+			dd_log(LOG_ERR,"delta write of %llu bytes at offset %llu failed to submit", w->size, w->offset);
+			exit(1);
+		}
+	}
+
+	//
+	// drain, the target is flushed once every worker is done
+	//
+	while ( ring->in_flight > 0 )
+		apply_reap(ring);
+
+	free(idle);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// sorted apply: records collect in a window of at most parms.sort_window_mb,
+// a full window is sorted by target offset, adjacent and overlapping
+// records are merged (the later record wins) and each merged extent is
+// written at once
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	apply_write	*records;
+	u_int64_t	count;
+	u_int64_t	capacity;
+	u_int64_t	bytes;
+	u_int64_t	limit;
+	pthread_mutex_t	lock;
+
+	void		*bounce;	// O_DIRECT bounce buffer of the flusher
+
+	u_int64_t	flushes;
+	u_int64_t	writes;
+	u_int64_t	merged;
+} apply_window;
+
+apply_window applyw;
+
+//-----------------------------------------------------------------------------
+static int window_offset_cmp(const void *a, const void *b)
+{
+	const apply_write *wa = a, *wb = b;
+
+	if ( wa->offset != wb->offset )
+		return wa->offset < wb->offset ? -1 : 1;
+	return wa->index < wb->index ? -1 : wa->index > wb->index;
+}
+
+static int window_index_cmp(const void *a, const void *b)
+{
+	const apply_write *wa = a, *wb = b;
+
+	return wa->index < wb->index ? -1 : wa->index > wb->index;
+}
+
+//-----------------------------------------------------------------------------
+// write the window, caller holds applyw.lock
+//-----------------------------------------------------------------------------
+void apply_window_flush()
+{
+	u_int64_t i = 0, j, k;
+
+	if ( applyw.count == 0 )
+		return;
+	qsort(applyw.records, applyw.count, sizeof(apply_write), window_offset_cmp);
+
+	while ( i < applyw.count )
+	{
+		apply_write *first = &applyw.records[i];
+		u_int64_t start = first->offset;
+		u_int64_t end = first->offset + first->size;
+		void *run = first->data;
+
+		for (j = i + 1; j < applyw.count && applyw.records[j].offset <= end; j++)
+		{
+			if ( applyw.records[j].offset + applyw.records[j].size > end )
+				end = applyw.records[j].offset + applyw.records[j].size;
+		}
+
+		//
+		// several records, build the extent in record order
+		//
+		if ( j > i + 1 )
+		{
+			if ((run = apply_alloc(end - start)) == NULL)
+			{
+				dd_log(LOG_ERR, "apply: unable to allocate %llu bytes extent", end - start);
+				exit(1);
+			}
+			qsort(first, j - i, sizeof(apply_write), window_index_cmp);
+			for (k = i; k < j; k++)
+				memcpy((char *)run + (applyw.records[k].offset - start),
+					applyw.records[k].data, applyw.records[k].size);
+			applyw.merged += j - i - 1;
+		}
+
+		if ( apply_pwrite(run, end - start, start, applyw.bounce) == -1 )
+		{
+			dd_log(LOG_ERR,"delta write of %llu bytes at offset %llu failed", end - start, start);
+			exit(1);
+		}
+		dd_log(LOG_DEBUG,"Writing extent of %llu records, size %llu at offset %llu", j - i, end - start, start);
+		applyw.writes++;
+
+		for (k = i; k < j; k++)
+			apply_account(&applyw.records[k]);
+		if (applyq.dirty == NULL && parms.checksum_array != NULL && !parms.checksumsflag)
+			apply_checksum(first->index, (Bytef *)run, start, end - start);
+
+		if ( run != first->data )
+			free(run);
+		for (k = i; k < j; k++)
+			free(applyw.records[k].data);
+		i = j;
+	}
+
+	pthread_mutex_lock(&applyq.lock);
+	applyq.windowed -= applyw.count;
+	pthread_mutex_unlock(&applyq.lock);
+
+	applyw.count = 0;
+	applyw.bytes = 0;
+	applyw.flushes++;
+}
+
+//-----------------------------------------------------------------------------
+// take a copy of the record into the window, write the window once full
+//-----------------------------------------------------------------------------
+void apply_window_add(apply_write *w)
+{
+	apply_write *r;
+
+	pthread_mutex_lock(&applyw.lock);
+	if ( applyw.count == applyw.capacity )
+	{
+		applyw.capacity = applyw.capacity ? applyw.capacity * 2 : 1024;
+		if ((applyw.records = realloc(applyw.records, applyw.capacity * sizeof(apply_write))) == NULL)
+		{
+			dd_log(LOG_ERR, "apply: unable to grow the window to %llu records", applyw.capacity);
+			exit(1);
+		}
+	}
+	r = &applyw.records[applyw.count];
+	*r = *w;
+	r->buffer = NULL;
+	r->slot = NULL;
+	if ((r->data = apply_alloc(w->size)) == NULL)
+	{
+		dd_log(LOG_ERR, "apply: unable to allocate %llu bytes in the window", w->size);
+		exit(1);
+	}
+	memcpy(r->data, w->data, w->size);
+	applyw.count++;
+	applyw.bytes += w->size;
+
+	pthread_mutex_lock(&applyq.lock);
+	applyq.windowed++;
+	pthread_cond_signal(&applyq.done_cond);
+	pthread_mutex_unlock(&applyq.lock);
+
+	if ( applyw.bytes >= applyw.limit )
+		apply_window_flush();
+	pthread_mutex_unlock(&applyw.lock);
+
+	if ( w->slot != NULL )
+	{
+		apply_put_idle(w->slot);
+		w->slot = NULL;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// checkpoints: every parms.checkpoint_mb of delta the reader waits for the
+// records handed out so far, syncs target and checksums and appends
+//
+//	Checkpoint <records> <delta offset> <data bytes> <zip bytes> <identity>
+//
+// to the .rinfo file. --resume continues after the last checkpoint of the
+// same delta (identity is a crc32 of its header, footer and size).
+//-----------------------------------------------------------------------------
+u_int32_t delta_identity(delta_header *dheader, delta_footer *dfooter)
+{
+	u_int32_t crc = crc32(0L, Z_NULL, 0);
+
+	crc = crc32(crc, (Bytef *)dheader, sizeof(delta_header));
+	crc = crc32(crc, (Bytef *)dfooter, sizeof(delta_footer));
+	crc = crc32(crc, (Bytef *)&parms.delta_size_bytes, sizeof(parms.delta_size_bytes));
+	return crc;
+}
+
+//-----------------------------------------------------------------------------
+// wait until the first records are written (sorted window included)
+//-----------------------------------------------------------------------------
+void apply_drain(u_int64_t records)
+{
+	pthread_mutex_lock(&applyq.lock);
+	while ( applyq.completed + applyq.windowed < records )
+		pthread_cond_wait(&applyq.done_cond, &applyq.lock);
+	pthread_mutex_unlock(&applyq.lock);
+
+	if ( parms.sort_window_mb > 0 )
+	{
+		pthread_mutex_lock(&applyw.lock);
+		apply_window_flush();
+		pthread_mutex_unlock(&applyw.lock);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// make the checksums durable
+//-----------------------------------------------------------------------------
+int sync_checksums()
+{
+	if ( parms.checksum_array != NULL &&
+		msync((void *)parms.checksum_array, parms.mmap_size, MS_SYNC) )
+	{
+		dd_log(LOG_ERR, "unable to sync checksum file %s", parms.checksum_file);
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+int apply_checkpoint(u_int64_t records, u_int64_t offset, u_int64_t zip_total,
+	u_int32_t identity)
+{
+	apply_drain(records);
+
+	if ( fdatasync(applyq.target_fd) && errno != EINVAL )
+	{
+		dd_log(LOG_ERR, "unable to sync target %s", parms.target_dev);
+		return -1;
+	}
+	if ( sync_checksums() == -1 )
+		return -1;
+
+	fprintf(parms.delta_info_fd, "Checkpoint %llu %llu %llu %llu %08x\n",
+		(long long unsigned)records, (long long unsigned)offset,
+		(long long unsigned)applyq.data_bytes, (long long unsigned)zip_total, identity);
+	if ( fflush(parms.delta_info_fd) || (fdatasync(fileno(parms.delta_info_fd)) && errno != EINVAL) )
+	{
+		dd_log(LOG_ERR, "unable to write checkpoint to %s", parms.delta_info_file);
+		return -1;
+	}
+	dd_log(LOG_INFO, "checkpoint: %llu records, delta offset %llu", records, offset);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// last checkpoint of this delta in the .rinfo file, 0 if there is none
+//-----------------------------------------------------------------------------
+int read_checkpoint(u_int32_t identity, u_int64_t *records, u_int64_t *offset,
+	u_int64_t *data_bytes, u_int64_t *zip_total)
+{
+	FILE *fp;
+	char line[256];
+	long long unsigned r, o, d, z;
+	unsigned int id;
+	int found = 0;
+
+	if ((fp = fopen(parms.delta_info_file, "r")) == NULL)
+		return 0;
+	while ( fgets(line, sizeof(line), fp) != NULL )
+	{
+		if ( sscanf(line, "Checkpoint %llu %llu %llu %llu %x", &r, &o, &d, &z, &id) == 5 &&
+			id == identity )
+		{
+			*records = r;
+			*offset = o;
+			*data_bytes = d;
+			*zip_total = z;
+			found = 1;
+		}
+	}
+	fclose(fp);
+	return found;
+}
+
+//-----------------------------------------------------------------------------
+// apply worker: uncompress, write and checksum records
+//-----------------------------------------------------------------------------
+void *apply_worker_thread(thread_struct *thread)
+{
+	apply_slot *slot;
+	apply_write *writes;
+	struct dd_uring ring;
+	void *bounce = NULL;
+	int i, count = 1, use_uring = 0;
+
+	dd_stats_thread(thread->worker_id);
+	thread->worker_thread_ccode = -1;
+	if ( parms.uring_depth > 0 && parms.sort_window_mb == 0 )
+	{
+		if ( dd_uring_init(&ring, parms.uring_depth) == 0 )
+		{
+			use_uring = 1;
+			count = parms.uring_depth;
+		}
+		else
+			dd_log(LOG_INFO, "apply: io_uring unavailable, worker %d uses pwrite", thread->worker_id);
+	}
+
+	if ((writes = calloc(count, sizeof(apply_write))) == NULL )
+	{
+		dd_log(LOG_ERR, "apply: unable to allocate worker writes");
+		return NULL;
+	}
+	for (i = 0; i < count && parms.compressedflag > 0; i++)
+	{
+		if ( posix_memalign((void**)&writes[i].buffer, getpagesize(), READ_BUFFER_SIZE) )
+		{
+			dd_log(LOG_ERR, "apply: unable to allocate worker buffer");
+			return NULL;
+		}
+	}
+
+	if ( applyq.direct_fd != -1 && (bounce = apply_alloc(READ_BUFFER_SIZE)) == NULL )
+	{
+		dd_log(LOG_ERR, "apply: unable to allocate worker bounce buffer");
+		return NULL;
+	}
+
+	if ( use_uring )
+	{
+		if ( apply_uring(&ring, writes, bounce) == -1 )
+			return NULL;
+		dd_uring_exit(&ring);
+	}
+	else if ( parms.sort_window_mb > 0 )
+	{
+		while ((slot = apply_get_ready()) != NULL)
+		{
+			apply_prepare(&writes[0], slot);
+			apply_window_add(&writes[0]);
+		}
+	}
+	else
+	{
+		while ((slot = apply_get_ready()) != NULL)
+		{
+			apply_prepare(&writes[0], slot);
+			if ( apply_pwrite(writes[0].data, writes[0].size, writes[0].offset, bounce) == -1 )
+			{
+				dd_log(LOG_ERR,"delta write of %llu bytes at offset %llu failed", writes[0].size, writes[0].offset);
+				exit(1);
+			}
+			apply_complete(&writes[0]);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		free(writes[i].buffer);
+	free(writes);
+	free(bounce);
+	thread->worker_thread_ccode = 0;
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// streamed delta: the footer follows the last record and nothing follows
+// the footer
+//-----------------------------------------------------------------------------
+int delta_stream_footer(dd_delta_reader *reader, u_int64_t records)
+{
+	delta_footer *dfooter = dd_delta_peek(reader, sizeof(delta_footer));
+
+	if ( dfooter == NULL || dfooter->delta_seg_count != records ||
+		strncmp(dfooter->magic_end, MAGIC_END, sizeof(dfooter->magic_end)) != 0 )
+		return 0;
+	return dd_delta_peek(reader, sizeof(delta_footer) + 1) == NULL;
+}
+
+//-----------------------------------------------------------------------------
+void show_footer(delta_footer *dfooter)
+{
+	fprintf(stdout, "Segment count:      %llu\n", (long long unsigned)dfooter->delta_seg_count);
+	fprintf(stdout, "Delta size:         %llu\n", (long long unsigned)dfooter->delta_size);
+	if (parms.compressedflag == 1) 
+	{
+		fprintf(stdout, "Delta zip size:     %llu\n", (long long unsigned)dfooter->delta_zip_size);
+		if (dfooter->delta_size > 0) 
+		{
+			fprintf(stdout, "Zip Ratio:         %5.2f%%\n", (float)dfooter->delta_zip_size/dfooter->delta_size);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// check: validate a delta file before it is applied. The records are located
+// in the mapped delta first (sizes, offsets and bounds), then workers check
+// their crc32 (DDFLAG_RECORDCRC) and uncompress zipped payloads in parallel,
+// the totals must match the footer
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	u_int64_t	start;		// delta offset of the record
+	u_int64_t	length;		// all of its bytes, crc included
+	u_int64_t	payload;	// delta offset of the payload
+	u_int64_t	size;		// stored payload size, copied bytes for copies
+	u_int64_t	offset;		// target offset
+	u_int64_t	checksum_count;
+	int		copy;
+} check_record;
+
+typedef struct
+{
+	dd_delta_reader	reader;
+	check_record	*records;
+	u_int64_t	count;
+	u_int64_t	next;		// handed out to the workers
+	u_int64_t	source_size;
+	u_int64_t	check_seg_size;
+	u_int64_t	data_bytes;
+	u_int64_t	failed;
+} check_state;
+
+check_state checks;
+
+#define CHECK_BATCH 64		// records a worker takes at once
+
+//-----------------------------------------------------------------------------
+void check_failed(check_record *r, u_int64_t index, char *reason)
+{
+	if ( __sync_add_and_fetch(&checks.failed, 1) <= 10 )
+		dd_log(LOG_ERR, "block %llu (offset %llu, target %llu) %s", index + 1, r->start, r->offset, reason);
+}
+
+//-----------------------------------------------------------------------------
+void *check_worker_thread(thread_struct *thread)
+{
+	u_int64_t first, i;
+	char *map = checks.reader.map;
+
+	if ( parms.compressedflag && (thread->aligned_buffer = apply_alloc(READ_BUFFER_SIZE)) == NULL )
+	{
+		dd_log(LOG_ERR, "check: unable to allocate worker buffer");
+		thread->worker_thread_ccode = -1;
+		pthread_exit(NULL);
+	}
+
+	while ( (first = __sync_fetch_and_add(&checks.next, CHECK_BATCH)) < checks.count )
+	{
+		for (i = first; i < first + CHECK_BATCH && i < checks.count; i++)
+		{
+			check_record *r = &checks.records[i];
+			u_int64_t raw = r->size;
+
+			if ( parms.recordcrcflag )
+			{
+				u_int64_t stored_crc;
+				u_int32_t crc = crc32(crc32(0L, Z_NULL, 0), (Bytef *)map + r->start,
+					r->length - sizeof(stored_crc));
+
+				memcpy(&stored_crc, map + r->start + r->length - sizeof(stored_crc), sizeof(stored_crc));
+				if ( stored_crc != crc )
+				{
+					check_failed(r, i, "fails its crc32");
+					continue;
+				}
+			}
+			if ( r->copy )
+				continue;
+
+			if ( parms.compressedflag )
+			{
+				uLongf destLen = READ_BUFFER_SIZE;
+
+				if ( uncompress((Bytef *)thread->aligned_buffer, &destLen,
+					(Bytef *)map + r->payload, r->size) != Z_OK )
+				{
+					check_failed(r, i, "does not uncompress");
+					continue;
+				}
+				raw = destLen;
+			}
+			if ( r->offset + raw > checks.source_size )
+			{
+				check_failed(r, i, "ends past the source size");
+				continue;
+			}
+			if ( parms.checksumsflag &&
+				r->checksum_count != (raw + checks.check_seg_size - 1) / checks.check_seg_size )
+			{
+				check_failed(r, i, "carries the wrong number of checksums");
+				continue;
+			}
+			__sync_fetch_and_add(&checks.data_bytes, raw);
+		}
+	}
+
+	free(thread->aligned_buffer);
+	pthread_exit(NULL);
+}
+
+//-----------------------------------------------------------------------------
+// locate the records, each is bounds checked against the mapped delta
+//-----------------------------------------------------------------------------
+int check_walk(delta_footer *dfooter, u_int64_t *zip_total)
+{
+	u_int64_t bound = compressBound((u_int64_t) READ_BUFFER_SIZE);
+	dd_delta_reader *reader = &checks.reader;
+	u_int64_t i;
+
+	for (i = 0; i < checks.count; i++)
+	{
+		check_record *r = &checks.records[i];
+		u_int64_t header[2];
+
+		r->start = reader->offset;
+		if ( dd_delta_read(reader, header, sizeof(header)) == -1 )
+		{
+			dd_log(LOG_ERR, "delta is truncated at block %llu (offset %llu)", i+1, r->start);
+			return -1;
+		}
+		r->offset = header[0];
+		r->size = header[1] & ~DELTA_COPY_RECORD;
+		r->copy = ( header[1] & DELTA_COPY_RECORD ) != 0;
+
+		if ( r->copy )
+		{
+			u_int64_t copy_offset;
+
+			if ( !parms.rollingflag || dd_delta_read(reader, &copy_offset, sizeof(copy_offset)) == -1 ||
+				r->size > READ_BUFFER_SIZE || copy_offset + r->size > checks.source_size ||
+				r->offset + r->size > checks.source_size )
+			{
+				dd_log(LOG_ERR, "block %llu (offset %llu) is a broken copy record", i+1, r->start);
+				return -1;
+			}
+		}
+		else
+		{
+			r->payload = reader->offset;
+			if ( r->size > (parms.compressedflag ? bound : READ_BUFFER_SIZE) ||
+				dd_delta_take(reader, r->size) == NULL )
+			{
+				dd_log(LOG_ERR, "block %llu (offset %llu) holds %llu bytes, delta is truncated or broken",
+					i+1, r->start, r->size);
+				return -1;
+			}
+			*zip_total += r->size;
+
+			if ( parms.checksumsflag &&
+				( dd_delta_read(reader, &r->checksum_count, sizeof(r->checksum_count)) == -1 ||
+				r->checksum_count > DELTA_RECORD_CHECKSUMS || r->offset % checks.check_seg_size ||
+				dd_delta_take(reader, r->checksum_count * sizeof(checksum_struct)) == NULL ) )
+			{
+				dd_log(LOG_ERR, "block %llu (offset %llu) has broken checksums", i+1, r->start);
+				return -1;
+			}
+		}
+		if ( parms.recordcrcflag && dd_delta_take(reader, sizeof(u_int64_t)) == NULL )
+		{
+			dd_log(LOG_ERR, "block %llu (offset %llu) is missing its crc", i+1, r->start);
+			return -1;
+		}
+		r->length = reader->offset - r->start;
+	}
+	if ( !dd_delta_at_end(reader) )
+	{
+		dd_log(LOG_ERR, "%llu bytes follow the last record of the delta", reader->len - reader->pos);
+		return -1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// returns 0 if the delta is sound, 1 if it is broken and -1 on errors
+//-----------------------------------------------------------------------------
+int delta_check(delta_header *dheader, delta_footer *dfooter)
+{
+	thread_struct *threads;
+	u_int64_t zip_total = 0;
+	int worker;
+
+	memset(&checks, 0, sizeof(checks));
+	checks.count = dfooter->delta_seg_count;
+	checks.source_size = dheader->source_size;
+	checks.check_seg_size = dheader->check_seg_size;
+
+	if ( checks.check_seg_size == 0 ||
+		checks.count > parms.delta_size_bytes / (2 * sizeof(u_int64_t)) )
+	{
+		dd_log(LOG_ERR, "delta header or footer is broken (%llu records)", checks.count);
+		return 1;
+	}
+	if ( dd_delta_reader_map(&checks.reader, parms.delta_fd, sizeof(delta_header),
+		parms.delta_size_bytes - sizeof(delta_footer), parms.delta_size_bytes) == -1 )
+	{
+		return -1;
+	}
+	if ( (checks.records = calloc(checks.count + 1, sizeof(check_record))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate memory for %llu records", checks.count);
+		return -1;
+	}
+	if ( check_walk(dfooter, &zip_total) == -1 )
+	{
+		fprintf(stdout, "Check:              FAILED\n");
+		return 1;
+	}
+
+	dd_log(LOG_INFO, "check workers: %d", parms.workers);
+	if ( (threads = calloc(parms.workers, sizeof(thread_struct))) == NULL )
+	{
+		dd_log(LOG_ERR,"unable to allocate memory for %d workers", parms.workers);
+		return -1;
+	}
+	for(worker=0; worker < parms.workers; worker++)
+	{
+		threads[worker].worker_id = worker;
+		pthread_attr_init(&threads[worker].thread_attributes);
+		if ( pthread_create(&threads[worker].worker_thread, &threads[worker].thread_attributes,
+			(void *) check_worker_thread, (void *)&threads[worker]) != 0 )
+		{
+			dd_log(LOG_ERR,"pthread_create check failed");
+			return -1;
+		}
+	}
+	for(worker=0; worker < parms.workers; worker++)
+	{
+		if ( pthread_join(threads[worker].worker_thread, NULL) != 0 )
+		{
+			dd_log(LOG_ERR,"pthread_join failed");
+			return -1;
+		}
+		if ( threads[worker].worker_thread_ccode == -1 )
+		{
+			dd_log(LOG_ERR,"thread terminated unexpectantly");
+			return -1;
+		}
+	}
+	free(threads);
+
+	if ( checks.failed == 0 && ( checks.data_bytes != dfooter->delta_size ||
+		( parms.compressedflag && zip_total != dfooter->delta_zip_size ) ) )
+	{
+		dd_log(LOG_ERR, "records hold %llu bytes (%llu zipped), footer says %llu (%llu zipped)",
+			checks.data_bytes, zip_total, dfooter->delta_size, dfooter->delta_zip_size);
+		checks.failed++;
+	}
+
+	fprintf(stdout, "Records checked:    %llu%s\n", (long long unsigned)checks.count,
+		parms.recordcrcflag ? " (crc32)" : " (no record crc in this delta)");
+	fprintf(stdout, "Check:              %s\n", checks.failed ? "FAILED" : "OK");
+
+	free(checks.records);
+	dd_delta_reader_free(&checks.reader);
+	return checks.failed ? 1 : 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -176,6 +1559,30 @@ int ddcommit(int runmode)
 	parms.delta_magic_start  = "beefcake";
 	parms.delta_magic_end    = "tailcafe";
 
+	//
+	// -x - reads the delta from stdin, records are applied as they arrive
+	// and the footer is checked at the end
+	//
+	dd_delta_reader reader;
+	int stream = ( strcmp(parms.delta_file, "-") == 0 );
+	int failed = 0;
+
+	if ( stream )
+	{
+		if ( runmode != RUNMODE_APPLY_DELTA )
+		{
+			dd_log(LOG_ERR, "a delta on stdin can only be applied");
+			return -1;
+		}
+		parms.delta_fd = STDIN_FILENO;
+		parms.delta_size_bytes = 0;
+		if ( dd_delta_reader_init(&reader, parms.delta_fd, 0) == -1 )
+		{
+			return -1;
+		}
+	}
+	else
+	{
 	if ((parms.delta_fd = open(parms.delta_file, O_RDONLY|O_LARGEFILE,
           (mode_t)0600)) == -1 )
 	{
@@ -189,6 +1596,7 @@ int ddcommit(int runmode)
 		return -1;
 	}
 	dd_log(LOG_DEBUG, "delta file size: %llu bytes", parms.delta_size_bytes); 
+	}
 	
 	// u_int64_t seg_size       = SEGMENT_SIZE;
 
@@ -211,7 +1619,7 @@ int ddcommit(int runmode)
 	//
 	// position the source file pointer
 	//
-	if ( lseek64(parms.delta_fd, source_pos, SEEK_SET) == -1 )
+	if ( !stream && lseek64(parms.delta_fd, source_pos, SEEK_SET) == -1 )
 	{
 		dd_log(LOG_ERR,"seek set to read offset: %llu failed",source_pos);
 		return -1;
@@ -227,7 +1635,15 @@ int ddcommit(int runmode)
 	delta_header dheader;
 	delta_footer dfooter;
 	
-	if ((read_struct(parms.delta_fd, (char *)&dheader, sizeof(delta_header), "delta_header")) == -1)
+	if ( stream )
+	{
+		if ( dd_delta_read(&reader, &dheader, sizeof(delta_header)) == -1 )
+		{
+			dd_log(LOG_ERR, "delta stream ended before the header");
+			return -1;
+		}
+	}
+	else if ((read_struct(parms.delta_fd, (char *)&dheader, sizeof(delta_header), "delta_header")) == -1)
 	{
 		return (-1);
 	}	
@@ -247,23 +1663,27 @@ int ddcommit(int runmode)
 	dd_log(LOG_INFO,"read magic version '%8.8s' from delta file", dheader.magic_version);
 	
 
-	if ( lseek64(parms.delta_fd, parms.delta_size_bytes-sizeof(delta_footer), SEEK_SET) == -1 )
+	memset(&dfooter, 0, sizeof(dfooter));
+	if ( !stream )
 	{
-		dd_log(LOG_ERR,"seek set to read offset: %llu failed", parms.delta_size_bytes-sizeof(delta_footer));
-		return -1;
-	}
+		if ( lseek64(parms.delta_fd, parms.delta_size_bytes-sizeof(delta_footer), SEEK_SET) == -1 )
+		{
+			dd_log(LOG_ERR,"seek set to read offset: %llu failed", parms.delta_size_bytes-sizeof(delta_footer));
+			return -1;
+		}
 
-	if ((read_struct(parms.delta_fd, (char *)&dfooter, sizeof(delta_footer), "delta_footer")) == -1)
-	{
-		return (-1);
-	}	
+		if ((read_struct(parms.delta_fd, (char *)&dfooter, sizeof(delta_footer), "delta_footer")) == -1)
+		{
+			return (-1);
+		}	
 
-       if ((strncmp((char *)&dfooter.magic_end, MAGIC_END, sizeof(dfooter.magic_end)) != 0))
-	{
-		dd_log(LOG_ERR, "failed to read magic end from delta file");
-		return -1;
+	       if ((strncmp((char *)&dfooter.magic_end, MAGIC_END, sizeof(dfooter.magic_end)) != 0))
+		{
+			dd_log(LOG_ERR, "failed to read magic end from delta file");
+			return -1;
+		}
+		dd_log(LOG_INFO,"read magic end     '%8.8s' from delta file", dfooter.magic_end);
 	}
-	dd_log(LOG_INFO,"read magic end     '%8.8s' from delta file", dfooter.magic_end);
 
 	parms.registeredflag = 0;
 	parms.compressedflag = 0;
@@ -274,10 +1694,26 @@ int ddcommit(int runmode)
 	if ((base_opts >> DDFLAG_REGISTERED) & 0x1) parms.registeredflag = 1;
 	if ((base_opts >> DDFLAG_COMPRESSED) & 0x1) parms.compressedflag = 1;
 	if ((base_opts >> DDFLAG_ENCRYPTED ) & 0x1) parms.encryptedflag  = 1;
+	if ((base_opts >> DDFLAG_ROLLING   ) & 0x1) parms.rollingflag    = 1;
+	if ((base_opts >> DDFLAG_CHECKSUMS ) & 0x1) parms.checksumsflag  = 1;
+	if ((base_opts >> DDFLAG_RECORDCRC ) & 0x1) parms.recordcrcflag  = 1;
+
+	if ( dheader.conf_opts & ~(set_dd_flag(DDFLAG_REGISTERED) | set_dd_flag(DDFLAG_COMPRESSED) |
+		set_dd_flag(DDFLAG_ENCRYPTED) | set_dd_flag(DDFLAG_ROLLING) | set_dd_flag(DDFLAG_CHECKSUMS) |
+		set_dd_flag(DDFLAG_RECORDCRC)) ||
+		( parms.rollingflag && parms.checksumsflag ) )
+	{
+		dd_log(LOG_ERR, "delta file options 0x%llx are not supported by this ddcommit",
+			(long long unsigned)dheader.conf_opts);
+		return -1;
+	}
 
 	dd_log(LOG_INFO, "parms.registeredflag '%s'", parms.registeredflag ? "TRUE": "FALSE");
 	dd_log(LOG_INFO, "parms.compressedflag '%s'", parms.compressedflag ? "TRUE": "FALSE");
 	dd_log(LOG_INFO, "parms.encryptedflag  '%s'", parms.encryptedflag  ? "TRUE": "FALSE");
+	dd_log(LOG_INFO, "parms.rollingflag    '%s'", parms.rollingflag    ? "TRUE": "FALSE");
+	dd_log(LOG_INFO, "parms.checksumsflag  '%s'", parms.checksumsflag  ? "TRUE": "FALSE");
+	dd_log(LOG_INFO, "parms.recordcrcflag  '%s'", parms.recordcrcflag  ? "TRUE": "FALSE");
 
  
 	if (parms.compressedflag == 0) {
@@ -290,20 +1726,30 @@ int ddcommit(int runmode)
 	// delta_payload = parms.delta_size_bytes - sizeof(delta_header) - sizeof(delta_footer) - (dfooter.delta_seg_count * 16);
 	
 	fprintf(stdout, "Zipped:             %s\n",  parms.compressedflag ? "True" : "False");
+	if (parms.rollingflag == 1)
+	{
+		fprintf(stdout, "Rolling:            True\n");
+	}
+	if (parms.checksumsflag == 1)
+	{
+		fprintf(stdout, "Checksums:          Embedded%s\n", parms.verifyflag ? " (verified)" : "");
+	}
+	if (parms.recordcrcflag == 1)
+	{
+		fprintf(stdout, "Record CRC:         True\n");
+	}
 	fprintf(stdout, "Source size:        %llu\n", (long long unsigned)dheader.source_size);
 	fprintf(stdout, "Check Seg size:     %llu\n", (long long unsigned)dheader.check_seg_size);
-	fprintf(stdout, "Segment count:      %llu\n", (long long unsigned)dfooter.delta_seg_count);
-	fprintf(stdout, "Delta size:         %llu\n", (long long unsigned)dfooter.delta_size);
-	if (parms.compressedflag == 1) 
+	if ( !stream )
 	{
-		fprintf(stdout, "Delta zip size:     %llu\n", (long long unsigned)dfooter.delta_zip_size);
-		if (dfooter.delta_size > 0) 
-		{
-			fprintf(stdout, "Zip Ratio:         %5.2f%%\n", (float)dfooter.delta_zip_size/dfooter.delta_size);
-		}
+		show_footer(&dfooter);
 	}
 	// fprintf(stdout, "Delta size(calc):   %llu\n", (long long unsigned)delta_payload);
 
+	if (parms.runmode == RUNMODE_CHECK_DELTA) {
+		return delta_check(&dheader, &dfooter);
+	}
+
 	if (parms.runmode == RUNMODE_APPLY_DELTA) {
 
 		u_int64_t checksum_size = 0;
@@ -313,7 +1759,12 @@ int ddcommit(int runmode)
 		fprintf(stdout, "Checksum size:      %llu\n", (long long unsigned)checksum_size);
 
 
-		if ( lseek64(parms.delta_fd, sizeof(delta_header), SEEK_SET) == -1 )
+		if ( stream && parms.rollingflag )
+		{
+			dd_log(LOG_ERR, "rolling hash deltas read the delta twice, apply them from a file");
+			return -1;
+		}
+		if ( !stream && lseek64(parms.delta_fd, sizeof(delta_header), SEEK_SET) == -1 )
 		{
 			dd_log(LOG_ERR,"seek set to read offset: %llu failed", 40);
 			return -1;
@@ -324,9 +1775,53 @@ int ddcommit(int runmode)
                 	dd_log(LOG_INFO,"skipping checksum computations");
                        	parms.checksum_array = NULL;
                	}
+		else if ( dd_file_exists(parms.checksum_file) &&
+			dd_checksum_is_compact(parms.checksum_file) )
+		{
+			//
+			// compact checksum file, expand it into memory and save it
+			// once the delta is applied, sized like a raw file would be
+			//
+			u_int64_t segments, new_segments = checksum_size / sizeof(checksum_struct);
+			parms.checksum_compact = 1;
+
+			//
+			// a checkpoint would rewrite the whole file, the apply
+			// restarts from the first block instead
+			//
+			if ( parms.checkpoint_mb > 0 )
+			{
+				dd_log(LOG_INFO, "compact checksum file %s, checkpoints disabled",
+					parms.checksum_file);
+				parms.checkpoint_mb = 0;
+			}
+			if ((parms.checksum_array = dd_checksum_load(parms.checksum_file, &segments)) == NULL )
+			{
+				return -1;
+			}
+			if ( segments > new_segments && !parms.rollingflag )
+				new_segments = segments;
+			if ((parms.checksum_array = dd_checksum_resize(parms.checksum_array,
+				segments, new_segments)) == NULL )
+			{
+				return -1;
+			}
+			parms.mmap_size = new_segments * sizeof(checksum_struct);
+		}
 		else 
 		{
-			parms.mmap_fd = open_file_with_size("checksum", parms.checksum_file, checksum_size);
+			parms.mmap_fd = open_file_with_size("checksum", parms.checksum_file, checksum_size, parms.rollingflag);
+
+			//
+			// a rolling hash delta may shrink the source, checksums
+			// of the segments that remain stay valid
+			//
+			if ( parms.rollingflag && ftruncate64(parms.mmap_fd, checksum_size) )
+			{
+				dd_log(LOG_ERR, "ftruncate64 of checksum file %s failed to %llu bytes",
+					parms.checksum_file, checksum_size);
+				return -1;
+			}
 
 			if ((parms.mmap_size = dd_device_size(parms.mmap_fd)) == -1 )
 			{
@@ -344,120 +1839,428 @@ int ddcommit(int runmode)
 			dd_log(LOG_DEBUG,"checksum array ptr: %p", parms.checksum_array);
 		}
 
-		strncpy (parms.delta_info_file, parms.delta_file, strlen(parms.delta_file));
-		strncat (parms.delta_info_file, ".rinfo", strlen(parms.delta_file)+6);
-		parms.delta_info_fd = fopen (parms.delta_info_file, "w+");
+		u_int64_t resume_records = 0, resume_offset = sizeof(delta_header);
+		u_int64_t resume_data_bytes = 0, resume_zip_total = 0;
+		if ( parms.resumeflag && ( stream || parms.rollingflag ) )
+		{
+			dd_log(LOG_ERR, "--resume needs a delta file and no copy records (rolling hash)");
+			return -1;
+		}
+
+		//
+		// progress of a stream is not kept
+		//
+		if ( stream )
+		{
+			strcpy (parms.delta_info_file, "/dev/null");
+			parms.delta_info_fd = fopen (parms.delta_info_file, "w");
+		}
+		else
+		{
+		if ( snprintf(parms.delta_info_file, sizeof(parms.delta_info_file), "%s.rinfo",
+			parms.delta_file) >= sizeof(parms.delta_info_file) )
+		{
+			dd_log(LOG_ERR, "info file name of %s is too long", parms.delta_file);
+			return -1;
+		}
+
+		//
+		// resume after the last checkpoint, the .rinfo file is kept
+		//
+		if ( parms.resumeflag &&
+			read_checkpoint(delta_identity(&dheader, &dfooter), &resume_records,
+			&resume_offset, &resume_data_bytes, &resume_zip_total) )
+		{
+			fprintf(stdout, "Resume:             block %llu, offset %llu\n",
+				(long long unsigned)resume_records, (long long unsigned)resume_offset);
+		}
+		else if ( parms.resumeflag )
+		{
+			dd_log(LOG_INFO, "no checkpoint of this delta in %s, starting at the first block",
+				parms.delta_info_file);
+		}
+		parms.delta_info_fd = fopen (parms.delta_info_file, parms.resumeflag ? "a+" : "w+");
+		}
 
-		ts.target_fd = open_file_with_size("target", parms.target_dev, dheader.source_size);
+		ts.target_fd = open_file_with_size("target", parms.target_dev, dheader.source_size, parms.rollingflag);
 		if (ts.target_fd < 0) { exit (1); }
 
-		// Allocate memory to use as the compress buffer
-		if (parms.zipbuffer == NULL) 
+		//
+		// rolling hash deltas: resolve copy records before writing, and
+		// track the segments written to checksum them at the end
+		//
+		int spool_fd = -1;
+		u_int8_t *dirty = NULL;
+		if (parms.rollingflag > 0)
+		{
+			if ((spool_fd = spool_copy_records(ts.target_fd, dfooter.delta_seg_count, read_buffer)) == -1 )
+			{
+				return -1;
+			}
+			if ( parms.checksum_array != NULL &&
+				(dirty = calloc(checksum_size / sizeof(checksum_struct) + 1, 1)) == NULL )
+			{
+				dd_log(LOG_ERR, "unable to allocate dirty segment map");
+				return -1;
+			}
+		}
+
+		//
+		// start the workers, they take records from the queue until the
+		// reader is done
+		//
+		thread_struct *threads;
+		int worker;
+
+		//
+		// records of a file are parsed in the mapped delta, payloads are
+		// not copied (a stream goes through the buffered reader)
+		//
+		if ( !stream && delta_reader_open(&reader, resume_offset) == -1 )
+		{
+			return -1;
+		}
+
+		//
+		// -q with a compressed delta: every queued write uncompresses
+		// into its own 8MB buffer, all of them stay within APPLY_BUFFER_MB
+		//
+		if ( parms.compressedflag && parms.uring_depth > 0 &&
+			(u_int64_t)parms.workers * parms.uring_depth * READ_BUFFER_SIZE >
+			(u_int64_t)APPLY_BUFFER_MB * MEGABYTE_FACTOR )
+		{
+			int depth = (u_int64_t)APPLY_BUFFER_MB * MEGABYTE_FACTOR /
+				((u_int64_t)parms.workers * READ_BUFFER_SIZE);
+			if ( depth < 1 )
+				depth = 1;
+			dd_log(LOG_INFO, "apply: queue depth %d reduced to %d, %d MB of uncompress buffers",
+				parms.uring_depth, depth, APPLY_BUFFER_MB);
+			parms.uring_depth = depth;
+		}
+
+		//
+		// slots need a buffer for the buffered reader and for copy
+		// records (read from the spool), not for mapped payloads. Slots
+		// without one are cheap, enough for every queued write to hold one.
+		//
+		u_int64_t slot_bound = reader.map == NULL || parms.rollingflag ? bound : 0;
+		int slots = parms.workers * (2 + parms.uring_depth);
+		if ( slot_bound > 0 )
+			slots = parms.workers * 2 + APPLY_READ_AHEAD;
+		if ( apply_queue_init(slots, slot_bound) == -1 )
+		{
+			return -1;
+		}
+		applyq.target_fd      = ts.target_fd;
+		applyq.seg_count      = dfooter.delta_seg_count;
+		applyq.check_seg_size = dheader.check_seg_size;
+		applyq.dirty          = dirty;
+		applyq.data_bytes     = resume_data_bytes;
+		applyq.completed      = resume_records;
+
+		//
+		// -d: a second, O_DIRECT descriptor for the aligned part of the
+		// writes, the buffered one takes unaligned heads and tails and
+		// the reads (copy records, rehashing)
+		//
+		if ( parms.o_direct )
+		{
+			if ( (applyq.direct_fd = dd_dev_open_rw(parms.target_dev, 1)) == -1 )
+				dd_log(LOG_INFO, "target %s does not support direct io, writes are buffered", parms.target_dev);
+			else
+				dd_log(LOG_INFO, "direct io enabled on target %s", parms.target_dev);
+		}
+
+		memset(&applyw, 0, sizeof(applyw));
+		if ( parms.sort_window_mb > 0 )
+		{
+			applyw.limit = parms.sort_window_mb * MEGABYTE_FACTOR;
+			if ( applyq.direct_fd != -1 && (applyw.bounce = apply_alloc(READ_BUFFER_SIZE)) == NULL )
+			{
+				dd_log(LOG_ERR, "apply: unable to allocate window bounce buffer");
+				return -1;
+			}
+			pthread_mutex_init(&applyw.lock, NULL);
+			dd_log(LOG_INFO, "sorted apply: window of %llu MB", parms.sort_window_mb);
+			if ( parms.uring_depth > 0 )
+				dd_log(LOG_INFO, "sorted apply writes extents with pwrite, ignoring -q");
+		}
+
+		dd_log(LOG_INFO, "workers: %d", parms.workers);
+		if ( (threads = calloc(parms.workers, sizeof(thread_struct))) == NULL )
+		{
+			dd_log(LOG_ERR,"unable to allocate memory for %d workers", parms.workers);
+			return -1;
+		}
+		for(worker=0; worker < parms.workers; worker++)
 		{
-			if ((parms.zipbuffer = malloc(bound)) == NULL)
+			threads[worker].worker_id = worker;
+			pthread_attr_init(&threads[worker].thread_attributes);
+			if ( pthread_create(&threads[worker].worker_thread, &threads[worker].thread_attributes,
+				(void *) apply_worker_thread, (void *)&threads[worker]) != 0 )
 			{
-               			dd_log(LOG_ERR,"delta: Failed to malloc %d bytes", bound);
-               			exit(1);
+				dd_log(LOG_ERR,"pthread_create apply failed");
+				return -1;
 			}
-                	dd_log(LOG_DEBUG,"delta: Success with malloc of %d bytes", bound);
 		}
-		dd_log(LOG_DEBUG, "uLongf size %d bytes, u_int64_t size %d bytes", sizeof(uLongf), sizeof(u_int64_t));
 
-		u_int64_t i;
-		for (i=0; i < dfooter.delta_seg_count; i++) {
-			int buffer_read_bytes = 0;
-			u_int64_t seg_offset = read_long(parms.delta_fd);
-			u_int64_t data_size  = read_long(parms.delta_fd);
+		u_int64_t i = resume_records;
+		u_int64_t zip_total = resume_zip_total;
+		u_int64_t checkpoint_offset = reader.offset;
+		u_int32_t identity = delta_identity(&dheader, &dfooter);
+		for (;;) {
+			if ( stream ? delta_stream_footer(&reader, i) : i == dfooter.delta_seg_count )
+			{
+				break;
+			}
+
+			apply_slot *slot = apply_get_idle();
+			u_int64_t seg_offset, data_size;
+			u_int32_t crc = crc32(0L, Z_NULL, 0);
+			u_int64_t checksum_count = 0;
+			if ( dd_delta_read(&reader, &seg_offset, sizeof(seg_offset)) == -1 ||
+				dd_delta_read(&reader, &data_size, sizeof(data_size)) == -1 )
+			{
+				dd_log(LOG_ERR, "delta is truncated at block %llu (offset %llu)", i+1, reader.offset);
+				apply_put_idle(slot);
+				failed = 1;
+				break;
+			}
+			crc = crc32(crc, (Bytef *)&seg_offset, sizeof(seg_offset));
+			crc = crc32(crc, (Bytef *)&data_size, sizeof(data_size));
 	
 			// fprintf (stdout, "Applying data block %lu/%lu, size %lu at offset %lu\n", i+1, dfooter.delta_seg_count, data_size, seg_offset);
 
-			if (parms.compressedflag > 0) 
-			{
-				dd_log(LOG_DEBUG, "unzipping segment(s)");
+			slot->index = i+1;
+			slot->offset = seg_offset;
+			slot->compressed = 0;
+			slot->copy = 0;
+			slot->checksum_count = 0;
+			slot->payload = slot->data;
 
-				if ( (buffer_read_bytes = read(parms.delta_fd, parms.zipbuffer, data_size)) == -1 )
+			if (data_size & DELTA_COPY_RECORD)
+			{
+				u_int64_t copy_offset = 0;
+				data_size &= ~DELTA_COPY_RECORD;
+				if ( dd_delta_read(&reader, &copy_offset, sizeof(copy_offset)) == -1 ||
+					spool_fd == -1 || data_size > READ_BUFFER_SIZE ||
+					read_payload(spool_fd, slot->data, data_size) == -1 )
 				{
-					dd_log(LOG_ERR, "unable to read %llu compressed bytes from delta file, block %lu of %lu", data_size, i+1, dfooter.delta_seg_count);
-					return -1;
+					dd_log(LOG_ERR, "unable to read %llu spooled bytes (from %llu), block %lu of %lu", data_size, copy_offset, i+1, dfooter.delta_seg_count);
+					apply_put_idle(slot);
+					failed = 1;
+					break;
 				}
-		
-				// ZEXTERN int ZEXPORT uncompress OF((Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLen));
-				uLongf destLen = bound;
-				int uncomp_ret;
-				if ((uncomp_ret = uncompress ((Bytef *)read_buffer, &destLen, (Bytef *)parms.zipbuffer, data_size)) != Z_OK) 
+				crc = crc32(crc, (Bytef *)&copy_offset, sizeof(copy_offset));
+				slot->copy = 1;
+			}
+			else
+			{
+				u_int64_t phase_ns = dd_stats_begin();
+				if ( data_size > (parms.compressedflag ? bound : READ_BUFFER_SIZE) ||
+					( reader.map != NULL ? (slot->payload = dd_delta_take(&reader, data_size)) == NULL :
+					dd_delta_read(&reader, slot->data, data_size) == -1 ) )
 				{
-                                       	dd_log(LOG_ERR,"uncompress delta: failed at block %lu of %lu - input size %lu - error %d", i+1, dfooter.delta_seg_count, data_size, uncomp_ret);
-                                       	exit(1);
-
+					dd_log(LOG_ERR, "unable to read %llu bytes from delta, block %lu (offset %llu), delta is truncated or broken", data_size, i+1, reader.offset);
+					apply_put_idle(slot);
+					failed = 1;
+					break;
+				}
+				dd_stats_end(DD_PHASE_READ, phase_ns, data_size);
+				slot->compressed = parms.compressedflag;
+				zip_total += data_size;
+				if ( parms.recordcrcflag )
+				{
+					phase_ns = dd_stats_begin();
+					crc = crc32(crc, (Bytef *)slot->payload, data_size);
+					dd_stats_end(DD_PHASE_HASH, phase_ns, data_size);
 				}
-                                dd_log(LOG_DEBUG,"uncompress delta: uncompressed %lu bytes to %lu bytes", data_size, destLen);
-				data_size = destLen;
 
-				
-			}
-			else 
-			{
-				if ( (buffer_read_bytes = read(parms.delta_fd, read_buffer, data_size)) == -1 )
+				//
+				// embedded checksums travel with the record, the worker
+				// stores them once they pass (--verify) before writing
+				//
+				if ( parms.checksumsflag )
 				{
-					dd_log(LOG_ERR, "unable to read %llu bytes from delta file, block %lu of %lu", data_size, i+1, dfooter.delta_seg_count);
-					return -1;
+					u_int64_t first = seg_offset / dheader.check_seg_size;
+
+					if ( dd_delta_read(&reader, &checksum_count, sizeof(checksum_count)) == -1 ||
+						checksum_count > DELTA_RECORD_CHECKSUMS || seg_offset % dheader.check_seg_size ||
+						first + checksum_count > checksum_size / sizeof(checksum_struct) ||
+						dd_delta_read(&reader, slot->checksums, checksum_count * sizeof(checksum_struct)) == -1 )
+					{
+						dd_log(LOG_ERR, "unable to read %llu checksums of block %lu (offset %llu), delta is truncated or broken", checksum_count, i+1, reader.offset);
+						apply_put_idle(slot);
+						failed = 1;
+						break;
+					}
+					crc = crc32(crc, (Bytef *)&checksum_count, sizeof(checksum_count));
+					crc = crc32(crc, (Bytef *)slot->checksums, checksum_count * sizeof(checksum_struct));
+					slot->checksum_count = checksum_count;
 				}
-		
 			}
 
-			u_int64_t delta_bytes_written;
+			//
+			// a record that fails its crc is not written
+			//
+			if ( parms.recordcrcflag )
+			{
+				u_int64_t stored_crc = 0;
 
-                        if ( lseek64(ts.target_fd, seg_offset, SEEK_SET) == -1 )
-                        {
-                                dd_log(LOG_ERR,"seek set to write offset: %llu failed",seg_offset);
-                                exit(1);
-                        }
+				if ( dd_delta_read(&reader, &stored_crc, sizeof(stored_crc)) == -1 || stored_crc != crc )
+				{
+					dd_log(LOG_ERR, "block %llu (offset %llu) fails its integrity check, crc32 %08x, delta has %08llx",
+						i+1, reader.offset, crc, stored_crc);
+					apply_put_idle(slot);
+					failed = 1;
+					break;
+				}
+			}
+			slot->size = data_size;
+			apply_put_ready(slot);
+			i++;
 
+			if ( parms.checkpoint_mb > 0 &&
+				reader.offset - checkpoint_offset >= parms.checkpoint_mb * MEGABYTE_FACTOR )
+			{
+				if ( apply_checkpoint(i, reader.offset, zip_total, identity) == -1 )
+				{
+					failed = 1;
+					break;
+				}
+				checkpoint_offset = reader.offset;
+			}
+		}
 
-                        if ((delta_bytes_written = write(ts.target_fd, read_buffer, data_size))==-1)
-                        {
-                        	dd_log(LOG_ERR,"delta write failed");
-                                exit(1);
-                        }
-                        dd_log(LOG_DEBUG,"Writing block %llu/%llu, size %llu at offset %llu", i+1, dfooter.delta_seg_count, data_size, seg_offset);
+		apply_finish();
+		for(worker=0; worker < parms.workers; worker++)
+		{
+			if ( pthread_join(threads[worker].worker_thread, NULL) != 0 )
+			{
+				dd_log(LOG_ERR,"pthread_join failed");
+				return -1;
+			}
+			if ( threads[worker].worker_thread_ccode == -1 )
+			{
+				dd_log(LOG_ERR,"thread terminated unexpectantly");
+				return -1;
+			}
+		}
+		free(threads);
 
-                        fprintf(parms.delta_info_fd, "Writing block %llu/%llu, size %llu at offset %llu\n", (long long unsigned)i+1, (long long unsigned)dfooter.delta_seg_count, (long long unsigned)data_size, (long long unsigned)seg_offset);
+		//
+		// the last window is written before the queue (whose lock the
+		// accounting takes) goes away
+		//
+		if ( parms.sort_window_mb > 0 )
+		{
+			apply_window_flush();
+			free(applyw.records);
+			free(applyw.bounce);
+			pthread_mutex_destroy(&applyw.lock);
+			dd_log(LOG_INFO, "sorted apply: %llu records in %llu writes, %llu merged, %llu windows",
+				i, applyw.writes, applyw.merged, applyw.flushes);
+		}
+		apply_queue_free();
 
+		if ( applyq.direct_fd != -1 )
+		{
+			fprintf(stdout, "Direct writes:      %llu (%llu bytes, %llu bounced)\n",
+				(long long unsigned)applyq.direct_writes, (long long unsigned)applyq.direct_bytes,
+				(long long unsigned)applyq.bounced_bytes);
+			fprintf(stdout, "Buffered writes:    %llu (%llu bytes)\n",
+				(long long unsigned)applyq.buffered_writes, (long long unsigned)applyq.buffered_bytes);
+			close(applyq.direct_fd);
+			applyq.direct_fd = -1;
+		}
 
-			if (parms.checksum_array != NULL)
+		//
+		// the footer closes the stream, its totals must match what was
+		// applied (a file's footer is checked the same way)
+		//
+		if ( !failed && stream )
+		{
+			if ( dd_delta_read(&reader, &dfooter, sizeof(delta_footer)) == -1 )
+			{
+				dd_log(LOG_ERR, "delta stream ended before the footer");
+				failed = 1;
+			}
+			else
 			{
+				show_footer(&dfooter);
+			}
+		}
+		if ( !failed && reader.map != NULL && !dd_delta_at_end(&reader) )
+		{
+			dd_log(LOG_ERR, "%llu bytes follow the last record of the delta",
+				reader.len - reader.pos);
+			failed = 1;
+		}
+		if ( !failed && ( applyq.data_bytes != dfooter.delta_size ||
+			( parms.compressedflag && zip_total != dfooter.delta_zip_size ) ) )
+		{
+			dd_log(LOG_ERR, "applied %llu bytes (%llu zipped), footer says %llu (%llu zipped)",
+				applyq.data_bytes, zip_total, dfooter.delta_size, dfooter.delta_zip_size);
+			failed = 1;
+		}
+		dd_delta_reader_free(&reader);
 
-				u_int64_t j;
-				Bytef * ptr = read_buffer;
-				u_int64_t check_count  = data_size  / dheader.check_seg_size;
-				u_int64_t check_offset = seg_offset / dheader.check_seg_size;
-				checksum_struct *checksum_ptr = parms.checksum_array + check_offset;
+		//
+		// flush ordering: every write has completed, the target is made
+		// durable before the checksum file describes it
+		//
+		if ( fsync(ts.target_fd) && errno != EINVAL )
+		{
+			dd_log(LOG_ERR, "unable to sync target %s", parms.target_dev);
+			return -1;
+		}
 
-				for (j=0; j < check_count; j++) 
+		if (parms.rollingflag > 0)
+		{
+			if ( dirty != NULL )
+			{
+				if ( rehash_dirty_segments(ts.target_fd, dirty, dheader.source_size,
+					dheader.check_seg_size, read_buffer) == -1 )
 				{
-                               		dd_log(LOG_DEBUG,"Writing checksum %llu/%llu in block %llu/%llu", j+1, check_count, i+1, dfooter.delta_seg_count);
-					write_checksum(ptr, checksum_ptr, dheader.check_seg_size);
-					ptr += dheader.check_seg_size;
-					checksum_ptr++;
-				}
-
-				// Catch any trailing data
-				u_int64_t check_trail = data_size % dheader.check_seg_size;
-				if (check_trail > 0) {
-                        	        dd_log(LOG_DEBUG,"Writing checksum of %lu trailing bytes in block %lu/%lu", check_trail, i+1, dfooter.delta_seg_count);
-					write_checksum(ptr, checksum_ptr, check_trail);
-					ptr += check_trail;
-					checksum_ptr++;
+					return -1;
 				}
+				free(dirty);
+			}
+			close(spool_fd);
+
+			//
+			// the source may have shrunk, regular files follow it
+			//
+			struct stat64 tstat;
+			if ( fstat64(ts.target_fd, &tstat) == 0 && S_ISREG(tstat.st_mode) &&
+				tstat.st_size > dheader.source_size &&
+				ftruncate64(ts.target_fd, dheader.source_size) )
+			{
+				dd_log(LOG_ERR, "ftruncate64 of target %s failed to %llu bytes",
+					parms.target_dev, dheader.source_size);
+				return -1;
 			}
-
 		}
+
 		// close memory mapped checksum file (must update the file date/time
        	 	// stamp since mmap does not (http://lkml.org/lkml/2007/2/20/255) and
        		// backup programs would then miss the checksum file - shit!)
         	//
-               	if (parms.checksum_array != NULL)
+		if (parms.checksum_compact)
+		{
+			if ( dd_checksum_save(parms.checksum_file, parms.checksum_array,
+				parms.mmap_size / sizeof(checksum_struct), 1) == -1 )
+			{
+				return -1;
+			}
+			free(parms.checksum_array);
+		}
+               	else if (parms.checksum_array != NULL)
 		{
+			if ( sync_checksums() == -1 )
+			{
+				failed = 1;
+			}
         		munmap((void*)parms.checksum_array, parms.mmap_size);
         		close(parms.mmap_fd);
         		utime(parms.checksum_file,NULL);
@@ -465,12 +2268,15 @@ int ddcommit(int runmode)
 
         	close(ts.target_fd);
 		fclose(parms.delta_info_fd);
-		unlink(parms.delta_info_file);
+		if ( !stream && !failed )
+		{
+			unlink(parms.delta_info_file);
+		}
 	}
 
 	close (parms.delta_fd);
 
-        return 0;
+        return failed ? -1 : 0;
 }
 //-----------------------------------------------------------------------------
 // display configuration parameters
@@ -483,6 +2289,293 @@ void dd_parms()
 	printf("SEGMENT_SIZE_BYTES=%d\n",SEGMENT_SIZE);
 }
 
+//-----------------------------------------------------------------------------
+// verify: read the target in parallel, checksum its segments in memory and
+// compare them against the checksum file, nothing is written except the
+// optional ddmap (-m) of the mismatching segments
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	checksum_struct	*checksums;
+	u_int64_t	segments;	// entries in the checksum file
+	u_int64_t	target_size;
+	u_int64_t	buffers;	// READ_BUFFER_SIZE pieces of the target
+	u_int64_t	next_buffer;	// handed out to the workers
+	u_int64_t	bytes_read;
+	u_int64_t	mismatches;
+	u_int32_t	*map;		// ddmap bits, one per segment
+	u_int64_t	start_ns;	// monotonic, see dd_stats_now
+} verify_state;
+
+verify_state verifys;
+
+//-----------------------------------------------------------------------------
+void verify_mismatch(u_int64_t segment)
+{
+	__sync_fetch_and_or(&verifys.map[segment >> DDMAP_U32_SHIFT], 1U << (segment & 31));
+	__sync_fetch_and_add(&verifys.mismatches, 1);
+}
+
+//-----------------------------------------------------------------------------
+// keep the sum of all workers under -r MB/s
+//-----------------------------------------------------------------------------
+void verify_throttle(u_int64_t bytes)
+{
+	u_int64_t total = __sync_add_and_fetch(&verifys.bytes_read, bytes);
+	u_int64_t due_usec, elapsed_usec;
+
+	if ( parms.max_read_mb_sec <= 0 )
+		return;
+
+	elapsed_usec = (dd_stats_now() - verifys.start_ns) / 1000;
+	due_usec = (double)total / ((double)parms.max_read_mb_sec * MEGABYTE_FACTOR) * 1000000.0;
+	if ( due_usec > elapsed_usec )
+	{
+		u_int64_t phase_ns = dd_stats_begin();
+		usleep(due_usec - elapsed_usec);
+		dd_stats_end(DD_PHASE_SLEEP, phase_ns, 0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+void *verify_worker_thread(thread_struct *thread)
+{
+	u_int64_t buffer;
+
+	dd_stats_thread(thread->worker_id);
+	#ifdef SUNOS
+	if ((thread->aligned_buffer = memalign(getpagesize(), READ_BUFFER_SIZE)) == NULL )
+	#else
+	if (posix_memalign((void**)&thread->aligned_buffer, getpagesize(), READ_BUFFER_SIZE))
+	#endif
+	{
+		dd_log(LOG_ERR, "unable to allocate buffers with READ_BUFFER_SIZE=%d",READ_BUFFER_SIZE);
+		thread->worker_thread_ccode = -1;
+		pthread_exit(NULL);
+	}
+	if ((thread->source_fd = dd_dev_open_ro(parms.target_dev, parms.o_direct)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open target device: %s", parms.target_dev);
+		thread->worker_thread_ccode = -1;
+		pthread_exit(NULL);
+	}
+
+	//
+	// buffers are handed out in order, so the workers read the target
+	// roughly sequentially
+	//
+	while ( (buffer = __sync_fetch_and_add(&verifys.next_buffer, 1)) < verifys.buffers )
+	{
+		u_int64_t pos = buffer * READ_BUFFER_SIZE;
+		u_int64_t len = verifys.target_size - pos;
+		u_int64_t got = 0;
+		ssize_t bytes;
+		u_int64_t segment, s;
+		u_int64_t phase_ns = dd_stats_begin();
+
+		if ( len > READ_BUFFER_SIZE )
+			len = READ_BUFFER_SIZE;
+
+		//
+		// O_DIRECT wants aligned sizes, ask for the whole buffer and take
+		// the short read at the end of the target
+		//
+		while ( got < len )
+		{
+			if ( (bytes = pread64(thread->source_fd, (char *)thread->aligned_buffer + got,
+				READ_BUFFER_SIZE - got, pos + got)) <= 0 )
+				break;
+			got += bytes;
+		}
+		if ( got < len )
+		{
+			dd_log(LOG_ERR, "unable to read %llu bytes at %llu from target", len, pos);
+			thread->worker_thread_ccode = -1;
+			pthread_exit(NULL);
+		}
+		dd_stats_end(DD_PHASE_READ, phase_ns, len);
+
+		for (s = 0; s * SEGMENT_SIZE < len; s++)
+		{
+			char *ptr = (char *)thread->aligned_buffer + s * SEGMENT_SIZE;
+			u_int32_t seg_bytes = len - s * SEGMENT_SIZE;
+			checksum_struct checksum;
+
+			if ( seg_bytes > SEGMENT_SIZE )
+				seg_bytes = SEGMENT_SIZE;
+			segment = buffer * BUFFER_SEGMENTS + s;
+
+			phase_ns = dd_stats_begin();
+			if ( dd_zero_check(ptr, seg_bytes) )
+			{
+				dd_zero_checksum(seg_bytes, &checksum);
+				thread->stats_zero_segments++;
+			}
+			else
+				write_checksum((Bytef *)ptr, &checksum, seg_bytes);
+			dd_stats_end(DD_PHASE_HASH, phase_ns, seg_bytes);
+
+			phase_ns = dd_stats_begin();
+			if ( segment >= verifys.segments ||
+				checksum.checksum1_murmur != verifys.checksums[segment].checksum1_murmur ||
+				checksum.checksum2_crc32 != verifys.checksums[segment].checksum2_crc32 )
+			{
+				dd_log(LOG_DEBUG, "segment %llu differs", segment);
+				verify_mismatch(segment);
+			}
+			dd_stats_end(DD_PHASE_COMPARE, phase_ns, seg_bytes);
+		}
+		thread->stats_read_buffers++;
+		verify_throttle(len);
+	}
+
+	close(thread->source_fd);
+	free(thread->aligned_buffer);
+	pthread_exit(NULL);
+}
+
+//-----------------------------------------------------------------------------
+// returns 0 if the target matches, 1 if segments differ and -1 on errors
+//-----------------------------------------------------------------------------
+int ddverify()
+{
+	thread_struct *threads;
+	u_int64_t end_ns;
+	int worker, fd;
+	u_int64_t segment, target_segments, map_segments, run_start = 0;
+	u_int64_t zero_segments = 0, extents = 0;
+	int in_run = 0;
+	double elapsed;
+
+	if ( !*parms.target_dev || !*parms.checksum_file )
+	{
+		dd_log(LOG_ERR, "verify needs a target (-t) and a checksum file (-c)");
+		return -1;
+	}
+
+	memset(&verifys, 0, sizeof(verifys));
+	if ( (verifys.checksums = dd_checksum_load(parms.checksum_file, &verifys.segments)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to load checksum file %s", parms.checksum_file);
+		return -1;
+	}
+	if ((fd = dd_dev_open_ro(parms.target_dev, 0)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open target device: %s", parms.target_dev);
+		return -1;
+	}
+	verifys.target_size = dd_device_size(fd);
+	close(fd);
+
+	//
+	// segments missing on either side count as mismatches
+	//
+	target_segments = (verifys.target_size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+	map_segments = target_segments > verifys.segments ? target_segments : verifys.segments;
+	verifys.buffers = (verifys.target_size + READ_BUFFER_SIZE - 1) / READ_BUFFER_SIZE;
+
+	fprintf(stdout, "Target size:        %llu\n", (long long unsigned)verifys.target_size);
+	fprintf(stdout, "Checksum segments:  %llu\n", (long long unsigned)verifys.segments);
+	if ( target_segments != verifys.segments )
+		fprintf(stdout, "Target segments:    %llu (size mismatch)\n", (long long unsigned)target_segments);
+
+	if ( (verifys.map = calloc((map_segments + 31) / 32 + 1, DDMAP_U32_SIZE)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate memory for the map");
+		return -1;
+	}
+	for (segment = target_segments; segment < verifys.segments; segment++)
+		verify_mismatch(segment);
+
+	dd_log(LOG_INFO, "verify workers: %d", parms.workers);
+	if ( (threads = calloc(parms.workers, sizeof(thread_struct))) == NULL )
+	{
+		dd_log(LOG_ERR,"unable to allocate memory for %d workers", parms.workers);
+		return -1;
+	}
+	verifys.start_ns = dd_stats_now();
+	for(worker=0; worker < parms.workers; worker++)
+	{
+		threads[worker].worker_id = worker;
+		pthread_attr_init(&threads[worker].thread_attributes);
+		if ( pthread_create(&threads[worker].worker_thread, &threads[worker].thread_attributes,
+			(void *) verify_worker_thread, (void *)&threads[worker]) != 0 )
+		{
+			dd_log(LOG_ERR,"pthread_create verify failed");
+			return -1;
+		}
+	}
+	for(worker=0; worker < parms.workers; worker++)
+	{
+		if ( pthread_join(threads[worker].worker_thread, NULL) != 0 )
+		{
+			dd_log(LOG_ERR,"pthread_join failed");
+			return -1;
+		}
+		if ( threads[worker].worker_thread_ccode == -1 )
+		{
+			dd_log(LOG_ERR,"thread terminated unexpectantly");
+			return -1;
+		}
+		zero_segments += threads[worker].stats_zero_segments;
+	}
+	free(threads);
+	end_ns = dd_stats_now();
+
+	//
+	// list the mismatching extents
+	//
+	for (segment = 0; segment <= map_segments; segment++)
+	{
+		int bit = segment < map_segments &&
+			(verifys.map[segment >> DDMAP_U32_SHIFT] & (1U << (segment & 31)));
+
+		if ( bit && !in_run )
+		{
+			run_start = segment;
+			in_run = 1;
+		}
+		else if ( !bit && in_run )
+		{
+			fprintf(stdout, "Mismatch:           offset %llu length %llu\n",
+				(long long unsigned)run_start * SEGMENT_SIZE,
+				(long long unsigned)(segment - run_start) * SEGMENT_SIZE);
+			extents++;
+			in_run = 0;
+		}
+	}
+
+	elapsed = (end_ns - verifys.start_ns) / 1e9;
+	fprintf(stdout, "Zero segments:      %llu\n", (long long unsigned)zero_segments);
+	fprintf(stdout, "Mismatched:         %llu segments in %llu extents\n",
+		(long long unsigned)verifys.mismatches, (long long unsigned)extents);
+	fprintf(stdout, "Read rate:          %0.1f MB/s\n",
+		elapsed > 0 ? verifys.bytes_read / (double)MEGABYTE_FACTOR / elapsed : 0);
+
+	//
+	// the ddmap of the mismatches feeds ddplus -m to resend them
+	//
+	if ( *parms.ddmap_dev )
+	{
+		struct ddmap_data map_data;
+		char *p;
+
+		memset(&map_data, 0, sizeof(map_data));
+		snprintf(map_data.map_device, sizeof(map_data.map_device), "%s", parms.ddmap_dev);
+		for (p = parms.target_dev; *p; p++)
+			map_data.name_sum += *p;
+		map_data.map_size = (map_segments + 31) / 32;
+		map_data.map_size_bytes = map_data.map_size * DDMAP_U32_SIZE;
+		map_data.map = verifys.map;
+		if ( ddmap_write(&map_data) == -1 )
+			return -1;
+	}
+
+	free(verifys.map);
+	free(verifys.checksums);
+	return verifys.mismatches > 0 ? 1 : 0;
+}
+
 //-----------------------------------------------------------------------------
 // help
 //-----------------------------------------------------------------------------
@@ -493,20 +2586,57 @@ void usage()
 "\n"
 "Apply the delta file to the target and update the checksum file\n"
 "\n"
-"	ddcommit	[-d] -a <show|apply> -x <delta> -t <target> [-c checksum] [-v]\n"
+"	ddcommit	[-d] -a <show|apply> -x <delta> -t <target> [-c checksum] [-w #]\n"
+"			[-q #] [-S <window_mb>] [--checkpoint <mb>] [--resume] [--verify]\n"
+"			[-T <prefix>] [-v]\n"
+"	ddcommit	-a check -x <delta> [-w #] [-v]\n"
+"	ddcommit	[-d] -a verify -t <target> -c <checksum> [-w #] [-r <read_rate_mb_s>]\n"
+"			[-m <ddmap>] [-T <prefix>] [-v]\n"
 "\n"
 "Parameters\n"
-"	-d	direct io enabled (i.e. bypasses buffer cache)\n"
+"	-d	direct io enabled (i.e. bypasses buffer cache), apply writes\n"
+"		the 4k aligned part of each record direct and its unaligned\n"
+"		head and tail buffered\n"
 "\n"
-"	-a	action - show or apply\n"
+"	-a	action - show, apply, check (validate the delta, record crcs\n"
+"		and zipped payloads, before applying it) or verify (checksum\n"
+"		the target and compare it against the checksum file, nothing\n"
+"		is written)\n"
+"	-x	delta file, - applies a delta streamed on stdin (not rolling\n"
+"		hash deltas)\n"
 "	-c	checksum file\n"
 "	-t	target device\n"
+"	-w	number of worker threads uncompressing and writing records\n"
+"		(check: validating records, verify: reading and checksumming\n"
+"		the target)\n"
+"	-r	verify: max read rate of the target in megabytes/sec\n"
+"	-m	verify: write the mismatching segments as a ddmap file, usable\n"
+"		with ddplus -m\n"
+"	-q	io_uring queue depth per worker, number of writes in flight\n"
+"		(each holds up to 8MB of record data, falls back to pwrite\n"
+"		if io_uring is not available). With a compressed delta the\n"
+"		depth is reduced so that all workers uncompress into at most\n"
+"		1024MB\n"
+"	-S	sort and merge writes by target offset within a window of\n"
+"		this many megabytes, large sequential writes for disk arrays\n"
+"	--checkpoint	sync target and checksums and record a checkpoint in\n"
+"		the .rinfo file every this many megabytes of delta (1024,\n"
+"		off with a compact checksum file)\n"
+"	--resume	continue an interrupted apply of the same delta after\n"
+"		its last checkpoint\n"
+"	--verify	delta with embedded checksums (ddplus -E): hash the written\n"
+"		data anyway and fail if it does not match them\n"
+"	-T	write per phase timings (read, hash, compare, compress, write,\n"
+"		sleep) to <prefix>.json and the node_exporter textfile\n"
+"		<prefix>.prom, every 10 seconds and at the end\n"
 "	-v	verbose\n"
 "\n"
 "Exit codes:\n"
 "	0	successful\n"
 "	1	a runtime error code, unable to complete task (detailed perror\n"
 "		and logical error message are output via stderr)\n"
+"	2	verify: the target does not match the checksum file\n"
+"		check: the delta is broken\n"
 );
 }
 
@@ -526,12 +2656,31 @@ int main(int argc, char *argv[])
         parms.encryptedflag      = 0;
         parms.delta_size_bytes   = 0;
 	parms.zipbuffer          = NULL;
+	parms.workers            = 1;
+	parms.checkpoint_mb      = 1024;
 	errflg = 0;
 
-	while ((c = getopt(argc, argv, "a:c:t:x:dvh?")) != -1)
+	static struct option long_options[] =
+	{
+		{ "checkpoint",	required_argument,	NULL, 'K' },
+		{ "resume",	no_argument,		NULL, 'R' },
+		{ "verify",	no_argument,		NULL, 'V' },
+		{ NULL,		0,			NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "a:c:t:x:w:q:S:r:m:T:dvh?", long_options, NULL)) != -1)
 	{
 		switch (c)
 		{
+			case 'K':
+				sscanf(optarg,"%llu", (long long unsigned *)&parms.checkpoint_mb);
+				break;
+			case 'R':
+				parms.resumeflag = 1;
+				break;
+			case 'V':
+				parms.verifyflag = 1;
+				break;
 			case 'a':
 				strncpy(parms.delta_action, optarg, DEV_NAME_LENGTH);
 				break;
@@ -544,6 +2693,34 @@ int main(int argc, char *argv[])
 			case 'x':
 				strncpy(parms.delta_file, optarg, DEV_NAME_LENGTH);
 				break;
+			case 'w':
+				sscanf(optarg,"%d", &parms.workers);
+				if ( parms.workers < 1 )
+				{
+					dd_log(LOG_ERR,"worker parameter must be >=1");
+					exit(1);
+				}
+				break;
+			case 'S':
+				sscanf(optarg,"%llu", (long long unsigned *)&parms.sort_window_mb);
+				break;
+			case 'q':
+				sscanf(optarg,"%d", &parms.uring_depth);
+				if ( parms.uring_depth < 0 )
+				{
+					dd_log(LOG_ERR,"queue depth must be >=0");
+					exit(1);
+				}
+				break;
+			case 'r':
+				sscanf(optarg,"%d", &parms.max_read_mb_sec);
+				break;
+			case 'm':
+				strncpy(parms.ddmap_dev, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'T':
+				strncpy(parms.stats_prefix, optarg, DEV_NAME_LENGTH - 1);
+				break;
 			case 'd':
 				parms.o_direct = 1;
 				break;
@@ -561,14 +2738,32 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if ( dd_stats_init("ddcommit", parms.stats_prefix, parms.workers) == -1 ) exit(1);
+
 	if (strncmp(parms.delta_action, "show", strlen("show")) == 0) {
 	  fprintf(stdout, "Action:             %s\n", parms.delta_action);
-	  ddcommit(RUNMODE_SHOW_DELTA);  
+	  if ( ddcommit(RUNMODE_SHOW_DELTA) == -1 ) exit(1);
+	  dd_stats_finish();
         }
 	else {
           if (strncmp(parms.delta_action, "apply", strlen("apply")) == 0) {
 	    fprintf(stdout, "Action:             %s\n", parms.delta_action);
-	    ddcommit(RUNMODE_APPLY_DELTA);  
+	    if ( ddcommit(RUNMODE_APPLY_DELTA) == -1 ) exit(1);
+	    dd_stats_finish();
+          }
+          else if (strncmp(parms.delta_action, "check", strlen("check")) == 0) {
+	    fprintf(stdout, "Action:             %s\n", parms.delta_action);
+	    int rc = ddcommit(RUNMODE_CHECK_DELTA);
+	    dd_stats_finish();
+	    if ( rc == -1 ) exit(1);
+	    if ( rc == 1 ) exit(2);
+          }
+          else if (strncmp(parms.delta_action, "verify", strlen("verify")) == 0) {
+	    fprintf(stdout, "Action:             %s\n", parms.delta_action);
+	    int rc = ddverify();
+	    dd_stats_finish();
+	    if ( rc == -1 ) exit(1);
+	    if ( rc == 1 ) exit(2);
           }
           else {
 	    dd_log(LOG_ERR,"unknown action");
@@ -0,0 +1,377 @@
+/*
+  ddgen: synthetic source images and change patterns for the benchmark
+
+  An image is created dense (every block written) or sparse (a tenth of
+  the 1MB extents written, the rest left as holes). Each change generation
+  rewrites a percentage of the image in 4KB blocks, the unit a filesystem
+  dirties, following one of the patterns:
+
+	uniform		blocks anywhere on the image
+	hotspot		90% of the blocks within a hot 5% window, the rest anywhere
+	log		a sequential run continuing where the last generation
+			stopped (kept in <image>.log), wrapping at the end
+	zero		blocks anywhere, overwritten with zeros
+	random		blocks anywhere, incompressible random data
+
+  Written data other than random and zero is about 2:1 compressible. The
+  segments touched by a generation can be written as a ddmap for ddplus -m.
+*/
+
+#include "ddless.h"
+#include "dd_log.h"
+#include "dd_map.h"
+
+parms_struct parms;
+
+#define GEN_BLOCK_SIZE		4096
+#define GEN_EXTENT_SIZE		MEGABYTE_FACTOR
+#define GEN_SPARSE_EVERY	10		// sparse: one extent in ten has data
+#define GEN_HOT_PERCENT		90
+#define GEN_HOT_WINDOW		20		// 1/20 = 5% of the image
+
+#define GEN_UNIFORM		0
+#define GEN_HOTSPOT		1
+#define GEN_LOG			2
+#define GEN_ZERO		3
+#define GEN_RANDOM		4
+
+char *gen_patterns[] = { "uniform", "hotspot", "log", "zero", "random", NULL };
+
+typedef struct
+{
+	int		fd;
+	u_int64_t	size;
+	u_int64_t	blocks;
+	u_int64_t	seed;
+	u_int32_t *	map;		// changed segments, ddmap bits
+	u_int64_t	map_words;
+	u_int64_t	changed_segments;
+} gen_struct;
+
+gen_struct gen;
+
+//-----------------------------------------------------------------------------
+// xorshift64*, reproducible for a given seed
+//-----------------------------------------------------------------------------
+static inline u_int64_t gen_random()
+{
+	gen.seed ^= gen.seed >> 12;
+	gen.seed ^= gen.seed << 25;
+	gen.seed ^= gen.seed >> 27;
+	return gen.seed * 0x2545f4914f6cdd1dULL;
+}
+
+//-----------------------------------------------------------------------------
+// fill a block: the first half random, the second half a repeated text
+// line, which deflate shrinks to about half of the block
+//-----------------------------------------------------------------------------
+void gen_fill(char *buf, int pattern)
+{
+	static const char text[] = "ddgen synthetic block of a filesystem, compressible half.\n";
+	u_int64_t *p = (u_int64_t *)buf;
+	int i, words = GEN_BLOCK_SIZE / sizeof(u_int64_t);
+
+	if ( pattern == GEN_ZERO )
+	{
+		memset(buf, 0, GEN_BLOCK_SIZE);
+		return;
+	}
+	if ( pattern != GEN_RANDOM )
+		words /= 2;
+	for(i=0; i < words; i++)
+		p[i] = gen_random();
+	for(i=words * sizeof(u_int64_t); i < GEN_BLOCK_SIZE; i++)
+		buf[i] = text[i % (sizeof(text) - 1)];
+}
+
+//-----------------------------------------------------------------------------
+// write one block and remember its segment in the ddmap
+//-----------------------------------------------------------------------------
+int gen_write(char *buf, u_int64_t block)
+{
+	u_int64_t pos = block * GEN_BLOCK_SIZE;
+	u_int64_t segment = pos / SEGMENT_SIZE;
+
+	if ( pwrite(gen.fd, buf, GEN_BLOCK_SIZE, pos) != GEN_BLOCK_SIZE )
+	{
+		dd_log(LOG_ERR, "unable to write block at %llu", pos);
+		return -1;
+	}
+	if ( gen.map != NULL &&
+		!(gen.map[segment >> DDMAP_U32_SHIFT] & (1U << (segment & 31))) )
+	{
+		gen.map[segment >> DDMAP_U32_SHIFT] |= 1U << (segment & 31);
+		gen.changed_segments++;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// create a dense or sparse image of size_mb
+//-----------------------------------------------------------------------------
+int ddgen_create(char *image, u_int64_t size_mb, int sparse)
+{
+	char buf[GEN_BLOCK_SIZE];
+	u_int64_t extent, block;
+	u_int64_t extents = size_mb * MEGABYTE_FACTOR / GEN_EXTENT_SIZE;
+	u_int64_t extent_blocks = GEN_EXTENT_SIZE / GEN_BLOCK_SIZE;
+
+	if ((gen.fd = open(image, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, (mode_t)0600)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to create image: %s", image);
+		return -1;
+	}
+	if ( ftruncate(gen.fd, size_mb * MEGABYTE_FACTOR) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to size image: %s", image);
+		return -1;
+	}
+	for(extent=0; extent < extents; extent++)
+	{
+		if ( sparse && gen_random() % GEN_SPARSE_EVERY )
+			continue;
+		for(block=0; block < extent_blocks; block++)
+		{
+			gen_fill(buf, GEN_UNIFORM);
+			if ( gen_write(buf, extent * extent_blocks + block) == -1 )
+				return -1;
+		}
+	}
+	if ( close(gen.fd) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to close image: %s", image);
+		return -1;
+	}
+	printf("created %s image %s: %llu MB\n", sparse ? "sparse" : "dense", image,
+		(long long unsigned)size_mb);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// the log pattern continues at the block recorded by the last generation
+//-----------------------------------------------------------------------------
+u_int64_t gen_log_position(char *image, u_int64_t next)
+{
+	char state_file[DEV_NAME_LENGTH];
+	unsigned long long block = 0;
+	FILE *fp;
+
+	snprintf(state_file, sizeof(state_file), "%s.log", image);
+	if ( next == (u_int64_t)-1 )
+	{
+		if ( (fp = fopen(state_file, "r")) != NULL )
+		{
+			if ( fscanf(fp, "%llu", &block) != 1 )
+				block = 0;
+			fclose(fp);
+		}
+		return block % gen.blocks;
+	}
+	if ( (fp = fopen(state_file, "w")) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to write log state: %s", state_file);
+		return (u_int64_t)-1;
+	}
+	fprintf(fp, "%llu\n", (long long unsigned)next);
+	fclose(fp);
+	return next;
+}
+
+//-----------------------------------------------------------------------------
+// one change generation: rewrite percent of the image following pattern
+//-----------------------------------------------------------------------------
+int ddgen_change(char *image, int pattern, double percent, char *map_file)
+{
+	char buf[GEN_BLOCK_SIZE];
+	u_int64_t i, count, block = 0, log_next = 0;
+	u_int64_t hot_start = 0, hot_blocks = 0;
+	struct ddmap_data map_data;
+
+	if ((gen.fd = open(image, O_WRONLY|O_LARGEFILE)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open image: %s", image);
+		return -1;
+	}
+	gen.size = lseek64(gen.fd, 0, SEEK_END);
+	gen.blocks = gen.size / GEN_BLOCK_SIZE;
+	if ( gen.blocks == 0 )
+	{
+		dd_log(LOG_ERR, "image too small: %s", image);
+		return -1;
+	}
+	count = gen.blocks * percent / 100;
+
+	if ( *map_file )
+	{
+		gen.map_words = ((gen.size + SEGMENT_SIZE - 1) / SEGMENT_SIZE + 31) / 32;
+		if ( (gen.map = calloc(gen.map_words, DDMAP_U32_SIZE)) == NULL )
+		{
+			dd_log(LOG_ERR, "unable to allocate the ddmap");
+			return -1;
+		}
+	}
+
+	if ( pattern == GEN_HOTSPOT )
+	{
+		hot_blocks = gen.blocks / GEN_HOT_WINDOW + 1;
+		hot_start = gen_random() % (gen.blocks - hot_blocks + 1);
+	}
+	if ( pattern == GEN_LOG )
+		log_next = gen_log_position(image, (u_int64_t)-1);
+
+	for(i=0; i < count; i++)
+	{
+		switch ( pattern )
+		{
+			case GEN_LOG:
+				block = log_next;
+				log_next = (log_next + 1) % gen.blocks;
+				break;
+			case GEN_HOTSPOT:
+				if ( gen_random() % 100 < GEN_HOT_PERCENT )
+				{
+					block = hot_start + gen_random() % hot_blocks;
+					break;
+				}
+				// fall through
+			default:
+				block = gen_random() % gen.blocks;
+		}
+		gen_fill(buf, pattern);
+		if ( gen_write(buf, block) == -1 )
+			return -1;
+	}
+
+	if ( pattern == GEN_LOG && gen_log_position(image, log_next) == (u_int64_t)-1 )
+		return -1;
+	if ( close(gen.fd) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to close image: %s", image);
+		return -1;
+	}
+
+	if ( gen.map != NULL )
+	{
+		memset(&map_data, 0, sizeof(map_data));
+		strncpy(map_data.map_device, map_file, DEV_NAME_LENGTH - 1);
+		map_data.map = gen.map;
+		map_data.map_size = gen.map_words;
+		map_data.map_size_bytes = gen.map_words * DDMAP_U32_SIZE;
+		if ( ddmap_write(&map_data) == -1 )
+			return -1;
+		free(gen.map);
+	}
+	printf("%s: %llu blocks of %d bytes changed (%s), %llu segments\n", image,
+		(long long unsigned)count, GEN_BLOCK_SIZE, gen_patterns[pattern],
+		(long long unsigned)gen.changed_segments);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// help
+//-----------------------------------------------------------------------------
+void usage()
+{
+	printf(
+"ddgen by Graham Houston, release date: "RELEASE_DATE"\n"
+"\n"
+"Create a dense or sparse source image for benchmarks\n"
+"\n"
+"	ddgen	-f <image> -n <size_mb> [-S] [-k seed] [-v]\n"
+"\n"
+"Change a percentage of the image in 4KB blocks\n"
+"\n"
+"	ddgen	-f <image> -p <pattern> -r <percent> [-m ddmap] [-k seed] [-v]\n"
+"\n"
+"Parameters\n"
+"	-f	image file\n"
+"	-n	size of the new image in MB\n"
+"	-S	sparse image, a tenth of the 1MB extents hold data\n"
+"	-p	change pattern: uniform, hotspot, log, zero or random\n"
+"	-r	percentage of the image changed\n"
+"	-m	ddmap file of the changed segments (ddplus -m)\n"
+"	-k	random seed (default 1), the same seed repeats a generation\n"
+"	-v	verbose\n"
+"\n"
+"Exit codes:\n"
+"	0	successful\n"
+"	1	a runtime error code, unable to complete task\n"
+);
+}
+
+//-----------------------------------------------------------------------------
+// main
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	int c, errflg = 0;
+	extern char *optarg;
+	char image[DEV_NAME_LENGTH] = "";
+	char map_file[DEV_NAME_LENGTH] = "";
+	u_int64_t size_mb = 0;
+	int sparse = 0, pattern = -1;
+	double percent = -1;
+
+	dd_log_init("ddgen");
+	gen.seed = 1;
+
+	while ((c = getopt(argc, argv, "f:n:p:r:m:k:Svh?")) != -1)
+	{
+		switch (c)
+		{
+			case 'f':
+				strncpy(image, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'n':
+				size_mb = strtoull(optarg, NULL, 10);
+				break;
+			case 'S':
+				sparse = 1;
+				break;
+			case 'p':
+				for(pattern=0; gen_patterns[pattern] != NULL; pattern++)
+					if ( strcmp(optarg, gen_patterns[pattern]) == 0 )
+						break;
+				if ( gen_patterns[pattern] == NULL )
+					errflg++;
+				break;
+			case 'r':
+				percent = atof(optarg);
+				break;
+			case 'm':
+				strncpy(map_file, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'k':
+				gen.seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'v':
+				dd_loglevel_inc();
+				break;
+			case 'h':
+			case '?':
+				errflg++;
+		}
+	}
+	if ( errflg || !*image || ( size_mb == 0 && pattern == -1 ) ||
+		( pattern != -1 && ( percent < 0 || percent > 100 ) ) )
+	{
+		usage();
+		exit(1);
+	}
+
+	// xorshift never leaves 0
+	if ( gen.seed == 0 )
+		gen.seed = 1;
+
+	if ( size_mb > 0 )
+	{
+		if ( ddgen_create(image, size_mb, sparse) == -1 )
+			exit(1);
+		exit(0);
+	}
+	// a generation must not replay the data stream of the created image
+	gen.seed ^= 0x9e3779b97f4a7c15ULL * (pattern + 1);
+	if ( ddgen_change(image, pattern, percent, map_file) == -1 )
+		exit(1);
+	exit(0);
+}
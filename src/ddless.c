@@ -22,6 +22,14 @@
 #include "dd_murmurhash2.h"
 #include "dd_file.h"
 #include "dd_map.h"
+#include "dd_zero.h"
+#include "dd_delta.h"
+#include "dd_rolling.h"
+#include "dd_journal.h"
+#include "dd_checksum.h"
+#include "dd_stats.h"
+#include "dd_zone.h"
+#include "dd_cache.h"
 
 parms_struct parms;
 thread_struct *threads;
@@ -132,6 +140,167 @@ int ddless_worker_init_delta_writer(thread_struct *thread)
 	return 0;
 }
 
+//-----------------------------------------------------------------------------
+// windowed mode: write the worker's checksum slice back, in one batch, and
+// drop it from the page cache
+//-----------------------------------------------------------------------------
+int checksum_window_flush(thread_struct *thread)
+{
+	off64_t offset = thread->window_start * sizeof(checksum_struct);
+	size_t bytes = thread->window_count * sizeof(checksum_struct);
+
+	if ( thread->window_dirty )
+	{
+		if ( pwrite64(parms.mmap_fd, thread->window, bytes, offset) != bytes )
+		{
+			dd_log(LOG_ERR, "unable to write %llu checksum bytes at %llu", bytes, offset);
+			return -1;
+		}
+		dd_cache_sync(parms.mmap_fd, offset, bytes);
+		thread->window_dirty = 0;
+	}
+	if ( bytes )
+		dd_cache_drop(parms.mmap_fd, offset, bytes);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// checksums of segments [segment, segment+count), from the mmap'd file or
+// the worker's window (loaded as needed)
+//-----------------------------------------------------------------------------
+checksum_struct *checksum_window(thread_struct *thread, u_int64_t segment, u_int64_t count)
+{
+	if ( !parms.checksum_windowed )
+		return parms.checksum_array + segment;
+
+	if ( segment >= thread->window_start &&
+		segment + count <= thread->window_start + thread->window_count )
+		return thread->window + (segment - thread->window_start);
+
+	if ( thread->window == NULL &&
+		(thread->window = malloc(parms.checksum_window_entries * sizeof(checksum_struct))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate checksum window of %llu entries",
+			parms.checksum_window_entries);
+		return NULL;
+	}
+	if ( checksum_window_flush(thread) == -1 )
+		return NULL;
+
+	//
+	// the window ends with the worker's range, the checksums after it
+	// belong to (and are written back by) the next worker
+	//
+	u_int64_t range_end = parms.source_segments;
+	if ( thread->worker_id < parms.workers - 1 )
+		range_end = (parms.read_buffers_per_worker * BUFFER_SEGMENTS) * (thread->worker_id + 1);
+
+	thread->window_start = segment;
+	thread->window_count = parms.checksum_window_entries;
+	if ( thread->window_start + thread->window_count > range_end )
+		thread->window_count = range_end - thread->window_start;
+
+	size_t bytes = thread->window_count * sizeof(checksum_struct);
+	if ( pread64(parms.mmap_fd, thread->window, bytes,
+		thread->window_start * sizeof(checksum_struct)) != bytes )
+	{
+		dd_log(LOG_ERR, "unable to read %llu checksums at segment %llu",
+			thread->window_count, thread->window_start);
+		return NULL;
+	}
+	dd_log(LOG_DEBUG, "checksum window: segments %llu...%llu",
+		thread->window_start, thread->window_start + thread->window_count);
+
+	return thread->window;
+}
+
+//-----------------------------------------------------------------------------
+// record a new segment checksum, staged in the journal if there is one
+//-----------------------------------------------------------------------------
+int update_checksum(thread_struct *thread, u_int64_t segment, checksum_struct *checksum)
+{
+	if ( parms.journal != NULL )
+		return dd_journal_add(parms.journal, thread, segment, checksum);
+
+	if ( parms.checksum_windowed )
+	{
+		checksum_struct *window = checksum_window(thread, segment, 1);
+		if ( window == NULL )
+			return -1;
+		*window = *checksum;
+		thread->window_dirty = 1;
+		return 0;
+	}
+
+	parms.checksum_array[segment] = *checksum;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// append a version 2 record (one JSON line) to the stats file. The record is
+// written with a single write so concurrent runs do not interleave.
+//-----------------------------------------------------------------------------
+int stats_record(int runmode, u_int64_t changed_segments, u_int64_t zero_segments,
+	u_int64_t written_bytes, u_int64_t elapsed_ns, double processing_perf)
+{
+	size_t size = 1024 + parms.stats_region_count * 12;
+	char *tmp;
+	int len;
+	u_int64_t region;
+	struct tm begin;
+
+	if ( (tmp = malloc(size)) == NULL )
+	{
+		return -1;
+	}
+	localtime_r(&parms.start_time, &begin);
+	len = snprintf(tmp, size, "{\"version\": %d, \"start\": \"%04d-%02d-%02d %02d:%02d:%02d\", "
+		"\"start_epoch\": %lld, \"mode\": \"%s\", \"workers\": %d, "
+		"\"source_bytes\": %llu, \"segments\": %llu, \"changed_segments\": %llu, "
+		"\"zero_segments\": %llu, \"segment_change_ratio\": %0.6f, \"bytes_written\": %llu, "
+		"\"elapsed_ns\": %llu, \"mb_per_sec\": %0.2f, \"region_bytes\": %llu, "
+		"\"region_changed\": [",
+		STATS_VERSION,
+		1900+begin.tm_year, begin.tm_mon+1, begin.tm_mday,
+		begin.tm_hour, begin.tm_min, begin.tm_sec,
+		(long long)parms.start_time,
+		runmode == RUNMODE_SOURCE_DELTA ? "delta" : "target",
+		parms.workers,
+		(long long unsigned)parms.source_size_bytes,
+		(long long unsigned)parms.source_segments,
+		(long long unsigned)changed_segments,
+		(long long unsigned)zero_segments,
+		parms.source_segments ? (double)changed_segments / parms.source_segments : 0,
+		(long long unsigned)written_bytes,
+		(long long unsigned)elapsed_ns,
+		processing_perf,
+		(long long unsigned)STATS_REGION_SIZE);
+	for(region=0; region < parms.stats_region_count; region++)
+	{
+		len += snprintf(tmp + len, size - len, "%s%u", region ? ", " : "",
+			parms.stats_regions[region]);
+	}
+	len += snprintf(tmp + len, size - len, "]}\n");
+
+	if ( write(parms.stats_fd, tmp, len) != len )
+	{
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// count a changed segment in its region, workers may share a region
+//-----------------------------------------------------------------------------
+static inline void stats_region_changed(u_int64_t segment)
+{
+	if ( parms.stats_regions != NULL )
+		__atomic_fetch_add(&parms.stats_regions[segment / STATS_REGION_SEGMENTS], 1,
+			__ATOMIC_RELAXED);
+}
+
 //-----------------------------------------------------------------------------
 // process buffer
 //-----------------------------------------------------------------------------
@@ -148,11 +317,18 @@ int process_buffer(thread_struct *thread,
 	// prepare the checksum pointer
 	//
 	checksum_struct *checksum_ptr = NULL;
-	if ( parms.checksum_array != NULL )
+	u_int64_t checksum_segment = source_pos / SEGMENT_SIZE;
+	if ( parms.checksum_array != NULL || parms.checksum_windowed )
 	{
-		checksum_ptr = parms.checksum_array + (source_pos / SEGMENT_SIZE);
+		u_int64_t checksum_count = (read_size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+		if ( checksum_segment + checksum_count > parms.source_segments )
+			checksum_count = parms.source_segments - checksum_segment;
+		if ( (checksum_ptr = checksum_window(thread, checksum_segment, checksum_count)) == NULL )
+		{
+			return -1;
+		}
 		dd_log(LOG_DEBUG,"checksum_array=%p checksum_ptr=%p offset=%u",
-			parms.checksum_array, checksum_ptr, (source_pos / SEGMENT_SIZE));
+			parms.checksum_array, checksum_ptr, checksum_segment);
 	}
 
 	//
@@ -168,12 +344,14 @@ int process_buffer(thread_struct *thread,
 	// read data
 	//
 	int buffer_read_bytes = 0;
+	u_int64_t phase_ns = dd_stats_begin();
 	if ( (buffer_read_bytes = read(thread->source_fd, 
 		thread->aligned_buffer, read_size)) == -1 )
 	{
 		dd_log(LOG_ERR, "unable to read from source device");
 		return -1;
 	}
+	dd_stats_end(DD_PHASE_READ, phase_ns, buffer_read_bytes);
 
 	//
 	// EOF (on SunOS we do not get here if rdsk is used!)
@@ -242,34 +420,68 @@ int process_buffer(thread_struct *thread,
 			// no checksum, then consider the segment dirty to force the write
 			//
 			thread->seg_bytes_dirty_map[segment] = seg_bytes;
+			if ( parms.checksumsflag )
+			{
+				thread->seg_checksums[segment].checksum1_murmur =
+					MurmurHash2(buf + buf_offset, seg_bytes, MURMUR_SEED);
+				thread->seg_checksums[segment].checksum2_crc32 =
+					crc32(crc32(0L, Z_NULL, 0), buf + buf_offset, seg_bytes);
+			}
 
 			//
 			// record stats
 			//
 			thread->stats_changed_segments++;
 			thread->stats_written_bytes += seg_bytes;
+			stats_region_changed(checksum_segment + segment);
 		}
 		else
 		{
 			//
-			// compute checksum
+			// compute checksum, zero segments are detected first and
+			// use the precomputed zero checksums instead of hashing
 			//
 			u_int32_t checksum1_murmur;
 			u_int32_t checksum2_crc32 = crc32( 0L, Z_NULL, 0 );
+			phase_ns = dd_stats_begin();
+			int zero_segment = dd_zero_check(buf + buf_offset, seg_bytes);
 
-			checksum1_murmur = MurmurHash2(buf + buf_offset, seg_bytes, 0xbabeaffe);
-			checksum2_crc32 = crc32(checksum2_crc32, buf + buf_offset, seg_bytes);
+			if ( zero_segment )
+			{
+				checksum_struct zero_checksum;
+				dd_zero_checksum(seg_bytes, &zero_checksum);
+				checksum1_murmur = zero_checksum.checksum1_murmur;
+				checksum2_crc32 = zero_checksum.checksum2_crc32;
+				thread->stats_zero_segments++;
+			}
+			else
+			{
+				checksum1_murmur = MurmurHash2(buf + buf_offset, seg_bytes, MURMUR_SEED);
+				checksum2_crc32 = crc32(checksum2_crc32, buf + buf_offset, seg_bytes);
+			}
+			dd_stats_end(DD_PHASE_HASH, phase_ns, seg_bytes);
+			phase_ns = dd_stats_begin();
 
 			//
 			// check if we need to write out this segment of data
 			// to the output device (i.e. checksums changed) OR
 			// if we have a new checksum file
 			//
-			if ( parms.checksum_file_new || 
+			if ( parms.checksum_file_new ||
 					checksum_ptr->checksum1_murmur != checksum1_murmur ||
 					checksum_ptr->checksum2_crc32 != checksum2_crc32)
 			{
-				if ( parms.runmode == RUNMODE_SOURCE_TARGET || parms.runmode == RUNMODE_SOURCE_DELTA)
+				//
+				// a zero extent going to a target file we just created does
+				// not need to be written, the file is sparse
+				//
+				int sparse_segment = ( zero_segment &&
+					parms.runmode == RUNMODE_SOURCE_TARGET && parms.target_sparse );
+				if ( sparse_segment )
+				{
+					dd_log(LOG_DEBUG,"zero extent at segment %d left sparse", segment);
+				}
+				else if ( parms.runmode == RUNMODE_SOURCE_TARGET || parms.runmode == RUNMODE_SOURCE_DELTA)
 				{
 					//
 					// instead of fseek, write the data, we just track the number of
@@ -285,23 +497,32 @@ int process_buffer(thread_struct *thread,
 					checksum2_crc32);
 
 				//
-				// write out the checksum via mmap'd file
+				// write out the checksum via journal or mmap'd file
 				//
-				checksum_ptr->checksum1_murmur = checksum1_murmur;
-				checksum_ptr->checksum2_crc32 = checksum2_crc32;
+				checksum_struct checksum;
+				checksum.checksum1_murmur = checksum1_murmur;
+				checksum.checksum2_crc32 = checksum2_crc32;
+				thread->seg_checksums[segment] = checksum;
+				if ( update_checksum(thread, checksum_segment + segment, &checksum) == -1 )
+				{
+					return -1;
+				}
 
 				//
 				// record stats
 				//
 				thread->stats_changed_segments++;
-				thread->stats_written_bytes += seg_bytes;
+				if ( !sparse_segment )
+					thread->stats_written_bytes += seg_bytes;
+				stats_region_changed(checksum_segment + segment);
 				
 				dd_log(LOG_DEBUG, "process buffer source_pos: %llu read_size: %d checksum_ptr: %p", 
-						source_pos, read_size, checksum_ptr - parms.checksum_array);
+						source_pos, read_size, checksum_segment + segment);
 			}
 
 			dd_log(LOG_DEBUG,"checksum_ptr=%p segment=%lu murmur=%08x crc32=%08x",
 				checksum_ptr,buf_offset,checksum1_murmur,checksum2_crc32);
+			dd_stats_end(DD_PHASE_COMPARE, phase_ns, seg_bytes);
 
 			checksum_ptr++;
 		}
@@ -352,94 +573,10 @@ int process_buffer(thread_struct *thread,
 
 			if ( parms.runmode == RUNMODE_SOURCE_DELTA )
 			{
-                        	void   *delta_buf_ptr            = buf_dirty_ptr;
-	                        u_int64_t delta_bytes_write      = active_segment_bytes;
-	                        u_int64_t delta_bytes_written    = 0;
-	                       	u_int64_t compress_bytes_written = 0;
-	                        int delta_ret;
-	                        while(1)
-	                        {
-
-                                // dd_log(LOG_INFO, "Writing segment %lu", segment_write_offset);
-
-                                if ((delta_ret = write(parms.delta_fd, (void *)&write_offset, sizeof(write_offset)))==-1)
-                                {
-                                        dd_log(LOG_ERR,"delta: failed to write segment_write_offset");
-                                        exit(1);
-                                }
-
-				parms.delta_size     += delta_bytes_write;
-	                        fprintf(parms.delta_info_fd, "Writing %llu bytes - completion %5.2f%%\n", 
-                                  (long long unsigned)delta_bytes_write, 100*(float)write_offset /(float)parms.source_size_bytes);
-
-				if (parms.compressedflag > 0) {
-                                       	// dd_log(LOG_INFO,"compress delta: compressing buffer size %d", delta_bytes_write);
-					uLongf bound = compressBound(delta_bytes_write);
-					
-					if ((delta_ret = compress2 ((Bytef *)parms.zipbuffer, &bound, delta_buf_ptr, delta_bytes_write, parms.ziplevel)) != Z_OK) 
-					{
-                                        	dd_log(LOG_ERR,"compress delta: failed to compress buffer - %d", delta_ret);
-                                        	exit(1);
-
-					}
-					dd_log(LOG_INFO, "compressed %ld bytes into %ld - rate %.2f", delta_bytes_write, bound, 100 * (float)bound/(float)delta_bytes_write);
-			
-					parms.delta_zip_size += bound;
-
-					// delta_bytes_written = delta_bytes_write;
-	                        	u_int64_t compress_bytes_write = bound;
-					
-                                	if ((delta_ret = write(parms.delta_fd, (void *)&compress_bytes_write, sizeof(compress_bytes_write)))==-1)
-                                	{
-                                        	dd_log(LOG_ERR,"compress delta: failed to write buffer size (measured in BYTES units)");
-                                        	exit(1);
-                                	}
-                                	if ((compress_bytes_written = write(parms.delta_fd, parms.zipbuffer, compress_bytes_write))==-1)
-                                	{
-                                        	dd_log(LOG_ERR,"compress delta: buffer write failed");
-                                        	exit(1);
-                                	}
-                                	if ( compress_bytes_written-compress_bytes_write == 0 ) {
-                                        	parms.delta_writes++;
-                                        	break;
-                                	}
-                                	else {
-                                        	dd_log(LOG_ERR,"compress delta: encountered a short write on delta");
-                                        	exit(1);
-                                	}
-
-
-
-				}
-				else {
-                                	if ((delta_ret = write(parms.delta_fd, (void *)&delta_bytes_write, sizeof(delta_bytes_write)))==-1)
-                                	{
-                                        	dd_log(LOG_ERR,"delta: failed to write buffer_write_size (measured in SEGMENT_SIZE units)");
-                                        	exit(1);
-                                	}
-
-                                	if ((delta_bytes_written = write(parms.delta_fd, delta_buf_ptr, delta_bytes_write))==-1)
-                                	{
-                                        	dd_log(LOG_ERR,"delta write failed");
-                                        	exit(1);
-                                	}
-
-                                	dd_log(LOG_DEBUG,"seg_i=%d buf_dirty_ptr=%p active_segment_bytes=%d buf_ptr=%p bytes_write:%d bytes_written:%d more_to_write:%d",
-                                        	seg_i, buf_dirty_ptr,active_segment_bytes,delta_buf_ptr,delta_bytes_write,delta_bytes_written,delta_bytes_written-delta_bytes_write);
-
-                                	if ( delta_bytes_written-delta_bytes_write == 0 ) {
-                                        	parms.delta_writes++;
-                                        	break;
-                                	}
-                                	else {
-                                        	dd_log(LOG_ERR,"encountered a short write on delta");
-                                        	exit(1);
-                                	}
-                                }
-
-			    }
-			    active_segment_bytes = 0;
-			    fflush(parms.delta_info_fd);
+				dd_delta_write_record(&parms, write_offset, buf_dirty_ptr, active_segment_bytes,
+					thread->seg_checksums + (((char *)buf_dirty_ptr - (char *)buf) / SEGMENT_SIZE));
+				active_segment_bytes = 0;
+				fflush(parms.delta_info_fd);
 			}
 
 			if ( parms.runmode == RUNMODE_SOURCE_TARGET )
@@ -464,6 +601,7 @@ int process_buffer(thread_struct *thread,
 			void *buf_ptr = buf_dirty_ptr;
 			ssize_t bytes_write = active_segment_bytes;
 			ssize_t bytes_written = 0;
+			phase_ns = dd_stats_begin();
 			while(1)
 			{
 				if ((bytes_written = write(thread->target_fd, buf_ptr, bytes_write))==-1)
@@ -484,6 +622,8 @@ int process_buffer(thread_struct *thread,
 				bytes_write += bytes_written;
 			}
 
+			dd_stats_end(DD_PHASE_WRITE, phase_ns, active_segment_bytes);
+
 			//
 			// reset the state machine
 			//
@@ -520,6 +660,7 @@ void *ddmap_worker_thread(thread_struct *thread)
 {
 	int last_worker = ( thread->worker_id == parms.workers - 1);
 	dd_log(LOG_INFO, "worker_id: %d (%p) last_worker: %d", thread->worker_id, thread, last_worker);
+	dd_stats_thread(thread->worker_id);
 
 	//
 	// given the current worker id, determine a suitable location in ddmap to
@@ -640,6 +781,267 @@ void *ddmap_worker_thread(thread_struct *thread)
 }
 
 
+//-----------------------------------------------------------------------------
+// rolling hash: checksum a segment of the new source on the segment grid
+//-----------------------------------------------------------------------------
+dd_dict_struct rolling_dict;
+
+void rolling_checksum_segment(thread_struct *thread, u_int64_t segment,
+	void *buf, u_int32_t seg_bytes, checksum_struct *grid)
+{
+	checksum_struct checksum;
+
+	if ( dd_zero_check(buf, seg_bytes) )
+	{
+		dd_zero_checksum(seg_bytes, &checksum);
+		thread->stats_zero_segments++;
+	}
+	else
+	{
+		checksum.checksum1_murmur = MurmurHash2(buf, seg_bytes, MURMUR_SEED);
+		checksum.checksum2_crc32 = crc32(crc32(0L, Z_NULL, 0), buf, seg_bytes);
+	}
+	*grid = checksum;
+
+	if ( parms.checksum_file_new || segment >= rolling_dict.old_segments ||
+		rolling_dict.old[segment].checksum1_murmur != checksum.checksum1_murmur ||
+		rolling_dict.old[segment].checksum2_crc32 != checksum.checksum2_crc32 )
+	{
+		if ( update_checksum(thread, segment, &checksum) == -1 )
+		{
+			thread->worker_thread_ccode = -1;
+			pthread_exit(NULL);
+		}
+		thread->stats_changed_segments++;
+		stats_region_changed(segment);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// rolling hash: write out the pending copy record
+//-----------------------------------------------------------------------------
+void rolling_flush_copy(thread_struct *thread, u_int64_t *copy_pos,
+	u_int64_t *copy_from, u_int64_t *copy_len)
+{
+	if ( *copy_len == 0 )
+		return;
+	dd_delta_write_copy(&parms, *copy_pos, *copy_from, *copy_len);
+	thread->stats_copied_bytes += *copy_len;
+	*copy_len = 0;
+}
+
+//-----------------------------------------------------------------------------
+// worker thread (pthread) for rolling hash deltas (single worker)
+//-----------------------------------------------------------------------------
+/*
+ * The source is scanned with a rolling crc32 window of SEGMENT_SIZE bytes.
+ * A window matching a segment of the old checksum file (crc32, then murmur)
+ * becomes a copy record, which ddcommit resolves from the old target. Data
+ * in between is written as regular records. The checksum file remains on
+ * the SEGMENT_SIZE grid of the new source, so a later run without -R still
+ * works.
+ *
+ * The read buffer holds the source from the start of the pending literal
+ * (or the first segment not yet checksummed) up to the end of the window.
+ */
+void *rolling_worker_thread(thread_struct *thread)
+{
+	u_int64_t source_end = parms.source_size_bytes;
+	u_int64_t rbuf_size = 2 * READ_BUFFER_SIZE + 2 * SEGMENT_SIZE;
+	u_int64_t grid_size = rbuf_size / SEGMENT_SIZE + 2;
+	unsigned char *rbuf = NULL;
+	checksum_struct *grid = NULL;
+	u_int64_t base = 0;		// source offset of rbuf[0]
+
+	dd_stats_thread(thread->worker_id);
+	u_int64_t len = 0;		// valid bytes in rbuf
+	u_int64_t hashed = 0;		// segments below are checksummed
+	u_int64_t pos = 0;		// start of the window
+	u_int64_t lit_start = 0;	// start of the pending literal data
+	u_int64_t copy_pos = 0, copy_from = 0, copy_len = 0;
+	u_int32_t crc = 0;
+	int crc_valid = 0;
+	dd_roll_struct roll;
+
+	dd_log(LOG_INFO, "worker_id: %d (%p) rolling hash", thread->worker_id, thread);
+	dd_roll_init(&roll, SEGMENT_SIZE);
+
+	#ifdef SUNOS
+	if ((rbuf = memalign(getpagesize(), rbuf_size)) == NULL )
+	#else
+	if (posix_memalign((void**)&rbuf, getpagesize(), rbuf_size))
+	#endif
+	{
+		dd_log(LOG_ERR, "rolling: unable to allocate %llu byte buffer", rbuf_size);
+		thread->worker_thread_ccode = -1;
+		pthread_exit(NULL);
+	}
+	if ((grid = malloc(grid_size * sizeof(checksum_struct))) == NULL )
+	{
+		dd_log(LOG_ERR, "rolling: unable to allocate segment grid");
+		thread->worker_thread_ccode = -1;
+		pthread_exit(NULL);
+	}
+
+	while (1)
+	{
+		//
+		// refill, keeping the pending literal and unhashed data
+		//
+		if ( pos + SEGMENT_SIZE > base + len && base + len < source_end )
+		{
+			u_int64_t keep = lit_start < hashed ? lit_start : hashed;
+			memmove(rbuf, rbuf + (keep - base), base + len - keep);
+			len = base + len - keep;
+			base = keep;
+
+			u_int64_t want = rbuf_size - len;
+			if ( want > READ_BUFFER_SIZE )
+				want = READ_BUFFER_SIZE;
+			if ( want > source_end - (base + len) )
+				want = source_end - (base + len);
+
+			ssize_t got = pread64(thread->source_fd, rbuf + len, want, base + len);
+			if ( got <= 0 )
+			{
+				dd_log(LOG_ERR, "rolling: unable to read from source device at %llu", base + len);
+				thread->worker_thread_ccode = -1;
+				pthread_exit(NULL);
+			}
+			len += got;
+			thread->stats_read_buffers++;
+
+			while ( hashed < base + len &&
+				(hashed + SEGMENT_SIZE <= base + len || base + len == source_end) )
+			{
+				u_int32_t seg_bytes = SEGMENT_SIZE;
+				if ( hashed + seg_bytes > source_end )
+					seg_bytes = source_end - hashed;
+				rolling_checksum_segment(thread, hashed / SEGMENT_SIZE,
+					rbuf + (hashed - base), seg_bytes,
+					&grid[(hashed / SEGMENT_SIZE) % grid_size]);
+				hashed += seg_bytes;
+			}
+			continue;
+		}
+
+		//
+		// less than a window left, the rest is literal data
+		//
+		if ( pos + SEGMENT_SIZE > base + len )
+			break;
+
+		unsigned char *window = rbuf + (pos - base);
+		if ( !crc_valid )
+		{
+			crc = crc32(crc32(0L, Z_NULL, 0), window, SEGMENT_SIZE);
+			crc_valid = 1;
+		}
+
+		//
+		// unchanged in place (on the grid and same as the old segment), else
+		// look for the content anywhere in the old source
+		//
+		int64_t match = -1;
+		if ( pos % SEGMENT_SIZE == 0 && pos / SEGMENT_SIZE < rolling_dict.old_segments &&
+			!parms.checksum_file_new )
+		{
+			checksum_struct *new = &grid[(pos / SEGMENT_SIZE) % grid_size];
+			checksum_struct *old = &rolling_dict.old[pos / SEGMENT_SIZE];
+			if ( new->checksum1_murmur == old->checksum1_murmur &&
+				new->checksum2_crc32 == old->checksum2_crc32 )
+				match = pos / SEGMENT_SIZE;
+		}
+		if ( match < 0 && dd_dict_filter(&rolling_dict, crc) )
+			match = dd_dict_lookup(&rolling_dict, crc, window, SEGMENT_SIZE);
+
+		if ( match >= 0 )
+		{
+			u_int64_t match_pos = match * SEGMENT_SIZE;
+
+			//
+			// literal data up to here, then the copy (extending the
+			// pending copy when both sides continue it)
+			//
+			if ( lit_start < pos )
+			{
+				rolling_flush_copy(thread, &copy_pos, &copy_from, &copy_len);
+				dd_delta_write_record(&parms, lit_start, rbuf + (lit_start - base), pos - lit_start, NULL);
+				thread->stats_written_bytes += pos - lit_start;
+			}
+			if ( copy_len && copy_pos + copy_len == pos &&
+				copy_from + copy_len == match_pos &&
+				copy_len + SEGMENT_SIZE <= READ_BUFFER_SIZE )
+			{
+				copy_len += SEGMENT_SIZE;
+			}
+			else
+			{
+				rolling_flush_copy(thread, &copy_pos, &copy_from, &copy_len);
+				if ( match_pos != pos )
+				{
+					copy_pos = pos;
+					copy_from = match_pos;
+					copy_len = SEGMENT_SIZE;
+				}
+			}
+			pos += SEGMENT_SIZE;
+			lit_start = pos;
+			crc_valid = 0;
+			continue;
+		}
+
+		//
+		// zero windows are not in the dictionary, skip ahead to the grid
+		//
+		if ( crc == ZERO_CHECKSUM2_CRC32 && dd_zero_check(window, SEGMENT_SIZE) )
+		{
+			pos = (pos / SEGMENT_SIZE + 1) * SEGMENT_SIZE;
+			crc_valid = 0;
+		}
+		else
+		{
+			if ( pos + SEGMENT_SIZE < base + len )
+				crc = dd_roll(&roll, crc, window[0], window[SEGMENT_SIZE]);
+			else
+				crc_valid = 0;
+			pos++;
+		}
+
+		//
+		// records stay within READ_BUFFER_SIZE (the apply buffer size)
+		//
+		if ( pos - lit_start >= READ_BUFFER_SIZE )
+		{
+			rolling_flush_copy(thread, &copy_pos, &copy_from, &copy_len);
+			dd_delta_write_record(&parms, lit_start, rbuf + (lit_start - base), READ_BUFFER_SIZE, NULL);
+			thread->stats_written_bytes += READ_BUFFER_SIZE;
+			lit_start += READ_BUFFER_SIZE;
+			fflush(parms.delta_info_fd);
+		}
+	}
+
+	//
+	// trailing literal data
+	//
+	rolling_flush_copy(thread, &copy_pos, &copy_from, &copy_len);
+	while ( lit_start < source_end )
+	{
+		u_int64_t bytes = source_end - lit_start;
+		if ( bytes > READ_BUFFER_SIZE )
+			bytes = READ_BUFFER_SIZE;
+		dd_delta_write_record(&parms, lit_start, rbuf + (lit_start - base), bytes, NULL);
+		thread->stats_written_bytes += bytes;
+		lit_start += bytes;
+	}
+	fflush(parms.delta_info_fd);
+
+	free(grid);
+	free(rbuf);
+	pthread_exit(NULL);
+}
+
+
 //-----------------------------------------------------------------------------
 // worker thread (pthread) for ddless (reads all and writes changed segments)
 //-----------------------------------------------------------------------------
@@ -647,15 +1049,13 @@ void *ddless_worker_thread(thread_struct *thread)
 {
 	int last_worker = ( thread->worker_id == parms.workers - 1);
 	dd_log(LOG_INFO, "worker_id: %d (%p) last_worker: %d", thread->worker_id, thread, last_worker);
+	dd_stats_thread(thread->worker_id);
 
 	//
 	// ddzone mode/read throttle
 	//
 	#define DDZONE_DATA_COLUMS 2
-	struct timeval buffer_time_start;
-	struct timeval buffer_time_end;
-	long elapsed_seconds;
-	long elapsed_useconds;
+	u_int64_t buffer_time_start;
 	long elapsed_mtime;
 	char *zone_tabs = NULL;
 	double read_mb_sec;
@@ -712,7 +1112,7 @@ void *ddless_worker_thread(thread_struct *thread)
 	int is_done = 0;
 	int buffer_read_bytes = 0;
 	u_int64_t pos = pos_start;
-	gettimeofday(&buffer_time_start,NULL);
+	buffer_time_start = dd_stats_now();
 	u_int64_t monitor_count = 0;
 	while(!is_done)
 	{
@@ -765,16 +1165,15 @@ void *ddless_worker_thread(thread_struct *thread)
 		//
 		// ddzone statistics/reader throttle
 		//
-		// The gettimeofday for the next round is done before the sleep under max_read_mb_sec
+		// The clock for the next round is read before the sleep under max_read_mb_sec
 		// because the sleep below must be also accounted for. This code assumes that each
 		// worker would get the same performance from the underlying device.
 		//
-		gettimeofday(&buffer_time_end,NULL);
+		u_int64_t buffer_time_end = dd_stats_now();
 
-		elapsed_seconds  = buffer_time_end.tv_sec  - buffer_time_start.tv_sec;
-		elapsed_useconds = buffer_time_end.tv_usec - buffer_time_start.tv_usec;
-		elapsed_mtime = ((elapsed_seconds) * 1000 + elapsed_useconds/1000.0) + 0.5;
-		read_mb_sec = (double)((READ_BUFFER_SIZE)/MEGABYTE_FACTOR) / ((double)elapsed_mtime/1000);
+		elapsed_mtime = (buffer_time_end - buffer_time_start + 500000) / 1000000;
+		read_mb_sec = (double)((READ_BUFFER_SIZE)/MEGABYTE_FACTOR) /
+			((double)(buffer_time_end - buffer_time_start + 1) / 1e9);
 
 		if ( parms.runmode == RUNMODE_DDZONE )
 		{
@@ -786,7 +1185,7 @@ void *ddless_worker_thread(thread_struct *thread)
 			fflush(stdout);
 		}
 
-		gettimeofday(&buffer_time_start,NULL);
+		buffer_time_start = buffer_time_end;
 		
 		if ( parms.max_read_mb_sec_per_worker > 0 )
 		{
@@ -800,7 +1199,9 @@ void *ddless_worker_thread(thread_struct *thread)
 			}
 			if ( sleep_factor_usec > 0 )
 			{
+				u_int64_t sleep_ns = dd_stats_begin();
 				usleep(sleep_factor_usec);
+				dd_stats_end(DD_PHASE_SLEEP, sleep_ns, 0);
 			}
 			dd_log(LOG_DEBUG,"%u MB %s %ld ms %0.2f MB/s %d usec",
 				READ_BUFFER_SIZE / MEGABYTE_FACTOR,
@@ -962,6 +1363,8 @@ int ddless(int runmode)
 		}
 		if ( dd_file_exists(parms.checksum_file) )
 		{
+			if ( dd_checksum_is_compact(parms.checksum_file) )
+				parms.checksum_compact = 1;
 			dd_log(LOG_INFO,"removing existing checksum file: %s",parms.checksum_file);
 			if ( unlink(parms.checksum_file) == -1 )
 			{
@@ -969,6 +1372,18 @@ int ddless(int runmode)
 				return -1;
 			}
 		}
+
+		//
+		// a journal of the old checksum file no longer applies
+		//
+		char journal_file[JOURNAL_NAME_LENGTH];
+		if ( dd_journal_name(journal_file, parms.checksum_file) == -1 )
+			return -1;
+		if ( dd_file_exists(journal_file) )
+		{
+			dd_log(LOG_INFO,"removing existing journal: %s",journal_file);
+			unlink(journal_file);
+		}
 	}
 
 	//
@@ -993,9 +1408,29 @@ int ddless(int runmode)
 			parms.mmap_size = sizeof(checksum_struct) * parms.source_segments;
 			dd_log(LOG_INFO, "checksum file size: %llu bytes", parms.mmap_size);
 
+			//
+			// finish or drop the checksum journal of a previous run first
+			//
+			if ( runmode != RUNMODE_CHECKSUM_ONLY &&
+				dd_journal_recover(parms.checksum_file) == -1 )
+			{
+				return -1;
+			}
+
+			//
+			// a compact checksum file stays compact
+			//
+			if ( dd_file_exists(parms.checksum_file) &&
+				dd_checksum_is_compact(parms.checksum_file) )
+			{
+				parms.checksum_compact = 1;
+			}
+
 			parms.checksum_file_new = 0;
 			if ( !dd_file_exists(parms.checksum_file) ||
-				dd_file_size(parms.checksum_file) != parms.mmap_size)
+				( parms.checksum_compact ?
+				dd_checksum_segments(parms.checksum_file) != parms.source_segments :
+				dd_file_size(parms.checksum_file) != parms.mmap_size ) )
 			{
 				if ( runmode == RUNMODE_NEW_CHECKSUM )
 				{
@@ -1020,6 +1455,48 @@ int ddless(int runmode)
 				return 0;
 			}
 
+			//
+			// rolling hash mode keeps the old checksums as its dictionary,
+			// load them before the checksum file is resized
+			//
+			if ( parms.rollingflag && dd_file_exists(parms.checksum_file) )
+			{
+				if ( dd_dict_load(&rolling_dict, parms.checksum_file) == -1 )
+				{
+					return -1;
+				}
+			}
+
+			//
+			// compact checksum file, expand it into memory and bring the
+			// file to the source size (what ftruncate does for raw files)
+			//
+			if ( parms.checksum_compact )
+			{
+				u_int64_t segments = 0;
+				parms.mmap_fd = -1;
+				parms.checksum_array = NULL;
+				if ( dd_file_exists(parms.checksum_file) &&
+					(parms.checksum_array = dd_checksum_load(parms.checksum_file, &segments)) == NULL )
+				{
+					return -1;
+				}
+				if ((parms.checksum_array = dd_checksum_resize(parms.checksum_array,
+					segments, parms.source_segments)) == NULL )
+				{
+					return -1;
+				}
+				if ( segments != parms.source_segments &&
+					dd_checksum_save(parms.checksum_file, parms.checksum_array,
+					parms.source_segments, 1) == -1 )
+				{
+					return -1;
+				}
+				dd_log(LOG_INFO,"compact checksum file expanded to %llu segments",
+					parms.source_segments);
+			}
+			else
+			{
 			if ((parms.mmap_fd = open(parms.checksum_file, O_CREAT|O_RDWR|O_LARGEFILE,
 					(mode_t)0600)) == -1 )
 			{
@@ -1037,18 +1514,61 @@ int ddless(int runmode)
 					parms.checksum_file,parms.mmap_size);
 				return -1;
 			}
+			}
 
 			//
-			// mmap checksum file
+			// copying to a target or delta stages checksum updates in the
+			// journal, they are committed once the data is durable
+			//
+			if ( runmode == RUNMODE_SOURCE_TARGET || runmode == RUNMODE_SOURCE_DELTA )
+			{
+				if ( ( parms.journal = malloc(sizeof(struct dd_journal))) == NULL )
+				{
+					dd_log(LOG_ERR, "unable to allocate memory for journal");
+					return -1;
+				}
+				if ( dd_journal_open(parms.journal, parms.checksum_file, parms.source_segments) == -1 )
+				{
+					return -1;
+				}
+			}
+
+			//
+			// windowed mode, each worker reads/writes its own slice (a
+			// compact file is in memory already)
+			//
+			if ( parms.checksum_compact )
+			{
+				if ( parms.checksum_window_mb > 0 )
+					dd_log(LOG_INFO,"compact checksum file is kept in memory, ignoring -M");
+			}
+			else if ( parms.checksum_window_mb > 0 )
+			{
+				parms.checksum_windowed = 1;
+				parms.checksum_window_entries = parms.checksum_window_mb * MEGABYTE_FACTOR /
+					parms.workers / sizeof(checksum_struct);
+				if ( parms.checksum_window_entries < BUFFER_SEGMENTS )
+					parms.checksum_window_entries = BUFFER_SEGMENTS;
+				dd_log(LOG_INFO,"checksum window: %llu entries per worker",
+					parms.checksum_window_entries);
+				parms.checksum_array = NULL;
+			}
+			else
+			{
+
+			//
+			// mmap checksum file (read only when journaled)
 			//
 			parms.checksum_array = (void *)mmap64(
-				0, parms.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, parms.mmap_fd, 0);
+				0, parms.mmap_size, parms.journal ? PROT_READ : PROT_READ | PROT_WRITE,
+				MAP_SHARED, parms.mmap_fd, 0);
 			if ( parms.checksum_array == MAP_FAILED )
 			{
 				dd_log(LOG_ERR, "unable to mmap");
 				return -1;
 			}
 			dd_log(LOG_INFO,"checksum array ptr: %p", parms.checksum_array);
+			}
 		}
 	/* sample mmap write code (check for errors)
 		u_int64_t i;
@@ -1094,9 +1614,25 @@ int ddless(int runmode)
         		dheader.conf_opts += set_dd_flag(DDFLAG_COMPRESSED);
                 	dd_log(LOG_INFO,"dheader.conf_opts '%d'", dheader.conf_opts);
 		}
+		if (parms.rollingflag > 0)
+		{
+			dheader.conf_opts += set_dd_flag(DDFLAG_ROLLING);
+			dd_log(LOG_INFO,"dheader.conf_opts '%d'", dheader.conf_opts);
+		}
+		if (parms.checksumsflag > 0)
+		{
+			dheader.conf_opts += set_dd_flag(DDFLAG_CHECKSUMS);
+			dd_log(LOG_INFO,"dheader.conf_opts '%d'", dheader.conf_opts);
+		}
+		if (parms.recordcrcflag > 0)
+		{
+			dheader.conf_opts += set_dd_flag(DDFLAG_RECORDCRC);
+			dd_log(LOG_INFO,"dheader.conf_opts '%d'", dheader.conf_opts);
+		}
 
 		parms.delta_size = 0;
 		parms.delta_zip_size = 0;
+		parms.delta_copy_size = 0;
 
 		if ((write(parms.delta_fd, (void *)&dheader, sizeof(delta_header)))==-1)
         	{
@@ -1163,9 +1699,11 @@ int ddless(int runmode)
 
 			//
 			// since the target file did not exist, we must work from now on as
-			// if the checksum was new (i.e. all data gets written)
+			// if the checksum was new (i.e. all data gets written), except
+			// for zero extents, the new file is sparse
 			//
 			parms.checksum_file_new = 1;
+			parms.target_sparse = 1;
 		}
 
 		//
@@ -1230,8 +1768,25 @@ int ddless(int runmode)
 	//
 	// launch worker threads...
 	//
+	if ( ( runmode == RUNMODE_SOURCE_TARGET || runmode == RUNMODE_SOURCE_DELTA ) &&
+		( parms.checksum_array != NULL || parms.checksum_windowed ) )
+	{
+		parms.stats_region_count =
+			(parms.source_segments + STATS_REGION_SEGMENTS - 1) / STATS_REGION_SEGMENTS;
+		if ( (parms.stats_regions = calloc(parms.stats_region_count, sizeof(u_int32_t))) == NULL )
+		{
+			dd_log(LOG_ERR, "unable to allocate %llu stats regions", parms.stats_region_count);
+			return -1;
+		}
+	}
+
 	dd_log(LOG_INFO,"launching worker threads...");
 	time(&parms.start_time);
+	parms.start_ns = dd_stats_now();
+	if ( dd_stats_init("ddplus", parms.stats_prefix, parms.workers) == -1 )
+	{
+		return -1;
+	}
 	for(worker=0; worker < parms.workers; worker++)
 	{
 		thread = &threads[worker];
@@ -1247,7 +1802,19 @@ int ddless(int runmode)
 			return -1;
 		}
 
-		if ( *parms.ddmap_dev )
+		if ( parms.rollingflag )
+		{
+			//
+			// rolling hash delta
+			//
+			if ( pthread_create(&thread->worker_thread, &thread->thread_attributes, 
+				(void *) rolling_worker_thread, (void *)thread) != 0 )
+			{
+				dd_log(LOG_ERR,"pthread_create rolling failed");
+				return -1;
+			}
+		}
+		else if ( *parms.ddmap_dev )
 		{
 			//
 			// ddmap
@@ -1298,7 +1865,7 @@ int ddless(int runmode)
 			return -1;
 		}
 	}
-	time(&parms.end_time);
+	parms.end_ns = dd_stats_now();
 
 	//
 	// close source
@@ -1319,13 +1886,48 @@ int ddless(int runmode)
 		free(parms.ddmap_data);
 	}
 
+	if ( parms.rollingflag )
+	{
+		dd_dict_free(&rolling_dict);
+	}
+
 	//
 	// close memory mapped checksum file (must update the file date/time
 	// stamp since mmap does not (http://lkml.org/lkml/2007/2/20/255) and
 	// backup programs would then miss the checksum file - shit!)
 	//
-	munmap((void*)parms.checksum_array, parms.mmap_size);
-	close(parms.mmap_fd);
+	if ( parms.checksum_windowed )
+	{
+		for(worker=0; worker < parms.workers; worker++)
+		{
+			if ( checksum_window_flush(&threads[worker]) == -1 )
+			{
+				return -1;
+			}
+			free(threads[worker].window);
+		}
+	}
+	else if ( parms.checksum_compact )
+	{
+		//
+		// journaled updates are replayed into the file once sealed
+		//
+		if ( parms.journal == NULL &&
+			dd_checksum_save(parms.checksum_file, parms.checksum_array,
+			parms.source_segments, 1) == -1 )
+		{
+			return -1;
+		}
+		free(parms.checksum_array);
+	}
+	else
+	{
+		munmap((void*)parms.checksum_array, parms.mmap_size);
+	}
+	if ( !parms.checksum_compact )
+	{
+		close(parms.mmap_fd);
+	}
 	utime(parms.checksum_file,NULL);
 
 	//
@@ -1333,6 +1935,16 @@ int ddless(int runmode)
 	//
 	if ( runmode == RUNMODE_SOURCE_TARGET || runmode == RUNMODE_SOURCE_DELTA )
 	{
+		//
+		// the target must be durable before its checksums are committed
+		//
+		if ( runmode == RUNMODE_SOURCE_TARGET && parms.journal != NULL &&
+			fsync(threads[0].target_fd) )
+		{
+			dd_log(LOG_ERR, "unable to sync target device %s", parms.target_dev);
+			return -1;
+		}
+
 		for(worker=0; worker < parms.workers; worker++)
 		{
 			thread = &threads[worker];
@@ -1353,23 +1965,53 @@ int ddless(int runmode)
                 		exit(1);
         		}
 
+			if ( fsync(parms.delta_fd) )
+			{
+				dd_log(LOG_ERR,"delta: unable to sync %s", parms.delta_file);
+				return -1;
+			}
 			close(parms.delta_fd);
 			fclose(parms.delta_info_fd);
 			unlink(parms.delta_info_file);
         	}
 	}
 
+	//
+	// now that the data is durable, seal the journal (commit the checksums
+	// or keep them pending until the delta has been acknowledged)
+	//
+	if ( parms.journal != NULL )
+	{
+		for(worker=0; worker < parms.workers; worker++)
+		{
+			if ( dd_journal_flush(parms.journal, &threads[worker]) == -1 )
+			{
+				return -1;
+			}
+			free(threads[worker].journal_entries);
+		}
+		if ( dd_journal_seal(parms.journal,
+			parms.journal_pending ? JOURNAL_PENDING : JOURNAL_COMMITTED) == -1 )
+		{
+			return -1;
+		}
+		free(parms.journal);
+		parms.journal = NULL;
+	}
+
 	//
 	// performance summary
 	//
 	u_int64_t read_buffers = 0;
 	u_int64_t changed_segments = 0;
+	u_int64_t zero_segments = 0;
 	u_int64_t written_bytes = 0;
 	for(worker=0; worker < parms.workers; worker++)
 	{
 		thread = &threads[worker];
 		read_buffers += thread->stats_read_buffers;
 		changed_segments += thread->stats_changed_segments;
+		zero_segments += thread->stats_zero_segments;
 		written_bytes += thread->stats_written_bytes;
 	}
 	
@@ -1381,6 +2023,10 @@ int ddless(int runmode)
 		changed_segments,
 		segment_change_percentage,
 		parms.source_segments);
+	dd_log(LOG_INFO,"found zero segments %llu (%0.2f%%) of %llu segments",
+		zero_segments,
+		100*((double)zero_segments/(double)parms.source_segments),
+		parms.source_segments);
 
 	if ( runmode == RUNMODE_SOURCE_TARGET )
 	{
@@ -1392,20 +2038,31 @@ int ddless(int runmode)
 	{
 		dd_log(LOG_INFO,"wrote %llu bytes (%0.2f GB) to delta",
 			written_bytes, (double)(written_bytes) / GIGABYTE_FACTOR);
+		if ( parms.rollingflag )
+		{
+			u_int64_t copied_bytes = 0;
+			for(worker=0; worker < parms.workers; worker++)
+				copied_bytes += threads[worker].stats_copied_bytes;
+			dd_log(LOG_INFO,"copy records cover %llu bytes (%0.2f GB) of the old target",
+				copied_bytes, (double)(copied_bytes) / GIGABYTE_FACTOR);
+		}
 	}
 
-	double elapsed_sec = difftime(parms.end_time,parms.start_time);
+	u_int64_t elapsed_ns = parms.end_ns - parms.start_ns;
+	double elapsed_sec = (double)elapsed_ns / 1e9;
 	
-	dd_log(LOG_INFO,"processing time: %0.2f seconds (%0.2f minutes)", 
+	dd_log(LOG_INFO,"processing time: %0.3f seconds (%0.2f minutes)", 
 		elapsed_sec, elapsed_sec/60);
-	double processing_perf = (double)(parms.source_size_bytes/1024/1024)/elapsed_sec;
+	double processing_perf = elapsed_ns ?
+		((double)parms.source_size_bytes / MEGABYTE_FACTOR) / elapsed_sec : 0;
 
 	dd_log(LOG_INFO,"processing performance: %0.2f MB/s",processing_perf);
 
 	//
 	// output statistics file
 	//
-	if ( ( runmode == RUNMODE_SOURCE_TARGET || runmode == RUNMODE_SOURCE_DELTA ) && parms.checksum_array != NULL )
+	if ( ( runmode == RUNMODE_SOURCE_TARGET || runmode == RUNMODE_SOURCE_DELTA ) &&
+		( parms.checksum_array != NULL || parms.checksum_windowed ) )
 	{
 		snprintf(parms.stats_file, DEV_NAME_LENGTH, "%s.stats",parms.checksum_file);
 		dd_log(LOG_INFO,"preparing stats file %s", parms.stats_file);
@@ -1414,20 +2071,16 @@ int ddless(int runmode)
 			dd_log(LOG_ERR, "unable to open stats file: %s",parms.stats_file);
 			exit(1);
 		}
-		char tmp[512];
-		struct tm *begin;
-		begin = localtime(&parms.start_time);
-		snprintf(tmp,512, "%04d-%02d-%02d %02d:%02d:%02d %0.5f segment_change_ratio "
-			"%llu bytes_written %0.2f seconds %0.2f MB/s\n",
-			1900+begin->tm_year,begin->tm_mon+1,begin->tm_mday,
-			begin->tm_hour,begin->tm_min,begin->tm_sec,
-			segment_change_percentage/100,
-			(long long unsigned)written_bytes,
-			elapsed_sec,
-			processing_perf);
-		write(parms.stats_fd,tmp,strlen(tmp));
+		if ( stats_record(runmode, changed_segments, zero_segments, written_bytes,
+			elapsed_ns, processing_perf) == -1 )
+		{
+			dd_log(LOG_ERR, "unable to write stats file: %s",parms.stats_file);
+			exit(1);
+		}
 		close(parms.stats_fd);
 	}
+	free(parms.stats_regions);
+	parms.stats_regions = NULL;
 	
 	//
 	// dump to stderr dd like stats (can only report blocks read, the
@@ -1436,6 +2089,265 @@ int ddless(int runmode)
 	fprintf(stderr,"%llu MB processed\n", 
 		(long long unsigned)parms.source_size_bytes / MEGABYTE_FACTOR);
 
+	dd_stats_finish();
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// estimate: read a random sample of segments and compare them with the
+// checksum file (left as is) to predict the size of the next delta.
+//
+// The device is cut into strata of equal size, each stratum into as many
+// equal slices as it gets samples and one random segment is read per
+// slice. Per stratum the mean and variance of the changed bytes and of
+// their compressed size give the totals and a 95% confidence interval.
+//-----------------------------------------------------------------------------
+#define ESTIMATE_STRATA_MAX	256
+#define ESTIMATE_Z95		1.96
+
+typedef struct
+{
+	u_int64_t	first;		// segment range of the stratum
+	u_int64_t	segments;
+	u_int64_t	samples;
+	u_int64_t	changed;
+	double		sum_z;		// compressed bytes of changed samples
+	double		sumsq_z;
+} estimate_stratum;
+
+typedef struct
+{
+	int		source_fd;
+	u_int64_t	source_segments;
+	u_int64_t	source_size;
+	u_int64_t	checksum_segments;
+	estimate_stratum *strata;
+	int		nstrata;
+	u_int32_t	seed;
+	int		failed;
+} estimate_state;
+
+estimate_state estimates;
+
+//-----------------------------------------------------------------------------
+static inline u_int32_t estimate_random(u_int32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+//-----------------------------------------------------------------------------
+// sample the strata worker_id, worker_id + workers, ...
+//-----------------------------------------------------------------------------
+void *estimate_worker_thread(thread_struct *thread)
+{
+	uLongf bound = compressBound(SEGMENT_SIZE);
+	char *zbuf;
+	void *buf;
+	int h;
+
+	if ( posix_memalign(&buf, 4096, SEGMENT_SIZE) || (zbuf = malloc(bound)) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate estimate buffers");
+		estimates.failed = 1;
+		return NULL;
+	}
+
+	for (h = thread->worker_id; h < estimates.nstrata && !estimates.failed; h += parms.workers)
+	{
+		estimate_stratum *s = &estimates.strata[h];
+		u_int32_t state = estimates.seed ^ (h * 0x9e3779b9U) ^ 0x5bd1e995U;
+		u_int64_t i;
+
+		for (i = 0; i < s->samples; i++)
+		{
+			//
+			// one random segment out of the i-th slice of the stratum
+			//
+			u_int64_t lo = s->first + s->segments * i / s->samples;
+			u_int64_t hi = s->first + s->segments * (i + 1) / s->samples;
+			u_int64_t segment = lo + estimate_random(&state) % (hi - lo);
+			u_int64_t pos = segment * SEGMENT_SIZE;
+			u_int32_t seg_bytes = SEGMENT_SIZE;
+			checksum_struct checksum;
+			ssize_t read_bytes;
+
+			if ( pos + seg_bytes > estimates.source_size )
+				seg_bytes = estimates.source_size - pos;
+			if ( (read_bytes = pread64(estimates.source_fd, buf, SEGMENT_SIZE, pos)) < seg_bytes )
+			{
+				dd_log(LOG_ERR, "unable to read segment %llu from source device", segment);
+				estimates.failed = 1;
+				break;
+			}
+			thread->stats_read_buffers++;
+
+			if ( dd_zero_check(buf, seg_bytes) )
+				dd_zero_checksum(seg_bytes, &checksum);
+			else
+			{
+				checksum.checksum1_murmur = MurmurHash2(buf, seg_bytes, MURMUR_SEED);
+				checksum.checksum2_crc32 = crc32(crc32(0L, Z_NULL, 0), buf, seg_bytes);
+			}
+
+			if ( segment < estimates.checksum_segments &&
+				parms.checksum_array[segment].checksum1_murmur == checksum.checksum1_murmur &&
+				parms.checksum_array[segment].checksum2_crc32 == checksum.checksum2_crc32 )
+				continue;
+
+			uLongf zbytes = bound;
+			if ( compress2((Bytef *)zbuf, &zbytes, buf, seg_bytes, parms.ziplevel) != Z_OK )
+				zbytes = seg_bytes;
+			s->changed++;
+			s->sum_z += zbytes;
+			s->sumsq_z += (double)zbytes * zbytes;
+		}
+	}
+	free(zbuf);
+	free(buf);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// population total and its variance from per stratum sums, with the
+// finite population correction
+//-----------------------------------------------------------------------------
+static void estimate_total(int compressed, double *total, double *variance)
+{
+	int h;
+
+	*total = 0;
+	*variance = 0;
+	for (h = 0; h < estimates.nstrata; h++)
+	{
+		estimate_stratum *s = &estimates.strata[h];
+		double n = s->samples, N = s->segments;
+		double sum = compressed ? s->sum_z : (double)s->changed * SEGMENT_SIZE;
+		double sumsq = compressed ? s->sumsq_z : (double)s->changed * SEGMENT_SIZE * SEGMENT_SIZE;
+		double mean, var;
+
+		if ( n == 0 )
+			continue;
+		mean = sum / n;
+		var = n > 1 ? (sumsq - n * mean * mean) / (n - 1) : 0;
+		*total += N * mean;
+		*variance += N * N * (1 - n / N) * var / n;
+	}
+}
+
+//-----------------------------------------------------------------------------
+int ddestimate(u_int64_t samples)
+{
+	struct timeval start, end;
+	u_int64_t per_stratum, sampled = 0, changed = 0, read_segments = 0;
+	double bytes, bytes_var, zbytes, zbytes_var, elapsed;
+	off64_t size;
+	int h, worker;
+
+	parms.runmode = RUNMODE_ESTIMATE;
+	gettimeofday(&start, NULL);
+
+	if ( (estimates.source_fd = dd_dev_open_ro(parms.source_dev, parms.o_direct)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to open source device: %s", parms.source_dev);
+		return -1;
+	}
+	if ( (size = dd_device_size(estimates.source_fd)) == -1 )
+	{
+		dd_log(LOG_ERR, "unable to determine source device %s size", parms.source_dev);
+		return -1;
+	}
+	estimates.source_size = size;
+	estimates.source_segments = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+
+	//
+	// the checksum file is only read, segments past its end are changed
+	//
+	if ( !dd_file_exists(parms.checksum_file) ||
+		(parms.checksum_array = dd_checksum_load(parms.checksum_file, &estimates.checksum_segments)) == NULL )
+	{
+		dd_log(LOG_ERR, "estimate requires an existing checksum file: %s", parms.checksum_file);
+		return -1;
+	}
+
+	if ( samples > estimates.source_segments )
+		samples = estimates.source_segments;
+	estimates.nstrata = samples / 32;
+	if ( estimates.nstrata > ESTIMATE_STRATA_MAX )
+		estimates.nstrata = ESTIMATE_STRATA_MAX;
+	if ( estimates.nstrata < 1 )
+		estimates.nstrata = 1;
+	if ( (estimates.strata = calloc(estimates.nstrata, sizeof(estimate_stratum))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate %d strata", estimates.nstrata);
+		return -1;
+	}
+	per_stratum = samples / estimates.nstrata;
+	for (h = 0; h < estimates.nstrata; h++)
+	{
+		estimate_stratum *s = &estimates.strata[h];
+
+		s->first = estimates.source_segments * h / estimates.nstrata;
+		s->segments = estimates.source_segments * (h + 1) / estimates.nstrata - s->first;
+		s->samples = per_stratum + ( h < samples % estimates.nstrata );
+		if ( s->samples > s->segments )
+			s->samples = s->segments;
+	}
+	estimates.seed = time(NULL) ^ getpid();
+	if ( estimates.seed == 0 )
+		estimates.seed = 1;
+	dd_log(LOG_INFO, "estimate: %llu samples in %d strata, seed %u", samples, estimates.nstrata, estimates.seed);
+
+	if ( (threads = calloc(parms.workers, sizeof(thread_struct))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate worker space");
+		return -1;
+	}
+	for (worker = 0; worker < parms.workers; worker++)
+	{
+		threads[worker].worker_id = worker;
+		if ( pthread_create(&threads[worker].worker_thread, NULL,
+			(void *) estimate_worker_thread, (void *)&threads[worker]) != 0 )
+		{
+			dd_log(LOG_ERR, "pthread_create estimate failed");
+			return -1;
+		}
+	}
+	for (worker = 0; worker < parms.workers; worker++)
+	{
+		pthread_join(threads[worker].worker_thread, NULL);
+		read_segments += threads[worker].stats_read_buffers;
+	}
+	if ( estimates.failed )
+		return -1;
+	gettimeofday(&end, NULL);
+
+	for (h = 0; h < estimates.nstrata; h++)
+	{
+		sampled += estimates.strata[h].samples;
+		changed += estimates.strata[h].changed;
+	}
+	estimate_total(0, &bytes, &bytes_var);
+	estimate_total(1, &zbytes, &zbytes_var);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	fprintf(stdout, "Source segments:    %llu\n", (long long unsigned)estimates.source_segments);
+	fprintf(stdout, "Sampled segments:   %llu (%0.3f%%) in %d strata\n", (long long unsigned)sampled,
+		100 * (double)sampled / estimates.source_segments, estimates.nstrata);
+	fprintf(stdout, "Changed samples:    %llu\n", (long long unsigned)changed);
+	fprintf(stdout, "Changed bytes:      %0.0f +/- %0.0f (%0.2f MB)\n", bytes,
+		ESTIMATE_Z95 * sqrt(bytes_var), bytes / MEGABYTE_FACTOR);
+	fprintf(stdout, "Compressed bytes:   %0.0f +/- %0.0f (%0.2f MB, level %d)\n", zbytes,
+		ESTIMATE_Z95 * sqrt(zbytes_var), zbytes / MEGABYTE_FACTOR, parms.ziplevel);
+	fprintf(stdout, "Elapsed:            %0.2f seconds\n", elapsed);
+
+	free(threads);
+	free(estimates.strata);
+	free(parms.checksum_array);
+	parms.checksum_array = NULL;
+	close(estimates.source_fd);
 	return 0;
 }
 
@@ -1462,7 +2374,7 @@ void usage()
 "copies are faster because we assume that not all of the source blocks change.\n"
 "\n"
 "	ddless	[-d] -s <source> [-m ddmap ][-r <read_rate_mb_s>] -c <checksum>\n"
-"		[-b] -t <target> [-w #] [-v]\n"
+"		[-M <checksum_mb>] [-C] [-b] -t <target> [-w #] [-T <prefix>] [-v]\n"
 "\n"
 "Produce a checksum file using the specified device. Hint: the device could be\n"
 "source or target. Use the target and a new checksum file, then compare it to\n"
@@ -1470,10 +2382,30 @@ void usage()
 "\n"
 "	ddless	[-d] -s <source> -c <checksum> [-v]\n"
 "\n"
+"Produce a delta file of the changed segments to be applied by ddcommit.\n"
+"\n"
+"	ddless	[-d] -s <source> -c <checksum> -x <delta> [-z] [-l #] [-R] [-E] [-I]\n"
+"		[-T <prefix>] [-v]\n"
+"\n"
+"Estimate the size of the next delta from a random sample of segments, the\n"
+"checksum file is not updated.\n"
+"\n"
+"	ddless	[-d] -s <source> -c <checksum> -e <samples> [-l #] [-w #] [-v]\n"
+"\n"
 "Determine disk read speed zones, outputs data to stdout.\n"
 "\n"
 "	ddless	[-d] -s <source> [-v]\n"
 "\n"
+"Profile the source: sweep buffered/direct reads, sequential/random access,\n"
+"block sizes and queue depths, write a per zone heatmap (CSV or .json).\n"
+"\n"
+"	ddless	[-d|-D] -s <source> -Z <heatmap> [-q #,...] [-B KB,...] [-P seq,rand]\n"
+"		[-N #] [-S #] [-v]\n"
+"\n"
+"Acknowledge (commit) or abort the checksum updates of a delta created with -k.\n"
+"\n"
+"	ddless	-c <checksum> -A <commit|abort> [-v]\n"
+"\n"
 "Outputs the built in parameters\n"
 "\n"
 "	ddless	-p\n"
@@ -1493,6 +2425,35 @@ void usage()
 "	-v	verbose\n"
 "	-z	zip the delta file\n"
 "	-l	zip level 1 - 9\n"
+"	-M	checksum memory limit in megabytes, workers read and write\n"
+"		their slice of the checksum file instead of mmap'ing it all\n"
+"	-C	store a new checksum file in the compact format (zero and\n"
+"		unwritten segments run length encoded), existing compact\n"
+"		files stay compact, ddprofile converts between formats\n"
+"	-k	keep the checksum updates of this delta pending until it has\n"
+"		been acknowledged with -A commit (or dropped with -A abort)\n"
+"	-A	commit|abort the pending checksum updates (requires -c)\n"
+"	-R	rolling hash delta, finds old data at shifted offsets (files\n"
+"		with insertions), requires -x and an existing checksum file\n"
+"	-E	embed the segment checksums in the delta records, ddcommit\n"
+"		stores them instead of hashing the data it writes\n"
+"	-T	write per phase timings (read, hash, compare, compress, write,\n"
+"		sleep) to <prefix>.json and the node_exporter textfile\n"
+"		<prefix>.prom, every 10 seconds and at the end\n"
+"	-e	estimate the changed and compressed bytes from the given\n"
+"		number of sampled segments, with a 95%% confidence interval\n"
+"	-Z	ddzone profiler heatmap file, one row per sweep point and zone\n"
+"		(mode, pattern, block size, queue depth, MB/s, IOPS, p50/p99/max\n"
+"		latency), JSON lines if it ends in .json, CSV otherwise\n"
+"	-q	profiler queue depths (1,4,16,32), above 1 requires io_uring\n"
+"	-B	profiler block sizes in KB (16,1024), multiples of 4\n"
+"	-P	profiler access patterns (seq,rand)\n"
+"	-D	profile both buffered and direct reads (-d: direct only)\n"
+"	-N	profiler zones (16)\n"
+"	-S	profiler seconds per sweep point, split across the zones (2)\n"
+"	-I	end every delta record in a crc32 of its bytes, ddcommit\n"
+"		checks each record before writing it and -a check validates\n"
+"		a whole delta\n"
 "	-vv	verbose+debug\n"
 "\n"
 "Exit codes:\n"
@@ -1520,11 +2481,16 @@ int main(int argc, char *argv[])
 	parms.registeredflag     = 0;
 	parms.compressedflag     = 0;
 	parms.encryptedflag      = 0;
+	parms.rollingflag        = 0;
 	parms.ziplevel           = 6;
 	parms.zipbuffer          = NULL;
 	int workers_override     = 0;
+	char journal_action[16]  = "";
+	u_int64_t estimate_samples = 0;
 	errflg = 0;
-	while ((c = getopt(argc, argv, "ds:r:c:bt:x:w:hvpm:zl:")) != -1)
+	int zone_both_modes      = 0;
+	dd_zone_defaults();
+	while ((c = getopt(argc, argv, "ds:r:c:bt:x:w:hvpm:zl:RkA:M:CEIe:T:Z:q:B:P:DN:S:")) != -1)
 	{
 		switch (c)
 		{
@@ -1583,6 +2549,72 @@ int main(int argc, char *argv[])
 					exit(1);
 				}
 				break;
+			case 'R':
+				parms.rollingflag = 1;
+				break;
+			case 'E':
+				parms.checksumsflag = 1;
+				break;
+			case 'I':
+				parms.recordcrcflag = 1;
+				break;
+			case 'T':
+				strncpy(parms.stats_prefix, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'e':
+				sscanf(optarg,"%llu", (long long unsigned *)&estimate_samples);
+				if ( estimate_samples < 1 )
+				{
+					dd_log(LOG_ERR,"estimate samples must be >=1");
+					exit(1);
+				}
+				break;
+			case 'k':
+				parms.journal_pending = 1;
+				break;
+			case 'M':
+				sscanf(optarg,"%llu", (long long unsigned *)&parms.checksum_window_mb);
+				break;
+			case 'C':
+				parms.checksum_compact = 1;
+				break;
+			case 'A':
+				strncpy(journal_action, optarg, sizeof(journal_action) - 1);
+				break;
+			case 'Z':
+				strncpy(zone_config.heatmap_file, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'q':
+				if ( (zone_config.ndepths = dd_zone_list(optarg, zone_config.depths, 1)) == -1 )
+					errflg++;
+				break;
+			case 'B':
+				if ( (zone_config.nsizes = dd_zone_list(optarg, zone_config.sizes, 1024)) == -1 )
+					errflg++;
+				break;
+			case 'P':
+				if ( (zone_config.patterns = dd_zone_patterns(optarg)) == -1 )
+					errflg++;
+				break;
+			case 'D':
+				zone_both_modes = 1;
+				break;
+			case 'N':
+				sscanf(optarg,"%d", &zone_config.zones);
+				if ( zone_config.zones < 1 )
+				{
+					dd_log(LOG_ERR,"number of zones must be >=1");
+					exit(1);
+				}
+				break;
+			case 'S':
+				sscanf(optarg,"%lf", &zone_config.seconds);
+				if ( zone_config.seconds <= 0 )
+				{
+					dd_log(LOG_ERR,"seconds per sweep point must be >0");
+					exit(1);
+				}
+				break;
 			case 'h':
 			case '?':
 				errflg++;
@@ -1594,6 +2626,68 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if ( *zone_config.heatmap_file )
+	{
+		if ( !*parms.source_dev )
+		{
+			usage();
+			exit(1);
+		}
+		zone_config.modes = zone_both_modes ? DD_ZONE_BUFFERED | DD_ZONE_DIRECT :
+			parms.o_direct ? DD_ZONE_DIRECT : DD_ZONE_BUFFERED;
+		dd_log(LOG_INFO,"invoking ddzone profiler...");
+		if ( dd_zone_profile(parms.source_dev) == -1 )
+		{
+			exit(1);
+		}
+		exit(0);
+	}
+
+	if ( *journal_action )
+	{
+		if ( !*parms.checksum_file ||
+			( strcmp(journal_action, "commit") && strcmp(journal_action, "abort") ) )
+		{
+			usage();
+			exit(1);
+		}
+		if ( dd_journal_resolve(parms.checksum_file, strcmp(journal_action, "commit") == 0) == -1 )
+		{
+			exit(1);
+		}
+		exit(0);
+	}
+
+	if ( parms.rollingflag && ( !*parms.delta_file || *parms.target_dev || *parms.ddmap_dev ) )
+	{
+		dd_log(LOG_ERR,"rolling hash mode (-R) requires a delta file (-x) and no target or ddmap");
+		exit(1);
+	}
+	if ( parms.checksumsflag && ( !*parms.delta_file || parms.rollingflag ) )
+	{
+		dd_log(LOG_ERR,"embedded checksums (-E) require a delta file (-x) and no rolling hash (-R)");
+		exit(1);
+	}
+	if ( parms.rollingflag && strncmp(parms.checksum_file,"/dev/null",strlen("/dev/null")) == 0 )
+	{
+		dd_log(LOG_ERR,"rolling hash mode (-R) requires a checksum file");
+		exit(1);
+	}
+
+	if ( estimate_samples )
+	{
+		if ( !*parms.source_dev || !*parms.checksum_file || *parms.target_dev || *parms.delta_file )
+		{
+			dd_log(LOG_ERR,"estimate (-e) requires a source (-s) and checksum file (-c) only");
+			exit(1);
+		}
+		if ( ddestimate(estimate_samples) == -1 )
+		{
+			exit(1);
+		}
+		exit(0);
+	}
+
 	if ( *parms.source_dev && 
 		*parms.checksum_file &&
 		*parms.target_dev )
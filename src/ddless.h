@@ -32,6 +32,7 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <zlib.h>
+#include <math.h>
 
 extern int open(const char *pathname, int flags, ...);
 
@@ -51,9 +52,22 @@ extern int open(const char *pathname, int flags, ...);
 #define SEGMENT_SIZE (16*1024)
 #define BUFFER_SEGMENTS READ_BUFFER_SIZE/SEGMENT_SIZE
 
+//
+// seed of the murmur segment checksum (part of the checksum file format)
+//
+#define MURMUR_SEED 0xbabeaffe
+
 #define GIGABYTE_FACTOR (1024 * 1024 * 1024)
 #define MEGABYTE_FACTOR (1024 * 1024)
 
+//
+// <checksum>.stats records: version 1 was a flat text line, version 2 is a
+// JSON line with the changed segments counted per STATS_REGION_SIZE region
+//
+#define STATS_VERSION 2
+#define STATS_REGION_SIZE ((u_int64_t)GIGABYTE_FACTOR)
+#define STATS_REGION_SEGMENTS (STATS_REGION_SIZE / SEGMENT_SIZE)
+
 #define RUNMODE_SOURCE_TARGET 0
 #define RUNMODE_CHECKSUM_ONLY 1
 #define RUNMODE_NEW_CHECKSUM  2
@@ -61,6 +75,8 @@ extern int open(const char *pathname, int flags, ...);
 #define RUNMODE_SOURCE_DELTA  4
 #define RUNMODE_SHOW_DELTA    5
 #define RUNMODE_APPLY_DELTA   6
+#define RUNMODE_CHECK_DELTA   7
+#define RUNMODE_ESTIMATE      8
 
 #define DEV_NAME_LENGTH    1024
 #define MAX_CMD_LENGTH     1024
@@ -68,6 +84,20 @@ extern int open(const char *pathname, int flags, ...);
 #define DDFLAG_REGISTERED     0
 #define DDFLAG_COMPRESSED     1
 #define DDFLAG_ENCRYPTED      2
+#define DDFLAG_ROLLING        3
+#define DDFLAG_CHECKSUMS      4
+#define DDFLAG_RECORDCRC      5
+
+//
+// delta record size bit marking a copy record (rolling hash deltas), the
+// record carries the offset of the data in the old target, not the data
+//
+#define DELTA_COPY_RECORD     0x8000000000000000ULL
+
+//
+// largest number of segment checksums a record carries (DDFLAG_CHECKSUMS)
+//
+#define DELTA_RECORD_CHECKSUMS (READ_BUFFER_SIZE / SEGMENT_SIZE)
 
 //
 // checksum structure (can accomodate multiple algorithms)
@@ -90,6 +120,10 @@ typedef struct
 	unsigned char	registeredflag;
 	unsigned char	compressedflag;
 	unsigned char	encryptedflag;
+	unsigned char	rollingflag;
+	unsigned char	checksumsflag;	// records carry their segment checksums
+	unsigned char	recordcrcflag;	// records end in a crc32 of their bytes
+	unsigned char	verifyflag;	// ddcommit rehashes records anyway
 	int		ziplevel;
 	void	      	*zipbuffer;
 
@@ -113,13 +147,37 @@ typedef struct
 	int		mmap_fd;
 	checksum_struct *checksum_array;
 
-	// statistics file
+	// io_uring queue depth of ddcommit apply workers, 0 uses pwrite
+	int		uring_depth;
+	// ddcommit sorted apply window in megabytes, 0 writes in delta order
+	u_int64_t	sort_window_mb;
+	// ddcommit checkpoints (0 disables) and resuming from the last one
+	u_int64_t	checkpoint_mb;
+	int		resumeflag;
+
+	// checksum file in the compact format (expanded in memory)
+	int		checksum_compact;
+
+	// windowed checksum access (bounded memory instead of mmap'ing it all)
+	int		checksum_windowed;
+	u_int64_t	checksum_window_mb;
+	u_int64_t	checksum_window_entries;
+
+	// checksum journal (updates are staged until the data is durable)
+	struct dd_journal *journal;
+	int		journal_pending;
+
+	// statistics file, changed segments are also counted per region
 	char		stats_file[DEV_NAME_LENGTH];
+	u_int32_t *	stats_regions;
+	u_int64_t	stats_region_count;
+	char		stats_prefix[DEV_NAME_LENGTH];	// -T, dd_stats json/prom files
 	int		stats_fd;
 	
 	// target device/file
 	char		target_dev[DEV_NAME_LENGTH];
 	off64_t		target_size_bytes;
+	int		target_sparse;
 	
 	// delta file
 	char		delta_file[DEV_NAME_LENGTH];
@@ -129,18 +187,20 @@ typedef struct
 	char *		delta_magic_end;
 	u_int64_t	delta_size;
 	u_int64_t	delta_zip_size;
+	u_int64_t	delta_copy_size;
 	u_int64_t	delta_size_bytes;
 	
 	// delta info file
-	char		delta_info_file[DEV_NAME_LENGTH];
+	char		delta_info_file[DEV_NAME_LENGTH + sizeof(".rinfo")];
 	FILE *		delta_info_fd;
 
 	// delta show | apply
 	char		delta_action[DEV_NAME_LENGTH];
 	
-	// timing
+	// timing, wall clock for the record, monotonic ns for the durations
 	time_t		start_time;
-	time_t		end_time;
+	u_int64_t	start_ns;
+	u_int64_t	end_ns;
 } parms_struct;
 
 //
@@ -170,12 +230,33 @@ typedef struct
 	//
 	int	seg_bytes_dirty_map[BUFFER_SEGMENTS+1];
 
+	//
+	// checksums of the segments in the buffer, embedded in delta records
+	//
+	checksum_struct	seg_checksums[BUFFER_SEGMENTS+1];
+
+	//
+	// slice of the checksum file (windowed mode)
+	//
+	checksum_struct	*window;
+	u_int64_t	window_start;
+	u_int64_t	window_count;
+	int		window_dirty;
+
+	//
+	// checksum updates staged for the journal
+	//
+	struct dd_journal_entry *journal_entries;
+	int	journal_count;
+
 	//
 	// statistics (at the end the stats are summed up across all workers)
 	//
 	u_int64_t	stats_read_buffers;
 	u_int64_t	stats_changed_segments;
+	u_int64_t	stats_zero_segments;
 	u_int64_t	stats_written_bytes;
+	u_int64_t	stats_copied_bytes;
 } thread_struct;
 
 typedef struct
@@ -8,6 +8,8 @@
 #include "dd_murmurhash2.h"
 #include "dd_file.h"
 #include "dd_map.h"
+#include "dd_zero.h"
+#include "dd_checksum.h"
 
 parms_struct parms;
 
@@ -37,41 +39,923 @@ u_int64_t read_long(int fd)
 
 }
 //-----------------------------------------------------------------------------
-int ddprofile(int runmode)
+// summary: zero and data runs of the checksum array, a histogram of their
+// lengths and the share of data segments per GB. Workers scan GB aligned
+// parts of the array, runs that cross parts are joined afterwards.
+//-----------------------------------------------------------------------------
+#define PROFILE_HIST		48	// log2 buckets of run lengths in segments
+#define PROFILE_GB_SEGMENTS	(GIGABYTE_FACTOR / SEGMENT_SIZE)
+#define PROFILE_ZERO		(((u_int64_t)ZERO_CHECKSUM2_CRC32 << 32) | ZERO_CHECKSUM1_MURMUR)
+
+typedef struct
 {
-	parms.runmode = runmode;
+	u_int64_t	start;		// segment range of the part
+	u_int64_t	end;
+	u_int64_t	zero;
+	u_int64_t	unset;		// 0/0 entries, never checksummed
+	u_int64_t	zero_hist[PROFILE_HIST];
+	u_int64_t	data_hist[PROFILE_HIST];
+	int		first_kind;	// runs touching the part boundaries
+	u_int64_t	first_len;
+	int		last_kind;
+	u_int64_t	last_len;
+	pthread_t	thread;
+} profile_part;
 
-	if ((parms.mmap_fd = dd_dev_open_rw(parms.checksum_file, 0)) == -1 )
-        {
-                dd_log(LOG_ERR, "unable to open file: %s", parms.checksum_file);
-                exit (1);
-        }
-        dd_log(LOG_DEBUG, "opened file: %s", parms.checksum_file);
+typedef struct
+{
+	u_int64_t	*entries;	// checksum array as u64 (murmur | crc << 32)
+	u_int64_t	count;
+	u_int32_t	*gb_data;	// data segments per GB
+	u_int64_t	gbs;
+	u_int64_t	zero;
+	u_int64_t	unset;
+	u_int64_t	zero_hist[PROFILE_HIST];
+	u_int64_t	data_hist[PROFILE_HIST];
+	u_int64_t	zero_runs;
+	u_int64_t	data_runs;
+} profile_summary;
+
+profile_summary profs;
+
+//-----------------------------------------------------------------------------
+static int hist_bucket(u_int64_t len)
+{
+	int b = 0;
+
+	while ( len > 1 && b < PROFILE_HIST - 1 )
+	{
+		len >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static void hist_add(u_int64_t *zero_hist, u_int64_t *data_hist, int kind, u_int64_t len)
+{
+	if ( len == 0 )
+		return;
+	if ( kind )
+		zero_hist[hist_bucket(len)]++;
+	else
+		data_hist[hist_bucket(len)]++;
+}
+
+//-----------------------------------------------------------------------------
+// scan a part: 8 entries at a time when they extend the current run
+//-----------------------------------------------------------------------------
+void *profile_scan_thread(profile_part *part)
+{
+	u_int64_t *e = profs.entries;
+	u_int64_t i = part->start, gb_start = part->start;
+	u_int64_t gb_zero = 0, run_len = 0;
+	int kind = -1, first_done = 0;
+
+	while ( i < part->end )
+	{
+		u_int64_t n = part->end - i, j, zeros = 0;
+
+		if ( n > 8 )
+			n = 8;
+		if ( (i + n - 1) / PROFILE_GB_SEGMENTS != i / PROFILE_GB_SEGMENTS )
+			n = PROFILE_GB_SEGMENTS - i % PROFILE_GB_SEGMENTS;
+
+		for (j = 0; j < n; j++)
+			zeros += ( e[i + j] == PROFILE_ZERO );
+
+		if ( (zeros == n && kind == 1) || (zeros == 0 && kind == 0) )
+		{
+			run_len += n;
+		}
+		else
+		{
+			for (j = 0; j < n; j++)
+			{
+				int z = ( e[i + j] == PROFILE_ZERO );
+
+				if ( z == kind )
+				{
+					run_len++;
+					continue;
+				}
+				if ( kind != -1 && !first_done )
+				{
+					part->first_kind = kind;
+					part->first_len = run_len;
+					first_done = 1;
+				}
+				else if ( kind != -1 )
+					hist_add(part->zero_hist, part->data_hist, kind, run_len);
+				kind = z;
+				run_len = 1;
+			}
+		}
+		for (j = 0; j < n; j++)
+			part->unset += ( e[i + j] == 0 );
+		gb_zero += zeros;
+		i += n;
+
+		if ( i % PROFILE_GB_SEGMENTS == 0 || i == part->end )
+		{
+			profs.gb_data[gb_start / PROFILE_GB_SEGMENTS] = (i - gb_start) - gb_zero;
+			part->zero += gb_zero;
+			gb_zero = 0;
+			gb_start = i;
+		}
+	}
+
+	part->last_kind = kind;
+	part->last_len = run_len;
+	if ( !first_done )
+	{
+		part->first_kind = kind;
+		part->first_len = 0;	// one run, held in last
+	}
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+int profile_summarize(int workers)
+{
+	profile_part *parts;
+	u_int64_t gbs_per_part, carry_len = 0;
+	int p, nparts, carry_kind = -1;
+
+	profs.gbs = (profs.count + PROFILE_GB_SEGMENTS - 1) / PROFILE_GB_SEGMENTS;
+	if ( (profs.gb_data = calloc(profs.gbs + 1, sizeof(u_int32_t))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate memory for %llu GB counters", profs.gbs);
+		return -1;
+	}
+	if ( workers < 1 )
+		workers = 1;
+	if ( workers > profs.gbs )
+		workers = profs.gbs ? profs.gbs : 1;
+	gbs_per_part = (profs.gbs + workers - 1) / workers;
+	if ( gbs_per_part == 0 )
+		gbs_per_part = 1;
+	nparts = (profs.gbs + gbs_per_part - 1) / gbs_per_part;
+
+	if ( (parts = calloc(nparts + 1, sizeof(profile_part))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate memory for %d parts", nparts);
+		return -1;
+	}
+	dd_log(LOG_INFO, "summary: %llu segments in %d parts", profs.count, nparts);
+	for (p = 0; p < nparts; p++)
+	{
+		parts[p].start = p * gbs_per_part * PROFILE_GB_SEGMENTS;
+		parts[p].end = (p + 1) * gbs_per_part * PROFILE_GB_SEGMENTS;
+		if ( parts[p].end > profs.count )
+			parts[p].end = profs.count;
+		if ( pthread_create(&parts[p].thread, NULL, (void *) profile_scan_thread, (void *)&parts[p]) != 0 )
+		{
+			dd_log(LOG_ERR, "pthread_create summary failed");
+			return -1;
+		}
+	}
+
+	//
+	// join the parts in order, the run at a boundary continues in the
+	// next part if it is of the same kind
+	//
+	for (p = 0; p < nparts; p++)
+	{
+		profile_part *part = &parts[p];
+		int b;
+
+		pthread_join(part->thread, NULL);
+		profs.zero += part->zero;
+		profs.unset += part->unset;
+		for (b = 0; b < PROFILE_HIST; b++)
+		{
+			profs.zero_hist[b] += part->zero_hist[b];
+			profs.data_hist[b] += part->data_hist[b];
+		}
+
+		if ( part->first_len > 0 )
+		{
+			if ( part->first_kind == carry_kind )
+				carry_len += part->first_len;
+			else
+			{
+				hist_add(profs.zero_hist, profs.data_hist, carry_kind, carry_len);
+				carry_kind = part->first_kind;
+				carry_len = part->first_len;
+			}
+			hist_add(profs.zero_hist, profs.data_hist, carry_kind, carry_len);
+			carry_kind = -1;
+			carry_len = 0;
+		}
+		if ( part->last_kind == carry_kind )
+			carry_len += part->last_len;
+		else
+		{
+			hist_add(profs.zero_hist, profs.data_hist, carry_kind, carry_len);
+			carry_kind = part->last_kind;
+			carry_len = part->last_len;
+		}
+	}
+	hist_add(profs.zero_hist, profs.data_hist, carry_kind, carry_len);
+	free(parts);
+
+	for (p = 0; p < PROFILE_HIST; p++)
+	{
+		profs.zero_runs += profs.zero_hist[p];
+		profs.data_runs += profs.data_hist[p];
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// run lengths as text, 16K, 512M, 2T
+//-----------------------------------------------------------------------------
+static char *profile_size(u_int64_t bytes, char *buf)
+{
+	char *units = "KMGTPE";
+	int u = 0;
+
+	bytes >>= 10;
+	while ( bytes >= 1024 && units[u + 1] )
+	{
+		bytes >>= 10;
+		u++;
+	}
+	snprintf(buf, 24, "%llu%c", (long long unsigned)bytes, units[u]);
+	return buf;
+}
+
+//-----------------------------------------------------------------------------
+// zero and data extents in target byte offsets
+//-----------------------------------------------------------------------------
+void profile_extents(int json)
+{
+	u_int64_t i, start = 0;
+	int kind, first = 1;
+
+	if ( profs.count == 0 )
+		return;
+	kind = ( profs.entries[0] == PROFILE_ZERO );
+	for (i = 1; i <= profs.count; i++)
+	{
+		if ( i < profs.count && ( profs.entries[i] == PROFILE_ZERO ) == kind )
+			continue;
+		if ( json )
+			fprintf(stdout, "%s\n    {\"kind\": \"%s\", \"offset\": %llu, \"bytes\": %llu}", first ? "" : ",",
+				kind ? "zero" : "data", (long long unsigned)start * SEGMENT_SIZE,
+				(long long unsigned)(i - start) * SEGMENT_SIZE);
+		else
+			fprintf(stdout, "extent %s %llu %llu\n", kind ? "zero" : "data",
+				(long long unsigned)start * SEGMENT_SIZE, (long long unsigned)(i - start) * SEGMENT_SIZE);
+		first = 0;
+		start = i;
+		if ( i < profs.count )
+			kind = !kind;
+	}
+}
+
+//-----------------------------------------------------------------------------
+void profile_print(int json, int extents)
+{
+	u_int64_t data = profs.count - profs.zero;
+	double blank = profs.count ? 100 * (double)profs.zero / profs.count : 0;
+	u_int64_t g;
+	int b, last = 0, first;
+	char lo[24], hi[24];
+
+	for (b = 0; b < PROFILE_HIST; b++)
+		if ( profs.zero_hist[b] || profs.data_hist[b] )
+			last = b;
+
+	if ( json )
+	{
+		fprintf(stdout, "{\n  \"segments\": %llu,\n  \"segment_size\": %d,\n", (long long unsigned)profs.count, SEGMENT_SIZE);
+		fprintf(stdout, "  \"zero_segments\": %llu,\n  \"data_segments\": %llu,\n  \"unset_segments\": %llu,\n",
+			(long long unsigned)profs.zero, (long long unsigned)data, (long long unsigned)profs.unset);
+		fprintf(stdout, "  \"blank_percent\": %.2f,\n  \"zero_runs\": %llu,\n  \"data_runs\": %llu,\n",
+			blank, (long long unsigned)profs.zero_runs, (long long unsigned)profs.data_runs);
+		fprintf(stdout, "  \"histogram\": [");
+		for (b = 0, first = 1; b <= last; b++)
+		{
+			if ( !profs.zero_hist[b] && !profs.data_hist[b] )
+				continue;
+			fprintf(stdout, "%s\n    {\"min_bytes\": %llu, \"zero_runs\": %llu, \"data_runs\": %llu}",
+				first ? "" : ",", (long long unsigned)SEGMENT_SIZE << b,
+				(long long unsigned)profs.zero_hist[b], (long long unsigned)profs.data_hist[b]);
+			first = 0;
+		}
+		fprintf(stdout, "\n  ],\n  \"gb_data_percent\": [");
+		for (g = 0; g < profs.gbs; g++)
+		{
+			u_int64_t segs = g == profs.gbs - 1 ? profs.count - g * PROFILE_GB_SEGMENTS : PROFILE_GB_SEGMENTS;
+			fprintf(stdout, "%s%.1f", g ? ", " : "", 100 * (double)profs.gb_data[g] / segs);
+		}
+		fprintf(stdout, "]");
+		if ( extents )
+		{
+			fprintf(stdout, ",\n  \"extents\": [");
+			profile_extents(1);
+			fprintf(stdout, "\n  ]");
+		}
+		fprintf(stdout, "\n}\n");
+		return;
+	}
+
+	fprintf(stdout, "segments %llu of %d bytes\n", (long long unsigned)profs.count, SEGMENT_SIZE);
+	fprintf(stdout, "zero %llu data %llu unset %llu\n", (long long unsigned)profs.zero,
+		(long long unsigned)data, (long long unsigned)profs.unset);
+	fprintf(stdout, "runs zero %llu data %llu\n", (long long unsigned)profs.zero_runs,
+		(long long unsigned)profs.data_runs);
+	fprintf(stdout, "histogram run length: zero runs, data runs\n");
+	for (b = 0; b <= last; b++)
+	{
+		if ( !profs.zero_hist[b] && !profs.data_hist[b] )
+			continue;
+		fprintf(stdout, "  %6s-%-6s %llu %llu\n", profile_size((u_int64_t)SEGMENT_SIZE << b, lo),
+			profile_size((u_int64_t)SEGMENT_SIZE << (b + 1), hi),
+			(long long unsigned)profs.zero_hist[b], (long long unsigned)profs.data_hist[b]);
+	}
+	fprintf(stdout, "data per GB (%%)");
+	for (g = 0; g < profs.gbs; g++)
+	{
+		u_int64_t segs = g == profs.gbs - 1 ? profs.count - g * PROFILE_GB_SEGMENTS : PROFILE_GB_SEGMENTS;
+		if ( g % 16 == 0 )
+			fprintf(stdout, "\n  %6llu:", (long long unsigned)g);
+		fprintf(stdout, " %3.0f", 100 * (double)profs.gb_data[g] / segs);
+	}
+	fprintf(stdout, "\n");
+	if ( extents )
+		profile_extents(0);
+	fprintf (stdout, "blank %llu/%llu %.2f%%\n", (long long unsigned int)profs.zero,
+		(long long unsigned int)profs.count, blank);
+}
+
+//-----------------------------------------------------------------------------
+// diff: segments whose checksums differ between the source (-c) and the
+// backup site (-D), as a ddmap for ddplus -m. Workers own whole u32 map
+// words, so the bits are set without locking.
+//-----------------------------------------------------------------------------
+typedef struct
+{
+	u_int64_t	start;		// segment range, a multiple of 32
+	u_int64_t	end;
+	u_int64_t	changed;
+	u_int64_t	extents;	// runs of changed segments
+	u_int64_t	records;	// runs split at read buffer boundaries
+	pthread_t	thread;
+} diff_part;
+
+typedef struct
+{
+	u_int64_t	*source;
+	u_int64_t	source_count;
+	u_int64_t	*backup;
+	u_int64_t	backup_count;
+	u_int32_t	*map;
+} profile_diff;
+
+profile_diff diffs;
+
+static int diff_segment(u_int64_t i)
+{
+	return i >= diffs.backup_count || diffs.source[i] != diffs.backup[i];
+}
+
+//-----------------------------------------------------------------------------
+void *profile_diff_thread(diff_part *part)
+{
+	u_int64_t i, j;
+
+	for (i = part->start; i < part->end; i += 32)
+	{
+		u_int64_t n = part->end - i < 32 ? part->end - i : 32;
+		u_int32_t word = 0;
+
+		if ( i + n <= diffs.backup_count )
+		{
+			for (j = 0; j < n; j++)
+				word |= (u_int32_t)( diffs.source[i + j] != diffs.backup[i + j] ) << j;
+		}
+		else
+		{
+			for (j = 0; j < n; j++)
+				word |= (u_int32_t)diff_segment(i + j) << j;
+		}
+		if ( word == 0 )
+			continue;
+
+		diffs.map[i >> DDMAP_U32_SHIFT] = word;
+		part->changed += __builtin_popcount(word);
+		for (j = 0; j < n; j++)
+		{
+			int prev;
 
-	if ((parms.mmap_size = dd_device_size(parms.mmap_fd)) == -1 )
+			if ( !(word & (1U << j)) )
+				continue;
+			prev = ( i + j > 0 && diff_segment(i + j - 1) );
+			if ( !prev )
+				part->extents++;
+			if ( !prev || (i + j) % BUFFER_SEGMENTS == 0 )
+				part->records++;
+		}
+	}
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+int ddprofile_diff(char *backup_file, char *map_file, char *map_name, int json, int workers)
+{
+	diff_part *parts;
+	u_int64_t changed = 0, extents = 0, records = 0, words, per_part, delta_bytes;
+	int p, nparts;
+
+	if ((parms.checksum_array = dd_checksum_load(parms.checksum_file, &diffs.source_count)) == NULL )
+		return -1;
+	if ((diffs.backup = (u_int64_t *)dd_checksum_load(backup_file, &diffs.backup_count)) == NULL )
+		return -1;
+	diffs.source = (u_int64_t *)parms.checksum_array;
+
+	words = (diffs.source_count + 31) / 32;
+	if ( (diffs.map = calloc(words + 1, DDMAP_U32_SIZE)) == NULL )
 	{
-		dd_log(LOG_ERR, "unable to determine checksum file %s size",parms.checksum_file);
+		dd_log(LOG_ERR, "unable to allocate memory for a map of %llu words", words);
 		return -1;
 	}
 
-	parms.checksum_array = (void *)mmap64(
-		0, parms.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, parms.mmap_fd, 0);
-	if ( parms.checksum_array == MAP_FAILED )
+	if ( workers < 1 )
+		workers = 1;
+	per_part = (words + workers - 1) / workers;
+	if ( per_part == 0 )
+		per_part = 1;
+	nparts = (words + per_part - 1) / per_part;
+	if ( (parts = calloc(nparts + 1, sizeof(diff_part))) == NULL )
 	{
-		dd_log(LOG_ERR, "unable to mmap from the checksum file");
+		dd_log(LOG_ERR, "unable to allocate memory for %d parts", nparts);
 		return -1;
 	}
+	dd_log(LOG_INFO, "diff: %llu/%llu segments in %d parts", diffs.source_count, diffs.backup_count, nparts);
+	for (p = 0; p < nparts; p++)
+	{
+		parts[p].start = p * per_part * 32;
+		parts[p].end = (p + 1) * per_part * 32;
+		if ( parts[p].end > diffs.source_count )
+			parts[p].end = diffs.source_count;
+		if ( pthread_create(&parts[p].thread, NULL, (void *) profile_diff_thread, (void *)&parts[p]) != 0 )
+		{
+			dd_log(LOG_ERR, "pthread_create diff failed");
+			return -1;
+		}
+	}
+	for (p = 0; p < nparts; p++)
+	{
+		pthread_join(parts[p].thread, NULL);
+		changed += parts[p].changed;
+		extents += parts[p].extents;
+		records += parts[p].records;
+	}
+	free(parts);
+
+	//
+	// a ddplus delta carries the offset and size of each record plus the
+	// header and footer, the payload is not compressed in this estimate
+	//
+	delta_bytes = changed * SEGMENT_SIZE + records * 2 * sizeof(u_int64_t) +
+		sizeof(delta_header) + sizeof(delta_footer);
+
+	if ( *map_file )
+	{
+		struct ddmap_data map_data;
+		char *c;
+
+		memset(&map_data, 0, sizeof(map_data));
+		strncpy(map_data.map_device, map_file, DEV_NAME_LENGTH - 1);
+		for (c = map_name; *c; c++)
+			map_data.name_sum += *c;
+		map_data.map_size = words;
+		map_data.map_size_bytes = words * DDMAP_U32_SIZE;
+		map_data.map = diffs.map;
+		if ( ddmap_write(&map_data) == -1 )
+			return -1;
+	}
+
+	if ( json )
+	{
+		fprintf(stdout, "{\n  \"source_segments\": %llu,\n  \"backup_segments\": %llu,\n",
+			(long long unsigned)diffs.source_count, (long long unsigned)diffs.backup_count);
+		fprintf(stdout, "  \"changed_segments\": %llu,\n  \"changed_extents\": %llu,\n",
+			(long long unsigned)changed, (long long unsigned)extents);
+		fprintf(stdout, "  \"changed_bytes\": %llu,\n  \"estimated_delta_bytes\": %llu\n}\n",
+			(long long unsigned)changed * SEGMENT_SIZE, (long long unsigned)delta_bytes);
+	}
+	else
+	{
+		fprintf(stdout, "segments %llu source %llu backup\n",
+			(long long unsigned)diffs.source_count, (long long unsigned)diffs.backup_count);
+		fprintf(stdout, "changed %llu segments in %llu extents, %llu bytes\n", (long long unsigned)changed,
+			(long long unsigned)extents, (long long unsigned)changed * SEGMENT_SIZE);
+		fprintf(stdout, "estimated delta %llu bytes (%.2f MB)\n",
+			(long long unsigned)delta_bytes, delta_bytes / (double)MEGABYTE_FACTOR);
+	}
+
+	free(diffs.map);
+	free(diffs.backup);
+	free(parms.checksum_array);
+	return changed > 0 ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// dedup: how often each segment content (murmur | crc as 64 bits) occurs
+// in one or more checksum files. Zero and unwritten segments are counted
+// apart. If the table would exceed the memory limit the contents are
+// spilled to partition files by hash and each partition is counted on its
+// own, identical contents always land in the same partition.
+//-----------------------------------------------------------------------------
+#define DEDUP_BATCH		65536		// checksums per read
+#define DEDUP_SPILL_BUFFER	(1024*1024)
+#define DEDUP_MULTI_FILE	0xffffffff	// content seen in more than one file
+
+typedef struct
+{
+	u_int64_t	key;		// 0 is unwritten, never stored
+	u_int32_t	count;
+	u_int32_t	file;		// first file or DEDUP_MULTI_FILE
+} dedup_slot;
+
+typedef struct __attribute__((packed))
+{
+	u_int64_t	key;
+	u_int32_t	file;
+} dedup_spill;
+
+typedef struct
+{
+	dedup_slot	*table;
+	u_int64_t	slots;		// power of 2
+	u_int64_t	used;
+	int		partitions;
+	int		*spill_fd;
+	char		**spill_buf;
+	u_int64_t	*spill_used;
+	char		tmp_dir[DEV_NAME_LENGTH];
+	dedup_slot	*top;		// most repeated contents, descending
+	int		top_count;
+	u_int64_t	segments;
+	u_int64_t	zero;
+	u_int64_t	unset;
+	u_int64_t	unique;		// distinct contents
+	u_int64_t	repeated;	// distinct contents seen more than once
+	u_int64_t	duplicates;	// segments beyond the first copy
+	u_int64_t	shared;		// distinct contents in several files
+	u_int64_t	shared_segments;
+} dedup_state;
+
+dedup_state dedups;
+
+static inline u_int64_t dedup_hash(u_int64_t key)
+{
+	return key * 0x9e3779b97f4a7c15ULL;
+}
+
+//-----------------------------------------------------------------------------
+static int dedup_table_alloc(u_int64_t entries, u_int64_t limit_bytes)
+{
+	u_int64_t slots = 1024;
+
+	while ( slots < entries + entries / 4 && slots * sizeof(dedup_slot) < limit_bytes )
+		slots <<= 1;
+	if ( slots * sizeof(dedup_slot) > limit_bytes && slots > 1024 )
+		slots >>= 1;
+	if ( (dedups.table = calloc(slots, sizeof(dedup_slot))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate a table of %llu slots", slots);
+		return -1;
+	}
+	dedups.slots = slots;
+	dedups.used = 0;
+	dd_log(LOG_INFO, "dedup table: %llu slots, %llu MB", slots, slots * sizeof(dedup_slot) / MEGABYTE_FACTOR);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int dedup_insert(u_int64_t key, u_int32_t file)
+{
+	u_int64_t mask = dedups.slots - 1;
+	u_int64_t i = (dedup_hash(key) >> 20) & mask;
+
+	while ( dedups.table[i].key && dedups.table[i].key != key )
+		i = (i + 1) & mask;
+
+	if ( dedups.table[i].key == 0 )
+	{
+		if ( dedups.used >= dedups.slots - dedups.slots / 8 )
+		{
+			dd_log(LOG_ERR, "dedup table is full at %llu contents, raise the memory limit", dedups.used);
+			return -1;
+		}
+		dedups.table[i].key = key;
+		dedups.table[i].file = file;
+		dedups.used++;
+	}
+	else if ( dedups.table[i].file != file )
+		dedups.table[i].file = DEDUP_MULTI_FILE;
+	if ( dedups.table[i].count < 0xffffffff )
+		dedups.table[i].count++;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fold a filled table into the totals and the top list
+//-----------------------------------------------------------------------------
+static void dedup_collect()
+{
+	u_int64_t i;
+	int t;
+
+	for (i = 0; i < dedups.slots; i++)
+	{
+		dedup_slot *s = &dedups.table[i];
+
+		if ( s->key == 0 )
+			continue;
+		dedups.unique++;
+		if ( s->count > 1 )
+		{
+			dedups.repeated++;
+			dedups.duplicates += s->count - 1;
+		}
+		if ( s->file == DEDUP_MULTI_FILE )
+		{
+			dedups.shared++;
+			dedups.shared_segments += s->count;
+		}
+		if ( dedups.top_count == 0 || s->count <= 1 ||
+			s->count <= dedups.top[dedups.top_count - 1].count )
+			continue;
+		for (t = dedups.top_count - 1; t > 0 && dedups.top[t - 1].count < s->count; t--)
+			dedups.top[t] = dedups.top[t - 1];
+		dedups.top[t] = *s;
+	}
+	free(dedups.table);
+	dedups.table = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int dedup_spill_flush(int p)
+{
+	if ( dedups.spill_used[p] &&
+		write(dedups.spill_fd[p], dedups.spill_buf[p], dedups.spill_used[p]) != dedups.spill_used[p] )
+	{
+		dd_log(LOG_ERR, "unable to write dedup partition %d", p);
+		return -1;
+	}
+	dedups.spill_used[p] = 0;
+	return 0;
+}
+
+static int dedup_spill_put(u_int64_t key, u_int32_t file)
+{
+	int p = dedup_hash(key) >> 44 & (dedups.partitions - 1);
+	dedup_spill *e = (dedup_spill *)(dedups.spill_buf[p] + dedups.spill_used[p]);
+
+	e->key = key;
+	e->file = file;
+	dedups.spill_used[p] += sizeof(dedup_spill);
+	if ( dedups.spill_used[p] + sizeof(dedup_spill) > DEDUP_SPILL_BUFFER )
+		return dedup_spill_flush(p);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// read every file once, count zero and unwritten segments and insert or
+// spill the rest
+//-----------------------------------------------------------------------------
+static int dedup_scan(char **files, int nfiles)
+{
+	checksum_struct *batch;
+	int f;
+
+	if ( (batch = malloc(DEDUP_BATCH * sizeof(checksum_struct))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate memory for a batch of checksums");
+		return -1;
+	}
+	for (f = 0; f < nfiles; f++)
+	{
+		dd_checksum_reader reader;
+		int64_t n, i;
+
+		if ( dd_checksum_open(&reader, files[f]) == -1 )
+			return -1;
+		while ( (n = dd_checksum_next(&reader, batch, DEDUP_BATCH)) > 0 )
+		{
+			u_int64_t *e = (u_int64_t *)batch;
+
+			for (i = 0; i < n; i++)
+			{
+				if ( e[i] == PROFILE_ZERO )
+					dedups.zero++;
+				else if ( e[i] == 0 )
+					dedups.unset++;
+				else if ( dedups.partitions == 1 ? dedup_insert(e[i], f) : dedup_spill_put(e[i], f) )
+					return -1;
+			}
+			dedups.segments += n;
+		}
+		dd_checksum_close(&reader);
+		if ( n == -1 )
+			return -1;
+		dd_log(LOG_INFO, "dedup: scanned %s, %llu segments so far", files[f], dedups.segments);
+	}
+	free(batch);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int dedup_partition(int p, u_int64_t limit_bytes)
+{
+	char *buf = dedups.spill_buf[p];
+	u_int64_t entries, i;
+	ssize_t n;
+
+	entries = lseek64(dedups.spill_fd[p], 0, SEEK_END) / sizeof(dedup_spill);
+	if ( lseek64(dedups.spill_fd[p], 0, SEEK_SET) == -1 ||
+		dedup_table_alloc(entries, limit_bytes) == -1 )
+		return -1;
+
+	while ( (n = read(dedups.spill_fd[p], buf, DEDUP_SPILL_BUFFER / sizeof(dedup_spill) * sizeof(dedup_spill))) > 0 )
+	{
+		dedup_spill *e = (dedup_spill *)buf;
+
+		for (i = 0; i < n / sizeof(dedup_spill); i++)
+			if ( dedup_insert(e[i].key, e[i].file) == -1 )
+				return -1;
+	}
+	if ( n == -1 )
+	{
+		dd_log(LOG_ERR, "unable to read dedup partition %d", p);
+		return -1;
+	}
+	dd_log(LOG_INFO, "dedup partition %d: %llu entries, %llu contents", p, entries, dedups.used);
+	dedup_collect();
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+int ddprofile_dedup(char **files, int nfiles, u_int64_t limit_mb, char *tmp_dir, int top, int json)
+{
+	u_int64_t limit_bytes = limit_mb * MEGABYTE_FACTOR;
+	u_int64_t entries = 0, need;
+	int64_t segments;
+	int f, p;
+
+	for (f = 0; f < nfiles; f++)
+	{
+		if ( (segments = dd_checksum_segments(files[f])) == -1 )
+		{
+			dd_log(LOG_ERR, "unable to read checksum file: %s", files[f]);
+			return -1;
+		}
+		entries += segments;
+	}
+	if ( (dedups.top = calloc(top + 1, sizeof(dedup_slot))) == NULL )
+	{
+		dd_log(LOG_ERR, "unable to allocate memory for the top %d contents", top);
+		return -1;
+	}
+	dedups.top_count = top;
+
+	//
+	// every segment could be distinct, size the table or the partitions for
+	// that and let zero or repeated contents leave room to spare
+	//
+	need = (entries + entries / 4) * sizeof(dedup_slot);
+	dedups.partitions = 1;
+	while ( need / dedups.partitions > limit_bytes && dedups.partitions < 4096 )
+		dedups.partitions <<= 1;
+	dd_log(LOG_INFO, "dedup: %llu segments in %d files, %d partitions", entries, nfiles, dedups.partitions);
+
+	if ( dedups.partitions == 1 )
+	{
+		if ( dedup_table_alloc(entries, limit_bytes) == -1 || dedup_scan(files, nfiles) == -1 )
+			return -1;
+		dedup_collect();
+	}
+	else
+	{
+		dedups.spill_fd = calloc(dedups.partitions, sizeof(int));
+		dedups.spill_buf = calloc(dedups.partitions, sizeof(char *));
+		dedups.spill_used = calloc(dedups.partitions, sizeof(u_int64_t));
+		if ( !dedups.spill_fd || !dedups.spill_buf || !dedups.spill_used )
+		{
+			dd_log(LOG_ERR, "unable to allocate memory for %d partitions", dedups.partitions);
+			return -1;
+		}
+		for (p = 0; p < dedups.partitions; p++)
+		{
+			char spill_file[DEV_NAME_LENGTH];
+
+			snprintf(spill_file, DEV_NAME_LENGTH, "%s/ddprofile.%d.%d", tmp_dir, getpid(), p);
+			if ( (dedups.spill_fd[p] = open(spill_file, O_RDWR|O_CREAT|O_TRUNC|O_LARGEFILE, (mode_t)0600)) == -1 ||
+				(dedups.spill_buf[p] = malloc(DEDUP_SPILL_BUFFER)) == NULL )
+			{
+				dd_log(LOG_ERR, "unable to create dedup partition: %s", spill_file);
+				return -1;
+			}
+			unlink(spill_file);	// gone once closed
+		}
+		if ( dedup_scan(files, nfiles) == -1 )
+			return -1;
+		for (p = 0; p < dedups.partitions; p++)
+		{
+			if ( dedup_spill_flush(p) == -1 || dedup_partition(p, limit_bytes) == -1 )
+				return -1;
+			close(dedups.spill_fd[p]);
+			free(dedups.spill_buf[p]);
+		}
+		free(dedups.spill_fd);
+		free(dedups.spill_buf);
+		free(dedups.spill_used);
+	}
+
+	u_int64_t data = dedups.segments - dedups.zero - dedups.unset;
+	u_int64_t saved = dedups.duplicates * SEGMENT_SIZE;
+	int t;
+
+	if ( json )
+	{
+		fprintf(stdout, "{\n  \"files\": %d,\n  \"segments\": %llu,\n  \"zero_segments\": %llu,\n", nfiles,
+			(long long unsigned)dedups.segments, (long long unsigned)dedups.zero);
+		fprintf(stdout, "  \"unset_segments\": %llu,\n  \"data_segments\": %llu,\n  \"unique_contents\": %llu,\n",
+			(long long unsigned)dedups.unset, (long long unsigned)data, (long long unsigned)dedups.unique);
+		fprintf(stdout, "  \"repeated_contents\": %llu,\n  \"duplicate_segments\": %llu,\n",
+			(long long unsigned)dedups.repeated, (long long unsigned)dedups.duplicates);
+		fprintf(stdout, "  \"shared_contents\": %llu,\n  \"shared_segments\": %llu,\n",
+			(long long unsigned)dedups.shared, (long long unsigned)dedups.shared_segments);
+		fprintf(stdout, "  \"savings_bytes\": %llu,\n  \"top\": [", (long long unsigned)saved);
+		for (t = 0; t < top && dedups.top[t].count; t++)
+			fprintf(stdout, "%s\n    {\"murmur\": \"%08x\", \"crc32\": \"%08x\", \"count\": %u}", t ? "," : "",
+				(u_int32_t)dedups.top[t].key, (u_int32_t)(dedups.top[t].key >> 32), dedups.top[t].count);
+		fprintf(stdout, "\n  ]\n}\n");
+	}
+	else
+	{
+		fprintf(stdout, "segments %llu in %d files\n", (long long unsigned)dedups.segments, nfiles);
+		fprintf(stdout, "zero %llu unset %llu data %llu\n", (long long unsigned)dedups.zero,
+			(long long unsigned)dedups.unset, (long long unsigned)data);
+		fprintf(stdout, "unique contents %llu, repeated %llu\n", (long long unsigned)dedups.unique,
+			(long long unsigned)dedups.repeated);
+		fprintf(stdout, "duplicate segments %llu %.2f%% of data\n", (long long unsigned)dedups.duplicates,
+			data ? 100 * (double)dedups.duplicates / data : 0);
+		fprintf(stdout, "shared between files %llu contents in %llu segments\n",
+			(long long unsigned)dedups.shared, (long long unsigned)dedups.shared_segments);
+		fprintf(stdout, "savings %llu bytes (%.2f GB)\n", (long long unsigned)saved,
+			saved / (double)GIGABYTE_FACTOR);
+		for (t = 0; t < top && dedups.top[t].count; t++)
+			fprintf(stdout, "top %d %08x %08x %u\n", t + 1, (u_int32_t)dedups.top[t].key,
+				(u_int32_t)(dedups.top[t].key >> 32), dedups.top[t].count);
+	}
+	free(dedups.top);
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// summary by default, the per block listing on request
+//-----------------------------------------------------------------------------
+int ddprofile(int runmode, int blocks, int json, int extents, int workers)
+{
+	parms.runmode = runmode;
+
+	u_int64_t check_count = 0;
+
+	//
+	// raw or compact, either way an array of checksums
+	//
+	if ((parms.checksum_array = dd_checksum_load(parms.checksum_file, &check_count)) == NULL )
+	{
+		exit (1);
+	}
 	dd_log(LOG_DEBUG,"checksum array ptr: %p", parms.checksum_array);
 
+	if ( !blocks )
+	{
+		profs.entries = (u_int64_t *)parms.checksum_array;
+		profs.count = check_count;
+		if ( profile_summarize(workers) == -1 )
+			exit (1);
+		profile_print(json, extents);
+		free(profs.gb_data);
+		free(parms.checksum_array);
+		return 0;
+	}
+
 	u_int64_t i;
 	u_int64_t checksum_blank = 0;
-	u_int64_t check_count = parms.mmap_size / sizeof(checksum_struct);
 
 	checksum_struct *checksum_ptr = parms.checksum_array;
 
 	for (i=0; i < check_count; i++) 
 	{
-		if (checksum_ptr->checksum1_murmur == 0x68b3db1f && checksum_ptr->checksum2_crc32 == 0xab54d286) {
+		if (checksum_ptr->checksum1_murmur == ZERO_CHECKSUM1_MURMUR && checksum_ptr->checksum2_crc32 == ZERO_CHECKSUM2_CRC32) {
 			checksum_blank++;
 		}
 		fprintf (stdout, "block %llu/%llu %08x %08x\n", (long long unsigned int)i+1, (long long unsigned int)check_count, checksum_ptr->checksum1_murmur, checksum_ptr->checksum2_crc32);
@@ -80,12 +964,45 @@ int ddprofile(int runmode)
 
 	fprintf (stdout, "blank %llu/%llu %.2f%%\n", (long long unsigned int)checksum_blank, (long long unsigned int)check_count, 100*(float)checksum_blank/check_count);
 
-       	munmap((void*)parms.checksum_array, parms.mmap_size);
-       	close(parms.mmap_fd);
+	free(parms.checksum_array);
 
         return 0;
 }
 //-----------------------------------------------------------------------------
+// convert the checksum file to the raw or compact format
+//-----------------------------------------------------------------------------
+int ddprofile_convert(char *format, char *output_file)
+{
+	u_int64_t segments = 0;
+	int compact;
+
+	if ( strcmp(format, "compact") == 0 )
+		compact = 1;
+	else if ( strcmp(format, "raw") == 0 )
+		compact = 0;
+	else
+	{
+		dd_log(LOG_ERR, "unknown checksum format: %s", format);
+		return -1;
+	}
+
+	if ((parms.checksum_array = dd_checksum_load(parms.checksum_file, &segments)) == NULL )
+	{
+		return -1;
+	}
+	if ( dd_checksum_save(*output_file ? output_file : parms.checksum_file,
+		parms.checksum_array, segments, compact) == -1 )
+	{
+		free(parms.checksum_array);
+		return -1;
+	}
+	free(parms.checksum_array);
+
+	fprintf (stdout, "converted %llu checksums to %s: %llu bytes\n", (long long unsigned int)segments,
+		format, (long long unsigned int)dd_file_size(*output_file ? output_file : parms.checksum_file));
+	return 0;
+}
+//-----------------------------------------------------------------------------
 // help
 //-----------------------------------------------------------------------------
 void usage()
@@ -93,18 +1010,49 @@ void usage()
 	printf(
 "ddprofile by Graham Houston, release date: "RELEASE_DATE"\n"
 "\n"
-"Show the number of blank blocks in a checksum file\n"
+"Summarize a checksum file: zero and data segments, the run length\n"
+"histogram and the data share per GB, or list every block\n"
 "\n"
-"	ddprofile	-c checksum [-v]\n"
+"	ddprofile	-c checksum [-e] [-j] [-w #] [-v]\n"
+"	ddprofile	-c checksum -b [-v]\n"
+"\n"
+"Compare the source checksums with those of a backup site, count the\n"
+"changed segments and write them as a ddmap for ddplus -m\n"
+"\n"
+"	ddprofile	-c checksum -D checksum [-m ddmap [-s source]] [-j] [-w #] [-v]\n"
+"\n"
+"Count duplicate segment contents in one or more checksum files, spilling\n"
+"to partition files when the table exceeds the memory limit\n"
+"\n"
+"	ddprofile	-u -c checksum [checksum ...] [-M MB] [-T dir] [-n #] [-j] [-v]\n"
+"\n"
+"Convert a checksum file between the raw and compact format (in place\n"
+"unless an output file is given)\n"
+"\n"
+"	ddprofile	-c checksum -f <raw|compact> [-o output] [-v]\n"
 "\n"
 "Parameters\n"
-"	-c	checksum file\n"
+"	-b	list the checksums of every block\n"
+"	-c	checksum file (raw or compact)\n"
+"	-D	checksum file of the backup site to compare with\n"
+"	-e	list the zero and data extents (byte offset and length)\n"
+"	-f	convert to the raw or compact format\n"
+"	-j	summary as JSON\n"
+"	-M	memory limit of the dedup table in MB (default 1024)\n"
+"	-m	ddmap file of the changed segments\n"
+"	-n	number of most repeated contents to list (default 10)\n"
+"	-o	output checksum file\n"
+"	-s	source device name recorded in the ddmap header\n"
+"	-T	directory of the dedup partition files (default .)\n"
+"	-u	duplicate content analysis\n"
 "	-v	verbose\n"
+"	-w	summary threads (default: online cpus)\n"
 "\n"
 "Exit codes:\n"
-"	0	successful\n"
+"	0	successful (no changed segments with -D)\n"
 "	1	a runtime error code, unable to complete task (detailed perror\n"
 "		and logical error message are output via stderr)\n"
+"	2	changed segments found with -D\n"
 );
 }
 
@@ -115,6 +1063,15 @@ int main(int argc, char *argv[])
 {
 	int c, errflg;
 	extern char *optarg;
+	char format[16] = "";
+	char output_file[DEV_NAME_LENGTH] = "";
+	char backup_file[DEV_NAME_LENGTH] = "";
+	char map_file[DEV_NAME_LENGTH] = "";
+	char map_name[DEV_NAME_LENGTH] = "";
+	int blocks = 0, json = 0, extents = 0, dedup = 0, top = 10;
+	u_int64_t limit_mb = 1024;
+	char tmp_dir[DEV_NAME_LENGTH] = ".";
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
 
 	dd_log_init("ddprofile");
 	parms.o_direct  = 0;
@@ -122,13 +1079,52 @@ int main(int argc, char *argv[])
 	// parms.zipbuffer = NULL;
 	errflg = 0;
 
-	while ((c = getopt(argc, argv, "a:c:t:x:dvh?")) != -1)
+	while ((c = getopt(argc, argv, "a:c:t:x:f:o:w:D:m:s:M:T:n:bejudvh?")) != -1)
 	{
 		switch (c)
 		{
 			case 'c':
 				strncpy(parms.checksum_file, optarg, DEV_NAME_LENGTH);
 				break;
+			case 'D':
+				strncpy(backup_file, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'm':
+				strncpy(map_file, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 's':
+				strncpy(map_name, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'M':
+				limit_mb = strtoull(optarg, NULL, 10);
+				break;
+			case 'T':
+				strncpy(tmp_dir, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'n':
+				top = atoi(optarg);
+				break;
+			case 'u':
+				dedup = 1;
+				break;
+			case 'f':
+				strncpy(format, optarg, sizeof(format) - 1);
+				break;
+			case 'o':
+				strncpy(output_file, optarg, DEV_NAME_LENGTH - 1);
+				break;
+			case 'b':
+				blocks = 1;
+				break;
+			case 'e':
+				extents = 1;
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				break;
 			case 'v':
 				dd_loglevel_inc();
 				break;
@@ -143,7 +1139,40 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	ddprofile(RUNMODE_SHOW_DELTA);  
+	if ( *format )
+	{
+		if ( ddprofile_convert(format, output_file) == -1 )
+			exit (1);
+		exit (0);
+	}
+
+	if ( dedup )
+	{
+		char *files[argc - optind + 1];
+		int nfiles = 0;
+
+		//
+		// -c and any further checksum files given after the options
+		//
+		files[nfiles++] = parms.checksum_file;
+		while ( optind < argc )
+			files[nfiles++] = argv[optind++];
+		if ( !*parms.checksum_file || top < 0 || limit_mb == 0 ||
+			ddprofile_dedup(files, nfiles, limit_mb, tmp_dir, top, json) == -1 )
+			exit (1);
+		exit (0);
+	}
+
+	if ( *backup_file )
+	{
+		int rc = ddprofile_diff(backup_file, map_file, map_name, json, workers);
+
+		if ( rc == -1 ) exit(1);
+		if ( rc == 1 ) exit(2);
+		exit (0);
+	}
+
+	ddprofile(RUNMODE_SHOW_DELTA, blocks, json, extents, workers);  
 
 	exit (0);
 }
@@ -0,0 +1,106 @@
+#
+# end to end benchmark: ddplus full copy, ddplus delta, ddplus -m and
+# ddcommit apply on generated images, one JSON line per timed step
+#
+# BENCH_MB		image size in MB (256)
+# BENCH_SPARSE		1 creates a sparse image (0)
+# BENCH_PATTERNS	ddgen change patterns (uniform hotspot log zero random)
+# BENCH_CHANGE		percent of the image changed per generation (1)
+# BENCH_WORKERS		worker counts of the full, ddmap and apply steps (1 2 4)
+# BENCH_DROP_CACHES	1 drops the page cache before each step, needs root (0)
+# BENCH_OUT		results file (bench-results.json)
+#
+# The delta step always runs with one worker (ddplus -x is single threaded)
+# and is reported once per pattern.
+#
+MACH=bindir
+BENCH_MB=${BENCH_MB:-256}
+BENCH_SPARSE=${BENCH_SPARSE:-0}
+BENCH_PATTERNS=${BENCH_PATTERNS:-"uniform hotspot log zero random"}
+BENCH_CHANGE=${BENCH_CHANGE:-1}
+BENCH_WORKERS=${BENCH_WORKERS:-"1 2 4"}
+BENCH_DROP_CACHES=${BENCH_DROP_CACHES:-0}
+BENCH_OUT=${BENCH_OUT:-bench-results.json}
+
+B=bench
+LOG=${B}-log
+IMAGE=dense
+SPARSE=
+if [ "${BENCH_SPARSE}" = "1" ]; then
+  IMAGE=sparse
+  SPARSE=-S
+fi
+
+rm -f ${B}-*
+touch ${BENCH_OUT}
+
+#
+# timed <step> <workers> <bytes> <verify file or -> command...
+#
+timed()
+{
+  local step=$1 workers=$2 bytes=$3 verify=$4
+  shift 4
+
+  [ "${BENCH_DROP_CACHES}" = "1" ] && sync && echo 3 > /proc/sys/vm/drop_caches
+  TIMEFORMAT='%3R %3U %3S'
+  T=$( { time "$@" > /dev/null 2>> ${LOG} || echo fail ; } 2>&1 )
+  if [[ "${T}" == *fail* ]]; then
+    echo "${step} (${PATTERN}, ${workers} workers) failed: $*, see ${LOG}"
+    exit 1
+  fi
+
+  [ -f ${B}-delta ] && DELTA_BYTES=$(stat -c %s ${B}-delta)
+
+  VERIFIED=true
+  if [ "${verify}" != "-" ] && ! cmp -s ${B}-src ${verify}; then
+    VERIFIED=false
+  fi
+
+  echo ${T} | awk -v pattern=${PATTERN} -v image=${IMAGE} -v step=${step} -v workers=${workers} \
+    -v source=${SOURCE_BYTES} -v bytes=${bytes} -v delta=${DELTA_BYTES:-0} -v verified=${VERIFIED} \
+    '{ printf("{\"pattern\": \"%s\", \"image\": \"%s\", \"step\": \"%s\", \"workers\": %d, " \
+        "\"source_bytes\": %.0f, \"bytes\": %.0f, \"real_sec\": %.3f, \"user_sec\": %.3f, " \
+        "\"sys_sec\": %.3f, \"cpu_sec\": %.3f, \"mb_per_sec\": %.2f, \"delta_bytes\": %.0f, " \
+        "\"delta_ratio\": %.6f, \"verified\": %s}\n", \
+        pattern, image, step, workers, source, bytes, $1, $2, $3, $2 + $3, \
+        $1 > 0 ? bytes / 1048576 / $1 : 0, delta, delta / source, verified) }' | tee -a ${BENCH_OUT}
+}
+
+../${MACH}/ddgen -f ${B}-base -n ${BENCH_MB} ${SPARSE} >> ${LOG} || exit 1
+SOURCE_BYTES=$(stat -c %s ${B}-base)
+
+for PATTERN in ${BENCH_PATTERNS}; do
+  FIRST=1
+  for W in ${BENCH_WORKERS}; do
+    rm -f ${B}-src* ${B}-chk* ${B}-tgt* ${B}-tchk* ${B}-delta ${B}-map
+    DELTA_BYTES=
+    cp ${B}-base ${B}-src
+
+    timed full ${W} ${SOURCE_BYTES} ${B}-tgt \
+      ../${MACH}/ddplus -s ${B}-src -c ${B}-chk -t ${B}-tgt -w ${W}
+    cp ${B}-chk ${B}-chk.0
+    cp ${B}-chk ${B}-tchk
+    cp ${B}-tgt ${B}-tgt.0
+
+    # the same seed repeats the generation for every worker count
+    SEGMENTS=$(../${MACH}/ddgen -f ${B}-src -p ${PATTERN} -r ${BENCH_CHANGE} -m ${B}-map | awk '{print $(NF-1)}')
+
+    if [ ${FIRST} = 1 ]; then
+      timed delta 1 ${SOURCE_BYTES} - \
+        ../${MACH}/ddplus -s ${B}-src -c ${B}-chk -x ${B}-delta
+    else
+      ../${MACH}/ddplus -s ${B}-src -c ${B}-chk -x ${B}-delta > /dev/null 2>> ${LOG}
+    fi
+    FIRST=0
+    DELTA_BYTES=$(stat -c %s ${B}-delta)
+
+    timed apply ${W} ${DELTA_BYTES} ${B}-tgt \
+      ../${MACH}/ddcommit -a apply -t ${B}-tgt -c ${B}-tchk -x ${B}-delta -w ${W}
+
+    timed ddmap ${W} $((SEGMENTS * 16384)) ${B}-tgt.0 \
+      ../${MACH}/ddplus -s ${B}-src -c ${B}-chk.0 -m ${B}-map -t ${B}-tgt.0 -w ${W}
+  done
+done
+
+rm -f ${B}-base ${B}-src* ${B}-chk* ${B}-tgt* ${B}-tchk* ${B}-delta ${B}-map
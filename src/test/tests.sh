@@ -85,3 +85,320 @@ else
   echo
 fi
 
+
+rm -f ${SRC2} ${SRC2}.chk ${SRC1}.chk
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk -x ${SRC1}.del.r0 2>> ${SRC2}.del.log
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.r0 >> ${SRC2}.del.log
+( dd if=${SRC1} bs=1M count=1; head -c 777 /dev/urandom; dd if=${SRC1} bs=1M skip=1 ) > ${SRC1}.r 2> /dev/null
+mv ${SRC1}.r ${SRC1}
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk -x ${SRC1}.del.r1 -R -z 2>> ${SRC2}.del.log
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.r1 >> ${SRC2}.del.log
+S51=$(md5sum ${SRC1} | awk '{print $1}')
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C51=$(md5sum ${SRC1}.chk | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Rolling Delta Fail"; 
+  exit
+else 
+  echo "Rolling Delta OK"; 
+  echo
+fi
+
+#
+# checksum only (no journal), each 1MB window spans more than a worker
+#
+rm -f ${SRC1}.w ${SRC1}.w.chk ${SRC1}.w.chk.m
+truncate -s 3G ${SRC1}.w
+../${MACH}/ddplus -s ${SRC1}.w -c ${SRC1}.w.chk -w 4 2>> ${SRC2}.del.log
+../${MACH}/ddplus -s ${SRC1}.w -c ${SRC1}.w.chk.m -M 1 -w 4 2>> ${SRC2}.del.log
+C51=$(md5sum ${SRC1}.w.chk | awk '{print $1}')
+C52=$(md5sum ${SRC1}.w.chk.m | awk '{print $1}')
+rm -f ${SRC1}.w ${SRC1}.w.chk ${SRC1}.w.chk.m
+
+if [ "${C51}" != "${C52}" ]; then   
+  echo "Checksum Window Fail"; 
+  exit
+else 
+  echo "Checksum Window OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk ${SRC1}.chk.raw
+../${MACH}/ddplus -s ${SRC1} -t ${SRC2} -c ${SRC2}.chk -C 2>> ${SRC2}.del.log
+../${MACH}/ddprofile -c ${SRC2}.chk -f raw -o ${SRC1}.chk.raw >> ${SRC2}.del.log
+S51=$(md5sum ${SRC1} | awk '{print $1}')
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C51=$(md5sum ${SRC1}.chk | awk '{print $1}')
+C52=$(md5sum ${SRC1}.chk.raw | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Compact Checksum Fail"; 
+  exit
+else 
+  echo "Compact Checksum OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk ${SRC1}.chk.p
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk.p -x ${SRC1}.del.p -z 2>> ${SRC2}.del.log
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.p -w 3 >> ${SRC2}.del.log
+S51=$(md5sum ${SRC1} | awk '{print $1}')
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C51=$(md5sum ${SRC1}.chk.p | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Parallel Apply Fail"; 
+  exit
+else 
+  echo "Parallel Apply OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.p -q 4 >> ${SRC2}.del.log
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Queued Apply Fail"; 
+  exit
+else 
+  echo "Queued Apply OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk
+cat ${SRC1}.del.p | ../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x - >> ${SRC2}.del.log
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Stream Apply Fail"; 
+  exit
+else 
+  echo "Stream Apply OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.p -S 16 -w 2 >> ${SRC2}.del.log
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Sorted Apply Fail"; 
+  exit
+else 
+  echo "Sorted Apply OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.p --checkpoint 1 --resume >> ${SRC2}.del.log
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" -o -f ${SRC1}.del.p.rinfo ]; then   
+  echo "Resume Apply Fail"; 
+  exit
+else 
+  echo "Resume Apply OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk ${SRC1}.chk.q
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk.q -x ${SRC1}.del.q 2>> ${SRC2}.del.log
+timeout 60 ../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.q -q 4 --checkpoint 1 >> ${SRC2}.del.log
+R=$?
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C51=$(md5sum ${SRC1}.chk.q | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+rm -f ${SRC1}.chk.q ${SRC1}.del.q
+
+if [ ${R} != 0 -o "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Queued Checkpoint Fail"; 
+  exit
+else 
+  echo "Queued Checkpoint OK"; 
+  echo
+fi
+
+../${MACH}/ddcommit -a verify -t ${SRC2} -c ${SRC2}.chk -w 2 >> ${SRC2}.del.log
+V1=$?
+cp ${SRC2} ${SRC2}.v
+printf 'X' | dd of=${SRC2}.v bs=1 seek=1000000 conv=notrunc 2> /dev/null
+../${MACH}/ddcommit -a verify -t ${SRC2}.v -c ${SRC2}.chk -w 2 -m ${SRC2}.v.map >> ${SRC2}.del.log
+V2=$?
+rm -f ${SRC2}.v ${SRC2}.v.map
+
+if [ "${V1}" != "0" -o "${V2}" != "2" ]; then   
+  echo "Verify Target Fail"; 
+  exit
+else 
+  echo "Verify Target OK"; 
+  echo
+fi
+
+rm -f ${SRC1}.chk.e ${SRC2} ${SRC2}.chk
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk.e -x ${SRC1}.del.e -E -z 2>> ${SRC2}.del.log
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.e --verify -w 2 >> ${SRC2}.del.log
+S51=$(md5sum ${SRC1} | awk '{print $1}')
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C51=$(md5sum ${SRC1}.chk.e | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Embedded Checksums Fail"; 
+  exit
+else 
+  echo "Embedded Checksums OK"; 
+  echo
+fi
+
+rm -f ${SRC2} ${SRC2}.chk
+../${MACH}/ddcommit -a apply -t ${SRC2} -c ${SRC2}.chk -x ${SRC1}.del.e -d -w 2 >> ${SRC2}.del.log
+S52=$(md5sum ${SRC2} | awk '{print $1}')
+C52=$(md5sum ${SRC2}.chk | awk '{print $1}')
+
+if [ "${S51}" != "${S52}" -o "${C51}" != "${C52}" ]; then   
+  echo "Direct Apply Fail"; 
+  exit
+else 
+  echo "Direct Apply OK"; 
+  echo
+fi
+
+rm -f ${SRC1}.chk.i
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk.i -x ${SRC1}.del.i -I -z 2>> ${SRC2}.del.log
+../${MACH}/ddcommit -a check -x ${SRC1}.del.i -w 2 >> ${SRC2}.del.log
+K1=$?
+cp ${SRC1}.del.i ${SRC1}.del.k
+printf 'X' | dd of=${SRC1}.del.k bs=1 seek=40000 conv=notrunc 2> /dev/null
+../${MACH}/ddcommit -a check -x ${SRC1}.del.k -w 2 >> ${SRC2}.del.log 2>&1
+K2=$?
+rm -f ${SRC1}.del.k
+
+if [ "${K1}" != "0" -o "${K2}" != "2" ]; then   
+  echo "Delta Check Fail"; 
+  exit
+else 
+  echo "Delta Check OK"; 
+  echo
+fi
+
+P1=$(../${MACH}/ddprofile -c ${SRC1}.chk -b | tail -1)
+P2=$(../${MACH}/ddprofile -c ${SRC1}.chk -w 2 | tail -1)
+P3=$(../${MACH}/ddprofile -c ${SRC1}.chk -e | grep -c '^extent')
+P4=$(../${MACH}/ddprofile -c ${SRC1}.chk -j | grep -c '"zero_segments"')
+
+if [ "${P1}" != "${P2}" -o "${P3}" = "0" -o "${P4}" != "1" ]; then   
+  echo "Profile Summary Fail"; 
+  exit
+else 
+  echo "Profile Summary OK"; 
+  echo
+fi
+
+../${MACH}/ddprofile -c ${SRC1}.chk -D ${SRC1}.chk > /dev/null
+D1=$?
+cp ${SRC1}.chk ${SRC1}.chk.d
+printf 'XXXXXXXX' | dd of=${SRC1}.chk.d bs=8 seek=100 conv=notrunc 2> /dev/null
+../${MACH}/ddprofile -c ${SRC1}.chk -D ${SRC1}.chk.d -m ${SRC1}.map -w 2 >> ${SRC2}.del.log
+D2=$?
+../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk.d -m ${SRC1}.map -x ${SRC1}.del.m 2>> ${SRC2}.del.log
+../${MACH}/ddprofile -c ${SRC1}.chk -D ${SRC1}.chk.d > /dev/null
+D3=$?
+rm -f ${SRC1}.map ${SRC1}.chk.d ${SRC1}.del.m
+
+if [ "${D1}" != "0" -o "${D2}" != "2" -o "${D3}" != "0" ]; then   
+  echo "Profile Diff Fail"; 
+  exit
+else 
+  echo "Profile Diff OK"; 
+  echo
+fi
+
+U1=$(../${MACH}/ddprofile -u -c ${SRC1}.chk ${SRC2}.chk | md5sum)
+U2=$(../${MACH}/ddprofile -u -c ${SRC1}.chk ${SRC2}.chk -M 1 | md5sum)
+U3=$(../${MACH}/ddprofile -u -c ${SRC1}.chk ${SRC2}.chk | grep -c "^shared between files 0 ")
+
+if [ "${U1}" != "${U2}" -o "${U3}" != "0" ]; then   
+  echo "Profile Dedup Fail"; 
+  exit
+else 
+  echo "Profile Dedup OK"; 
+  echo
+fi
+
+C61=$(md5sum ${SRC1}.chk | awk '{print $1}')
+E1=$(../${MACH}/ddplus -s ${SRC1} -c ${SRC1}.chk -e 1000 -w 2 2>> ${SRC2}.del.log | grep -c "^Changed samples:    0$")
+C62=$(md5sum ${SRC1}.chk | awk '{print $1}')
+
+if [ "${E1}" != "1" -o "${C61}" != "${C62}" ]; then   
+  echo "Estimate Delta Fail"; 
+  exit
+else 
+  echo "Estimate Delta OK"; 
+  echo
+fi
+
+rm -f ${SRC2}.chk.t ${SRC1}.stats.*
+../${MACH}/ddplus -s ${SRC1} -c ${SRC2}.chk.t -x ${SRC1}.del.t -z -T ${SRC1}.stats.plus 2>> ${SRC2}.del.log
+../${MACH}/ddcommit -a check -x ${SRC1}.del.t -T ${SRC1}.stats.commit >> ${SRC2}.del.log
+T1=$(grep -c '"program": "ddplus"' ${SRC1}.stats.plus.json)
+T2=$(grep -c '^ddless_phase_seconds_count{program="ddplus",phase="read"} [1-9]' ${SRC1}.stats.plus.prom)
+T3=$(grep -c '^ddless_running{program="ddcommit"} 0$' ${SRC1}.stats.commit.prom)
+rm -f ${SRC2}.chk.t* ${SRC1}.del.t ${SRC1}.stats.*
+
+if [ "${T1}" != "1" -o "${T2}" != "1" -o "${T3}" != "1" ]; then   
+  echo "Phase Stats Fail"; 
+  exit
+else 
+  echo "Phase Stats OK"; 
+  echo
+fi
+
+rm -f ${SRC2}.chk.t
+DDLESS_LOG=async,json ../${MACH}/ddplus -s ${SRC1} -c ${SRC2}.chk.t -w 2 -v > ${SRC1}.log.t 2>&1
+T1=$(grep -c '"level": "info"' ${SRC1}.log.t)
+T2=$(grep -c '^ddless' ${SRC1}.log.t)
+rm -f ${SRC2}.chk.t ${SRC1}.log.t
+
+if [ "${T1}" = "0" -o "${T2}" != "0" ]; then   
+  echo "Async Log Fail"; 
+  exit
+else 
+  echo "Async Log OK"; 
+  echo
+fi
+
+rm -f ${SRC2}.chk.t ${SRC2}.chk.t.stats
+../${MACH}/ddplus -s ${SRC1} -c ${SRC2}.chk.t -t ${SRC2}.t > /dev/null 2>&1
+../${MACH}/ddplus -s ${SRC1} -c ${SRC2}.chk.t -t ${SRC2}.t > /dev/null 2>&1
+T1=$(grep -c '^{"version": 2, .*"changed_segments": 0, .*"region_changed": \[0' ${SRC2}.chk.t.stats)
+rm -f ${SRC2}.chk.t ${SRC2}.chk.t.stats ${SRC2}.t
+
+if [ "${T1}" != "1" ]; then   
+  echo "Stats Record Fail"; 
+  exit
+else 
+  echo "Stats Record OK"; 
+  echo
+fi
+
+rm -f ${SRC1}.zone.t*
+../${MACH}/ddplus -s ${SRC1} -Z ${SRC1}.zone.t.csv -q 1,4 -B 16 -P rand -N 2 -S 0.2 > ${SRC1}.zone.t
+T1=$(grep -c '^buffered rand ' ${SRC1}.zone.t)
+T2=$(grep -c '^buffered,rand,16384,[14],[01],' ${SRC1}.zone.t.csv)
+rm -f ${SRC1}.zone.t*
+
+if [ "${T1}" = "0" -o "${T2}" != "$((2 * T1))" ]; then   
+  echo "Zone Profile Fail"; 
+  exit
+else 
+  echo "Zone Profile OK"; 
+  echo
+fi